@@ -0,0 +1,169 @@
+/**
+ * The geometry of a multipolygon relation is a set of polygons, each with
+ * an outer ring and any number of inner rings. Like the WayGeometry it is
+ * kept as plain lists of coordinates, so it can be written to the database
+ * as EWKB and compared to the geometry of the minor version before it
+ * without building a geos geometry, see RowBuffer::addAreaGeometry.
+ *
+ * The coordinates of all rings are stored one after another, the rings
+ * and the polygons are described by the positions where they end:
+ *
+ *   x, y:         | outer 1 | inner 1.1 | inner 1.2 | outer 2 |
+ *   ringEnds:               ^           ^           ^         ^
+ *   polygonEnds:                                    ^         ^
+ */
+
+#ifndef IMPORTER_AREAGEOMETRY_HPP
+#define IMPORTER_AREAGEOMETRY_HPP
+
+#include <math.h>
+#include <vector>
+
+/**
+ * The rings of a multipolygon
+ */
+class AreaGeometry {
+public:
+    /**
+     * the coordinates of all rings, the first and the last coordinate of
+     * each ring are equal
+     */
+    std::vector<double> x, y;
+
+    /**
+     * the index in x and y behind the last coordinate of each ring
+     */
+    std::vector<size_t> ringEnds;
+
+    /**
+     * the index in ringEnds behind the last ring of each polygon, the
+     * first ring of a polygon is its outer ring
+     */
+    std::vector<size_t> polygonEnds;
+
+    AreaGeometry() : x(), y(), ringEnds(), polygonEnds() {}
+
+    size_t size() const {
+        return x.size();
+    }
+
+    size_t polygons() const {
+        return polygonEnds.size();
+    }
+
+    /**
+     * remove all coordinates, keeping the allocated memory
+     */
+    void clear() {
+        x.clear();
+        y.clear();
+        ringEnds.clear();
+        polygonEnds.clear();
+    }
+
+    /**
+     * append a ring with count coordinates to the current polygon
+     */
+    void addRing(const double *rx, const double *ry, size_t count) {
+        x.insert(x.end(), rx, rx + count);
+        y.insert(y.end(), ry, ry + count);
+        ringEnds.push_back(x.size());
+    }
+
+    /**
+     * close the current polygon, the next ring is the outer ring of the
+     * next polygon
+     */
+    void endPolygon() {
+        polygonEnds.push_back(ringEnds.size());
+    }
+
+    /**
+     * the index in x and y of the first coordinate of ring r
+     */
+    size_t ringBegin(size_t r) const {
+        return r == 0 ? 0 : ringEnds[r - 1];
+    }
+
+    /**
+     * the index in ringEnds of the outer ring of polygon p
+     */
+    size_t polygonBegin(size_t p) const {
+        return p == 0 ? 0 : polygonEnds[p - 1];
+    }
+
+    /**
+     * have both geometries exactly the same rings?
+     */
+    bool equals(const AreaGeometry &other) const {
+        return polygonEnds == other.polygonEnds && ringEnds == other.ringEnds && x == other.x && y == other.y;
+    }
+
+    /**
+     * the area of count coordinates of a ring, calculated with the
+     * shoelace formula like WayGeometry::area
+     */
+    static double ringArea(const double *x, const double *y, size_t count) {
+        if(count < 4) {
+            return 0;
+        }
+
+        double sum = 0;
+        double x0 = x[0];
+        for(size_t i = 1; i < count - 1; i++) {
+            sum += (x[i] - x0) * (y[i - 1] - y[i + 1]);
+        }
+        return fabs(sum / 2);
+    }
+
+    /**
+     * the area of the outer rings without the area of the inner rings
+     */
+    double area() const {
+        double sum = 0;
+        for(size_t p = 0; p < polygons(); p++) {
+            for(size_t r = polygonBegin(p); r < polygonEnds[p]; r++) {
+                size_t begin = ringBegin(r);
+                double a = ringArea(&x[begin], &y[begin], ringEnds[r] - begin);
+                sum += (r == polygonBegin(p)) ? a : -a;
+            }
+        }
+        return sum;
+    }
+
+    /**
+     * build a geos multipolygon with the given srid, the caller owns it
+     */
+    geos::geom::Geometry* toGeos(int srid) const {
+        geos::geom::GeometryFactory *f = Osmium::Geometry::geos_geometry_factory();
+
+        std::vector<geos::geom::Geometry*> *polygons = new std::vector<geos::geom::Geometry*>();
+        for(size_t p = 0; p < this->polygons(); p++) {
+            geos::geom::LinearRing *shell = NULL;
+            std::vector<geos::geom::Geometry*> *holes = new std::vector<geos::geom::Geometry*>();
+
+            for(size_t r = polygonBegin(p); r < polygonEnds[p]; r++) {
+                std::vector<geos::geom::Coordinate> *c = new std::vector<geos::geom::Coordinate>();
+                c->reserve(ringEnds[r] - ringBegin(r));
+                for(size_t i = ringBegin(r); i < ringEnds[r]; i++) {
+                    c->push_back(geos::geom::Coordinate(x[i], y[i], DoubleNotANumber));
+                }
+
+                geos::geom::LinearRing *ring = f->createLinearRing(f->getCoordinateSequenceFactory()->create(c));
+                if(!shell) {
+                    shell = ring;
+                } else {
+                    holes->push_back(ring);
+                }
+            }
+
+            polygons->push_back(f->createPolygon(shell, holes));
+        }
+
+        geos::geom::Geometry* geom = f->createMultiPolygon(polygons);
+        geom->setSRID(srid);
+        return geom;
+    }
+};
+
+#endif // IMPORTER_AREAGEOMETRY_HPP
@@ -0,0 +1,111 @@
+/**
+ * osm-history-render importer - id index benchmark
+ *
+ * fills the sparse nodestore with the same synthetic node histories, once
+ * with the sparsetable id index and once with the dense id index, and
+ * measures random lookups of the version valid at a time. The stl nodestore
+ * is measured as well for reference.
+ *
+ *   make benchmark-idindex
+ *   ./benchmark-idindex [NODES [VERSIONS [LOOKUPS [IDSTEP]]]]
+ *
+ * IDSTEP is the distance between two node ids, 1 is a planet where nearly
+ * all ids are used, larger steps are extracts.
+ */
+
+#include <sys/time.h>
+#include <stdlib.h>
+
+#define OSMIUM_MAIN
+#include <osmium.hpp>
+
+#include "nodestore.hpp"
+#include "nodestore/stl.hpp"
+#include "nodestore/sparse.hpp"
+
+/**
+ * the first timestamp of the synthetic histories, 2006-01-01
+ */
+static const time_t START = 1136073600;
+
+/**
+ * the time between two versions of a node
+ */
+static const time_t STEP = 86400;
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * a xorshift generator, so every store is asked for the same nodes
+ */
+static uint64_t nextRandom(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static void run(const char *name, Nodestore *store, long nodes, long versions, long lookups, long idstep) {
+    store->printDebugMessages(false);
+    store->printStoreErrors(false);
+
+    double start = now();
+    for(long i = 0; i < nodes; i++) {
+        osm_object_id_t id = 1 + i * idstep;
+        for(long v = 0; v < versions; v++) {
+            store->record(id, 1 + i % 1000, START + v * STEP + i % STEP, (i % 3600) / 10.0 - 180, (i % 1700) / 10.0 - 85);
+        }
+    }
+    double filled = now() - start;
+
+    uint64_t state = 2463534242UL;
+    long found = 0;
+    double checksum = 0;
+
+    start = now();
+    for(long i = 0; i < lookups; i++) {
+        uint64_t r = nextRandom(state);
+        osm_object_id_t id = 1 + static_cast< osm_object_id_t >(r % nodes) * idstep;
+        time_t t = START + static_cast< time_t >((r >> 32) % (versions * STEP));
+
+        bool ok;
+        Nodestore::Nodeinfo info = store->lookup(id, t, ok);
+        if(ok) {
+            found++;
+            checksum += info.lat;
+        }
+    }
+    double looked = now() - start;
+
+    std::cout << std::left << std::setw(14) << name
+        << std::right << std::fixed << std::setprecision(1)
+        << std::setw(10) << filled * 1e9 / (nodes * versions) << " ns/record"
+        << std::setw(10) << looked * 1e9 / lookups << " ns/lookup"
+        << "  (" << found << " found, checksum " << std::setprecision(0) << checksum << ")" << std::endl;
+
+    delete store;
+}
+
+int main(int argc, char *argv[]) {
+    long nodes = argc > 1 ? atol(argv[1]) : 10000000;
+    long versions = argc > 2 ? atol(argv[2]) : 3;
+    long lookups = argc > 3 ? atol(argv[3]) : 10000000;
+    long idstep = argc > 4 ? atol(argv[4]) : 1;
+
+    if(nodes < 1 || versions < 1 || lookups < 1 || idstep < 1) {
+        std::cerr << "Usage: " << argv[0] << " [NODES [VERSIONS [LOOKUPS [IDSTEP]]]]" << std::endl;
+        return 1;
+    }
+
+    std::cout << nodes << " nodes with " << versions << " versions, every " << idstep << ". id, " << lookups << " random lookups" << std::endl;
+
+    run("stl", new NodestoreStl(), nodes, versions, lookups, idstep);
+    run("sparse index", new NodestoreSparse(false, false), nodes, versions, lookups, idstep);
+    run("dense index", new NodestoreSparse(true, false), nodes, versions, lookups, idstep);
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * osm-history-render importer - row buffer benchmark
+ *
+ * encodes point rows like the importer does for its nodes, once in text and
+ * once in binary format, and measures the time per row and counts the heap
+ * allocations. Then the rows are sent through a COPY pipe into a compressed
+ * file in /dev/null, so the queue of the pipe and its writer thread are
+ * counted as well. After the buffers and the queue have been filled once,
+ * there should be no allocations left.
+ *
+ *   make benchmark-rowbuffer
+ *   ./benchmark-rowbuffer [ROWS]
+ */
+
+#include <sys/time.h>
+#include <stdlib.h>
+
+#define OSMIUM_MAIN
+#include <osmium.hpp>
+#include <osmium/geometry/geos.hpp>
+
+#include "rowbuffer.hpp"
+
+/**
+ * number of heap allocations in all threads, operator new of the c++
+ * library allocates through malloc as well
+ */
+static volatile size_t allocations = 0;
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+extern "C" void* malloc(size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __libc_realloc(ptr, size);
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * encode a row of the point table, like ImportHandler::write_node
+ */
+static void writeRow(RowBuffer& rows, long i, const Osmium::OSM::TagList& tags) {
+    rows.beginRow(9);
+    rows.addInt64(i);
+    rows.addInt16(1 + i % 5);
+    rows.addBool(true);
+    rows.addInt32(i % 100000);
+    rows.addText(i % 2 ? "MaZderMind" : "user\twith\\escapes");
+    rows.addTimestamp(1136073600 + i * 7);
+    if(i % 3) {
+        rows.addTimestamp(1136073600 + i * 11);
+    } else {
+        rows.addNull();
+    }
+    rows.addHStore(tags);
+    rows.addPoint(i % 20037508, i % 19971868, 900913);
+    rows.endRow();
+}
+
+/**
+ * encode count rows into a buffer, that is cleared like the buffer of a
+ * pipe is flushed, and return the seconds it took
+ */
+static double encode(bool binary, long count, const Osmium::OSM::TagList& tags, size_t& allocated) {
+    RowBuffer rows(NULL);
+    rows.binary(binary);
+
+    // let the buffer reach its size once
+    for(long i = 0; i < 1000; i++) {
+        writeRow(rows, i, tags);
+    }
+    rows.clear();
+
+    size_t before = allocations;
+    double start = now();
+    for(long i = 0; i < count; i++) {
+        writeRow(rows, i, tags);
+        if(rows.size() >= 64 * 1024) {
+            rows.clear();
+        }
+    }
+    double seconds = now() - start;
+    allocated = allocations - before;
+    return seconds;
+}
+
+/**
+ * send count rows through a COPY pipe into a compressed file in /dev/null
+ * and return the number of allocations
+ */
+static size_t sendThroughPipe(bool binary, long count, const Osmium::OSM::TagList& tags) {
+    DbCopyConn conn;
+    conn.openFile("/dev/null", binary);
+
+    RowBuffer rows(&conn);
+    rows.binary(binary);
+
+    // fill the buffers and the queue of the pipe once
+    for(long i = 0; i < 100000; i++) {
+        writeRow(rows, i, tags);
+    }
+
+    size_t before = allocations;
+    for(long i = 0; i < count; i++) {
+        writeRow(rows, i, tags);
+    }
+    size_t allocated = allocations - before;
+
+    rows.flush();
+    conn.close();
+    return allocated;
+}
+
+static void run(bool binary, long count, const Osmium::OSM::TagList& tags) {
+    size_t encoded;
+    double seconds = encode(binary, count, tags, encoded);
+    size_t piped = sendThroughPipe(binary, count, tags);
+
+    std::cout << std::left << std::setw(8) << (binary ? "binary" : "text")
+        << std::right << std::fixed << std::setprecision(1)
+        << std::setw(8) << seconds * 1e9 / count << " ns/row, "
+        << encoded << " allocations while encoding, "
+        << piped << " allocations through the pipe in " << count << " rows" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 5000000;
+    if(count < 1) {
+        std::cerr << "Usage: " << argv[0] << " [ROWS]" << std::endl;
+        return 1;
+    }
+
+    Osmium::OSM::TagList tags;
+    tags.add("highway", "bus_stop");
+    tags.add("name", "Hauptbahnhof \"Süd\"");
+    tags.add("shelter", "yes");
+
+    run(false, count, tags);
+    run(true, count, tags);
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+/**
+ * osm-history-render importer - timestamp benchmark
+ *
+ * checks that Timestamp::format and Timestamp::Cache write the same strings
+ * as gmtime_r and strftime for random and for edge case times, and then
+ * measures all three over a sequence of times like the one of the rows of
+ * a history file, where many rows share their changeset and their day.
+ *
+ *   make benchmark-timestamp
+ *   ./benchmark-timestamp [TIMES]
+ */
+
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "timestamp.hpp"
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * a xorshift generator, so every run sees the same times
+ */
+static uint64_t nextRandom(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static size_t formatStrftime(char *buffer, time_t time) {
+    struct tm tm;
+    gmtime_r(&time, &tm);
+    return strftime(buffer, Timestamp::buffer_length, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+/**
+ * compare the formatters with strftime, returns the number of differences
+ */
+static long check(const std::vector<time_t>& times) {
+    Timestamp::Cache cache;
+    long differences = 0;
+
+    for(size_t i = 0; i < times.size(); i++) {
+        char expected[Timestamp::buffer_length], formatted[Timestamp::buffer_length], cached[Timestamp::buffer_length];
+        size_t len = formatStrftime(expected, times[i]);
+
+        if(Timestamp::format(formatted, times[i]) != len || memcmp(expected, formatted, len) != 0 ||
+           cache.format(cached, times[i]) != len || memcmp(expected, cached, len) != 0) {
+            if(differences < 10) {
+                std::cerr << "difference at " << times[i] << ": " << expected << std::endl;
+            }
+            differences++;
+        }
+    }
+
+    return differences;
+}
+
+template <class TFormatter>
+static void run(const char *name, TFormatter format, const std::vector<time_t>& times) {
+    char buffer[Timestamp::buffer_length];
+    size_t sum = 0;
+
+    double start = now();
+    for(size_t i = 0; i < times.size(); i++) {
+        sum += format(buffer, times[i]);
+        sum += buffer[18];
+    }
+    double seconds = now() - start;
+
+    std::cout << std::left << std::setw(18) << name
+        << std::right << std::fixed << std::setprecision(1)
+        << std::setw(8) << seconds * 1e9 / times.size() << " ns/timestamp"
+        << "  (checksum " << sum << ")" << std::endl;
+}
+
+static size_t formatDirect(char *buffer, time_t time) {
+    return Timestamp::format(buffer, time);
+}
+
+static Timestamp::Cache benchmarkCache;
+
+static size_t formatCached(char *buffer, time_t time) {
+    return benchmarkCache.format(buffer, time);
+}
+
+int main(int argc, char *argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 5000000;
+    if(count < 1) {
+        std::cerr << "Usage: " << argv[0] << " [TIMES]" << std::endl;
+        return 1;
+    }
+
+    uint64_t state = 2463534242UL;
+
+    // random times between 1970 and 2038, and the edges of days, months,
+    // leap years and of the years with 4 digits
+    std::vector<time_t> samples;
+    samples.reserve(count + 16);
+    for(long i = 0; i < count; i++) {
+        samples.push_back(static_cast< time_t >(nextRandom(state) % 2147483648UL));
+    }
+    time_t edges[] = {0, 1, 59, 86399, 86400, 951782399, 951782400, 951868799, 951868800, 4107542399L, 4107542400L, 253402300799L, 253402300800L, -1, -62135596800L, -62135596801L};
+    for(size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+        if(sizeof(time_t) > 4 || (edges[i] >= -2147483647L && edges[i] <= 2147483647L)) {
+            samples.push_back(edges[i]);
+        }
+    }
+
+    long differences = check(samples);
+    std::cout << "compared " << samples.size() << " times with strftime: " << differences << " differences" << std::endl;
+
+    // the rows of a changeset share their time, changesets follow each
+    // other within minutes
+    std::vector<time_t> history;
+    history.reserve(count);
+    time_t t = 1136073600;
+    for(long i = 0; i < count; i++) {
+        uint64_t r = nextRandom(state);
+        if(r % 8 == 0) {
+            t += r % 600;
+        }
+        history.push_back(t);
+    }
+
+    if(check(history) > 0) {
+        differences++;
+    }
+
+    run("strftime", formatStrftime, history);
+    run("Timestamp::format", formatDirect, history);
+    run("Timestamp::Cache", formatCached, history);
+
+    return differences > 0 ? 1 : 0;
+}
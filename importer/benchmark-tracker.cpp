@@ -0,0 +1,144 @@
+/**
+ * osm-history-render importer - entity tracker benchmark
+ *
+ * runs the pattern of the node phase of the handler, feed, the accessors
+ * used by write_node and swap, over pre-allocated nodes, once with the
+ * EntityTracker and once with the tracker it replaced, which shifted three
+ * shared_ptrs and returned copies of them. Reading and storing the nodes
+ * is not part of it, so this is the overhead of tracking a node.
+ *
+ *   make benchmark-tracker
+ *   ./benchmark-tracker [NODES [ROUNDS]]
+ */
+
+#include <sys/time.h>
+#include <stdlib.h>
+
+#define OSMIUM_MAIN
+#include <osmium.hpp>
+
+#include "entitytracker.hpp"
+
+/**
+ * the EntityTracker before it kept its entities in a ring
+ */
+template <class TObject>
+class ShiftingTracker {
+private:
+    shared_ptr<TObject const> m_prev, m_cur, m_next;
+
+public:
+    const shared_ptr<TObject const> prev() {
+        return m_prev;
+    }
+
+    const shared_ptr<TObject const> cur() {
+        return m_cur;
+    }
+
+    const shared_ptr<TObject const> next() {
+        return m_next;
+    }
+
+    bool has_prev() {
+        return static_cast<bool>(m_prev);
+    }
+
+    bool has_cur() {
+        return static_cast<bool>(m_cur);
+    }
+
+    bool has_next() {
+        return static_cast<bool>(m_next);
+    }
+
+    bool next_is_same_entity() {
+        return has_cur() && has_next() && (cur()->id() == next()->id());
+    }
+
+    void feed(const shared_ptr<TObject const> obj) {
+        m_next = obj;
+    }
+
+    void swap() {
+        m_prev = m_cur;
+        m_cur = m_next;
+        m_next.reset();
+    }
+};
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * what write_node asks the tracker
+ */
+template <class TTracker>
+static long writeNode(TTracker& tracker) {
+    const shared_ptr<Osmium::OSM::Node const>& next = tracker.next();
+    const shared_ptr<Osmium::OSM::Node const>& cur = tracker.cur();
+
+    long sum = cur->id();
+    if(tracker.has_prev() && tracker.prev()->id() == cur->id()) {
+        sum++;
+    }
+    if(tracker.next_is_same_entity()) {
+        sum += next->timestamp();
+    }
+    return sum;
+}
+
+template <class TTracker>
+static void run(const char *name, const std::vector< shared_ptr<Osmium::OSM::Node const> >& nodes, long rounds) {
+    long sum = 0;
+    double start = now();
+
+    for(long r = 0; r < rounds; r++) {
+        TTracker tracker;
+        for(size_t i = 0; i < nodes.size(); i++) {
+            tracker.feed(nodes[i]);
+            if(tracker.has_cur()) {
+                sum += writeNode(tracker);
+            }
+            tracker.swap();
+        }
+        if(tracker.has_cur()) {
+            sum += writeNode(tracker);
+        }
+        tracker.swap();
+    }
+
+    double seconds = now() - start;
+    std::cout << std::left << std::setw(18) << name
+        << std::right << std::fixed << std::setprecision(1)
+        << std::setw(8) << seconds * 1e9 / (nodes.size() * rounds) << " ns/node"
+        << "  (checksum " << sum << ")" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 2000000;
+    long rounds = argc > 2 ? atol(argv[2]) : 5;
+    if(count < 1 || rounds < 1) {
+        std::cerr << "Usage: " << argv[0] << " [NODES [ROUNDS]]" << std::endl;
+        return 1;
+    }
+
+    // three versions per node
+    std::vector< shared_ptr<Osmium::OSM::Node const> > nodes;
+    nodes.reserve(count);
+    for(long i = 0; i < count; i++) {
+        shared_ptr<Osmium::OSM::Node> node(new Osmium::OSM::Node());
+        node->id(1 + i / 3);
+        node->version(1 + i % 3);
+        node->timestamp(1136073600 + i);
+        nodes.push_back(node);
+    }
+
+    run< ShiftingTracker<Osmium::OSM::Node> >("shifting tracker", nodes, rounds);
+    run< EntityTracker<Osmium::OSM::Node> >("EntityTracker", nodes, rounds);
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/**
+ * An import of a full history runs for days. To not start over when it is
+ * aborted, the importer can take checkpoints: the COPY pipes commit the
+ * rows written so far and the position of the import, the type and id of
+ * the last entity whose versions have all been written, is saved into the
+ * checkpoint file. A resumed import reads the input from the start again,
+ * the entities up to the position only go into the nodestore, the username
+ * map and the waystore, without building their geometries or writing
+ * their rows.
+ */
+
+#ifndef IMPORTER_CHECKPOINT_HPP
+#define IMPORTER_CHECKPOINT_HPP
+
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+class Checkpoint {
+private:
+    osm_object_type_t m_type;
+    osm_object_id_t m_id;
+
+    static const char* typeToText(osm_object_type_t type) {
+        switch(type) {
+            case NODE: return "node";
+            case WAY: return "way";
+            case RELATION: return "relation";
+            default: return "none";
+        }
+    }
+
+    static osm_object_type_t textToType(const std::string& text) {
+        if(text == "node") return NODE;
+        if(text == "way") return WAY;
+        if(text == "relation") return RELATION;
+        return UNKNOWN;
+    }
+
+public:
+    /**
+     * a checkpoint before the first entity
+     */
+    Checkpoint() : m_type(UNKNOWN), m_id(0) {}
+
+    Checkpoint(osm_object_type_t type, osm_object_id_t id) : m_type(type), m_id(id) {}
+
+    osm_object_type_t type() const {
+        return m_type;
+    }
+
+    osm_object_id_t id() const {
+        return m_id;
+    }
+
+    /**
+     * have the rows of this entity been written before the checkpoint?
+     */
+    bool covers(osm_object_type_t type, osm_object_id_t id) const {
+        if(m_type == UNKNOWN) return false;
+        return type < m_type || (type == m_type && id <= m_id);
+    }
+
+    std::string toString() const {
+        std::ostringstream out;
+        out << typeToText(m_type) << ' ' << m_id;
+        return out.str();
+    }
+
+    /**
+     * read the checkpoint from the file at path
+     */
+    void read(const std::string& path) {
+        std::ifstream in(path.c_str());
+        if(!in)
+            throw std::runtime_error("can't read checkpoint file " + path);
+
+        std::string type;
+        if(!(in >> type >> m_id) || (m_type = textToType(type)) == UNKNOWN)
+            throw std::runtime_error("invalid checkpoint file " + path);
+    }
+
+    /**
+     * write the checkpoint into the file at path, it's written next to it
+     * and renamed, so an abort while writing keeps the last checkpoint
+     */
+    void write(const std::string& path) const {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp.c_str());
+            out << toString() << std::endl;
+            if(!out)
+                throw std::runtime_error("can't write checkpoint file " + tmp);
+        }
+
+        if(rename(tmp.c_str(), path.c_str()) != 0)
+            throw std::runtime_error("can't rename checkpoint file " + tmp + " to " + path);
+    }
+};
+
+#endif // IMPORTER_CHECKPOINT_HPP
@@ -11,5 +11,9 @@ echo 'select id,version,visible,valid_from,valid_to,ST_AsText(geom) from hist_po
 ./osm-history-importer --nodestore sparse --latlng $IN
 echo 'select id,version,visible,valid_from,valid_to,ST_AsText(geom) from hist_point; select id,version,minor,visible,valid_from,valid_to,ST_NumPoints(geom) from hist_line;' | psql > sparse.out
 
+./osm-history-importer --nodestore mmap --mmap-dir /tmp --latlng $IN
+echo 'select id,version,visible,valid_from,valid_to,ST_AsText(geom) from hist_point; select id,version,minor,visible,valid_from,valid_to,ST_NumPoints(geom) from hist_line;' | psql > mmap.out
+
 
 diff stl.out sparse.out
+diff stl.out mmap.out
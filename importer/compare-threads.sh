@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# import every test file once with a single thread and once with THREADS
+# threads building the geometries, and compare the rows that were written.
+# The worker threads must not change a single byte of the COPY data.
+#
+# the rows are written into dumps (--output-dir), so no database is needed
+#
+THREADS=${1:-4}
+
+OUT=`mktemp -d`
+trap 'rm -rf "$OUT"' EXIT
+
+make all || exit 1
+
+FAILED=0
+for IN in test/*.osh; do
+    for FORMAT in text binary; do
+        for T in 1 $THREADS; do
+            rm -rf "$OUT/$T"
+            if ! ./osm-history-importer --multipolygons --copy-format $FORMAT --threads $T --output-dir "$OUT/$T" "$IN" >"$OUT/$T.log" 2>&1; then
+                echo "$IN ($FORMAT): import with $T threads failed, see:"
+                cat "$OUT/$T.log"
+                FAILED=1
+                continue 2
+            fi
+        done
+
+        RESULT=identical
+        if ! cmp -s "$OUT/1/manifest" "$OUT/$THREADS/manifest"; then
+            RESULT="different files"
+        else
+            for FILE in `awk -F '\t' '$1 == "copy" { print $3 }' "$OUT/1/manifest"`; do
+                gzip -dc "$OUT/1/$FILE" >"$OUT/serial"
+                gzip -dc "$OUT/$THREADS/$FILE" >"$OUT/threaded"
+                if ! cmp -s "$OUT/serial" "$OUT/threaded"; then
+                    RESULT="$FILE differs"
+                fi
+            done
+        fi
+
+        echo "$IN ($FORMAT): $RESULT"
+        if [ "$RESULT" != identical ]; then
+            FAILED=1
+        fi
+    done
+done
+
+exit $FAILED
@@ -1,16 +1,424 @@
 /**
- * The importer populates a postgres-database. This class controls a
- * connection to the database.
+ * The importer populates a postgres-database. In update mode it also
+ * needs to read from it and to change rows that are already there. This
+ * class controls the connection used for that.
+ *
+ * All statements are prepared once and work on batches of ids, which are
+ * passed as arrays, so a change file with thousands of entities needs
+ * only a few round trips to the server:
+ *
+ *  - the rows that were open until now (valid_to IS NULL) are closed at
+ *    the time of the first new version of their entity
+ *  - the ways whose current version contains a changed node are found
+ *    through the node lists in the way table, which the import only
+ *    writes with --keep-way-nodes
+ *  - the current versions of these ways and the complete histories of
+ *    their nodes are read back into the importer, so their geometries
+ *    and minor versions can be built again
+ *  - the rows of the rebuilt way versions are deleted
+ *
+ * Timestamps are passed as seconds since the epoch and converted on the
+ * server, so only arrays of numbers need to be formatted.
+ *
+ * The closes and deletes must only become visible together with the rows
+ * replacing them, but those are sent through the COPY pipes, each with a
+ * connection and a transaction of its own. So in update mode the pipes
+ * copy into staging tables, and all statements of the adapter run in one
+ * transaction, which finally moves the staged rows into the tables and
+ * commits after the pipes have committed. An abort before leaves the
+ * tables as they were. The staging tables can't be left out by keeping
+ * the transaction of the adapter open until the pipes committed: the
+ * rows of the rebuilt way versions have the keys of the deleted rows, so
+ * the pipes would wait for the adapter and the adapter for the pipes.
+ *
+ * There is no cache in front of the statements reading the histories of
+ * the nodes: the nodes of all ways to rebuild are collected first and the
+ * history of each of them is read exactly once into the nodestore, which
+ * keeps them for the rest of the run, so a cache would never be hit.
  */
 
 #ifndef IMPORTER_DBADAPTER_HPP
 #define IMPORTER_DBADAPTER_HPP
 
+#include <stdlib.h>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "dbconn.hpp"
+#include "nodestore.hpp"
+
 /**
- * Controls a connection to the database
+ * Controls a connection to the database for the update mode
  */
-class DbAdapter {
-    
+class DbAdapter : public DbConn {
+private:
+    /**
+     * number of ids passed to one execution of a statement
+     */
+    static const size_t BATCH_SIZE = 1024;
+
+    typedef std::pair< osm_object_id_t, time_t > closing_t;
+    typedef std::pair< osm_object_id_t, osm_version_t > version_t;
+
+    /**
+     * the rows waiting to be closed or deleted
+     */
+    std::vector< closing_t > m_closeNodes, m_closeWays;
+    std::vector< version_t > m_deleteWays;
+
+    /**
+     * the parameters of the statement that is currently executed
+     */
+    std::string m_param[2];
+
+    std::string m_prefix;
+
+    /**
+     * the number of tables and their names, without the prefix
+     */
+    static const size_t TABLE_COUNT = 4;
+
+    static const char* table(size_t i) {
+        static const char *tables[TABLE_COUNT] = {"point", "line", "polygon", "way"};
+        return tables[i];
+    }
+
+    void prepare(const char *name, const std::string &sql, int params) {
+        PGresult *res = PQprepare(conn, name, sql.c_str(), params, NULL);
+
+        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+            std::cerr << PQresultErrorMessage(res) << std::endl;
+            PQclear(res);
+            throw std::runtime_error("preparing statement failed");
+        }
+
+        PQclear(res);
+    }
+
+    /**
+     * execute a prepared statement with the current parameters, the
+     * caller needs to PQclear the result
+     */
+    PGresult *execute(const char *name, int params) {
+        const char *values[2] = {m_param[0].c_str(), m_param[1].c_str()};
+        PGresult *res = PQexecPrepared(conn, name, params, values, NULL, NULL, 0);
+
+        ExecStatusType status = PQresultStatus(res);
+        if(status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+            std::cerr << PQresultErrorMessage(res) << std::endl;
+            PQclear(res);
+            throw std::runtime_error(std::string("executing statement ") + name + " failed");
+        }
+
+        return res;
+    }
+
+    /**
+     * format the values of [begin, end) as array into param
+     */
+    template <class TIterator>
+    static void formatArray(TIterator begin, TIterator end, std::string &param) {
+        std::ostringstream out;
+        out << '{';
+        for(TIterator it = begin; it != end; ++it) {
+            if(it != begin) {
+                out << ',';
+            }
+            out << *it;
+        }
+        out << '}';
+        param = out.str();
+    }
+
+    /**
+     * format the ids and the times or versions of [begin, end) as two
+     * arrays into the parameters
+     */
+    template <class TIterator>
+    void formatPairs(TIterator begin, TIterator end) {
+        std::ostringstream ids, values;
+        ids << '{';
+        values << '{';
+        for(TIterator it = begin; it != end; ++it) {
+            if(it != begin) {
+                ids << ',';
+                values << ',';
+            }
+            ids << it->first;
+            values << it->second;
+        }
+        ids << '}';
+        values << '}';
+        m_param[0] = ids.str();
+        m_param[1] = values.str();
+    }
+
+    /**
+     * execute a statement taking the pairs as two arrays, in batches
+     */
+    template <class TPair>
+    void executePairs(const char *name, std::vector< TPair > &pairs) {
+        for(size_t i = 0; i < pairs.size(); i += BATCH_SIZE) {
+            size_t end = std::min(i + BATCH_SIZE, pairs.size());
+            formatPairs(pairs.begin() + i, pairs.begin() + end);
+            PQclear(execute(name, 2));
+        }
+        pairs.clear();
+    }
+
+    static int64_t toInt64(const char *value) {
+        return strtoll(value, NULL, 10);
+    }
+
+    /**
+     * parse the text form of a bigint array into nodes of way
+     */
+    static void parseNodes(const char *value, Osmium::OSM::Way &way) {
+        const char *ptr = value;
+        while(*ptr && *ptr != '}') {
+            ptr++;
+            if(*ptr == '}') {
+                break;
+            }
+
+            char *end;
+            way.add_node(strtoll(ptr, &end, 10));
+            ptr = end;
+        }
+    }
+
+public:
+    DbAdapter() : DbConn(), m_closeNodes(), m_closeWays(), m_deleteWays(), m_prefix() {}
+
+    /**
+     * the name of the staging table of a table, without the prefix
+     */
+    static std::string stagingTable(const std::string& table) {
+        return table + "_update";
+    }
+
+    /**
+     * Connect to the database specified by the dsn, create the empty
+     * staging tables, start the transaction and prepare the statements
+     * for the tables with the given prefix
+     */
+    void open(const std::string& dsn, const std::string& prefix) {
+        DbConn::open(dsn);
+        m_prefix = prefix;
+
+        // the ways to rebuild are found through the way table, which an
+        // import only writes with --keep-way-nodes
+        PGresult *res = PQexec(conn, ("SELECT to_regclass('" + prefix + "way') IS NOT NULL;").c_str());
+        bool hasWayTable = PQresultStatus(res) == PGRES_TUPLES_OK && PQgetvalue(res, 0, 0)[0] == 't';
+        PQclear(res);
+        if(!hasWayTable) {
+            throw std::runtime_error("the database has no " + prefix + "way table, only imports with --keep-way-nodes can be updated");
+        }
+
+        // the staging tables are left over, when an earlier update was aborted.
+        // They get the columns of the tables without the generated column
+        // valid of the partitioned tables, which COPY and INSERT can't fill.
+        for(size_t i = 0; i < TABLE_COUNT; i++) {
+            std::string staging = prefix + stagingTable(table(i));
+            exec("DROP TABLE IF EXISTS " + staging + ";"
+                " CREATE UNLOGGED TABLE " + staging + " (LIKE " + prefix + table(i) + ");"
+                " ALTER TABLE " + staging + " DROP COLUMN IF EXISTS valid;");
+        }
+
+        exec("BEGIN;");
+
+        // the ids and times in both arrays belong together
+        std::string pairs = "(SELECT ($1::bigint[])[i] AS id, ($2::bigint[])[i] AS value FROM generate_subscripts($1::bigint[], 1) AS i) AS u";
+
+        prepare("close_nodes",
+            "UPDATE " + prefix + "point AS t SET valid_to = to_timestamp(u.value) AT TIME ZONE 'UTC' FROM " + pairs +
+            " WHERE t.id = u.id AND t.valid_to IS NULL", 2);
+
+        prepare("close_ways",
+            "UPDATE " + prefix + "way AS t SET valid_to = to_timestamp(u.value) AT TIME ZONE 'UTC' FROM " + pairs +
+            " WHERE t.id = u.id AND t.valid_to IS NULL", 2);
+
+        prepare("delete_lines",
+            "DELETE FROM " + prefix + "line AS t USING " + pairs + " WHERE t.id = u.id AND t.version = u.value", 2);
+
+        prepare("delete_polygons",
+            "DELETE FROM " + prefix + "polygon AS t USING " + pairs + " WHERE t.id = u.id AND t.version = u.value", 2);
+
+        prepare("ways_with_nodes",
+            "SELECT DISTINCT id FROM " + prefix + "way WHERE valid_to IS NULL AND visible AND nodes && $1::bigint[]", 1);
+
+        prepare("current_ways",
+            "SELECT DISTINCT ON (id) id, version, visible, user_id, user_name, extract(epoch FROM valid_from)::bigint, nodes FROM " + prefix + "way"
+            " WHERE id = ANY($1::bigint[]) ORDER BY id, version DESC", 1);
+
+        prepare("current_way_tags",
+            "SELECT w.id, (each(w.tags)).* FROM"
+            " (SELECT DISTINCT ON (id) id, tags FROM " + prefix + "way WHERE id = ANY($1::bigint[]) ORDER BY id, version DESC) AS w"
+            " ORDER BY w.id", 1);
+
+        prepare("node_histories",
+            "SELECT id, user_id, user_name, extract(epoch FROM valid_from)::bigint, ST_X(geom), ST_Y(geom) FROM " + prefix + "point"
+            " WHERE id = ANY($1::bigint[]) AND visible", 1);
+    }
+
+    /**
+     * close the open row of the node at t, the time of its first new version
+     */
+    void closeNode(osm_object_id_t id, time_t t) {
+        m_closeNodes.push_back(closing_t(id, t));
+        if(m_closeNodes.size() >= BATCH_SIZE) {
+            executePairs("close_nodes", m_closeNodes);
+        }
+    }
+
+    /**
+     * close the open row of the way in the way table at t
+     */
+    void closeWay(osm_object_id_t id, time_t t) {
+        m_closeWays.push_back(closing_t(id, t));
+        if(m_closeWays.size() >= BATCH_SIZE) {
+            executePairs("close_ways", m_closeWays);
+        }
+    }
+
+    /**
+     * delete the line and polygon rows of a way version, which is written
+     * again
+     */
+    void deleteWayRows(osm_object_id_t id, osm_version_t version) {
+        m_deleteWays.push_back(version_t(id, version));
+        if(m_deleteWays.size() >= 2 * BATCH_SIZE) {
+            flush();
+        }
+    }
+
+    /**
+     * execute the pending closes and deletes
+     */
+    void flush() {
+        executePairs("close_nodes", m_closeNodes);
+        executePairs("close_ways", m_closeWays);
+
+        for(size_t i = 0; i < m_deleteWays.size(); i += BATCH_SIZE) {
+            size_t end = std::min(i + BATCH_SIZE, m_deleteWays.size());
+            formatPairs(m_deleteWays.begin() + i, m_deleteWays.begin() + end);
+            PQclear(execute("delete_lines", 2));
+            PQclear(execute("delete_polygons", 2));
+        }
+        m_deleteWays.clear();
+    }
+
+    /**
+     * execute the pending closes and deletes, move the rows of the staging
+     * tables into the tables and commit. The COPY pipes into the staging
+     * tables need to be committed before.
+     */
+    void commit() {
+        flush();
+
+        for(size_t i = 0; i < TABLE_COUNT; i++) {
+            std::string staging = m_prefix + stagingTable(table(i));
+            exec("INSERT INTO " + m_prefix + table(i) + " SELECT * FROM " + staging + ";"
+                " DROP TABLE " + staging + ";");
+        }
+
+        exec("COMMIT;");
+    }
+
+    /**
+     * append the ids of the ways, whose current version contains one of
+     * the nodes, to ways
+     */
+    void waysWithNodes(const std::vector< osm_object_id_t > &nodes, std::vector< osm_object_id_t > &ways) {
+        for(size_t i = 0; i < nodes.size(); i += BATCH_SIZE) {
+            size_t end = std::min(i + BATCH_SIZE, nodes.size());
+            formatArray(nodes.begin() + i, nodes.begin() + end, m_param[0]);
+
+            PGresult *res = execute("ways_with_nodes", 1);
+            for(int row = 0; row < PQntuples(res); row++) {
+                ways.push_back(toInt64(PQgetvalue(res, row, 0)));
+            }
+            PQclear(res);
+        }
+    }
+
+    /**
+     * append the current versions of the ways with the given sorted ids
+     * to ways, ordered by id. Unknown ways are skipped.
+     */
+    void currentWays(const std::vector< osm_object_id_t > &ids, std::vector< shared_ptr<Osmium::OSM::Way const> > &ways) {
+        for(size_t i = 0; i < ids.size(); i += BATCH_SIZE) {
+            size_t end = std::min(i + BATCH_SIZE, ids.size());
+            formatArray(ids.begin() + i, ids.begin() + end, m_param[0]);
+
+            PGresult *res = execute("current_ways", 1);
+            PGresult *tags = execute("current_way_tags", 1);
+
+            // both results are ordered by id
+            int tag = 0, tagCount = PQntuples(tags);
+            for(int row = 0; row < PQntuples(res); row++) {
+                Osmium::OSM::Way *way = new Osmium::OSM::Way();
+                shared_ptr<Osmium::OSM::Way const> ptr(way);
+
+                osm_object_id_t id = toInt64(PQgetvalue(res, row, 0));
+                way->id(id);
+                way->version(toInt64(PQgetvalue(res, row, 1)));
+                way->visible(PQgetvalue(res, row, 2)[0] == 't');
+                way->uid(toInt64(PQgetvalue(res, row, 3)));
+                way->user(PQgetvalue(res, row, 4));
+                way->timestamp(toInt64(PQgetvalue(res, row, 5)));
+                if(!PQgetisnull(res, row, 6)) {
+                    parseNodes(PQgetvalue(res, row, 6), *way);
+                }
+
+                while(tag < tagCount && toInt64(PQgetvalue(tags, tag, 0)) < id) {
+                    tag++;
+                }
+                while(tag < tagCount && toInt64(PQgetvalue(tags, tag, 0)) == id) {
+                    way->tags().add(PQgetvalue(tags, tag, 1), PQgetvalue(tags, tag, 2));
+                    tag++;
+                }
+
+                ways.push_back(ptr);
+            }
+
+            PQclear(tags);
+            PQclear(res);
+        }
+    }
+
+    /**
+     * record all visible versions of the nodes with the given ids into
+     * the nodestore, the coordinates are recorded as they are stored in
+     * the point table. The names of their users are added to usernames,
+     * so the minor versions built of them get a user name.
+     */
+    template <class TUsernameMap>
+    void nodeHistories(const std::vector< osm_object_id_t > &ids, Nodestore *store, TUsernameMap &usernames) {
+        for(size_t i = 0; i < ids.size(); i += BATCH_SIZE) {
+            size_t end = std::min(i + BATCH_SIZE, ids.size());
+            formatArray(ids.begin() + i, ids.begin() + end, m_param[0]);
+
+            PGresult *res = execute("node_histories", 1);
+            for(int row = 0; row < PQntuples(res); row++) {
+                osm_user_id_t uid = toInt64(PQgetvalue(res, row, 1));
+                store->record(
+                    toInt64(PQgetvalue(res, row, 0)),
+                    uid,
+                    toInt64(PQgetvalue(res, row, 3)),
+                    strtod(PQgetvalue(res, row, 4), NULL),
+                    strtod(PQgetvalue(res, row, 5), NULL)
+                );
+
+                if(usernames.find(uid) == usernames.end()) {
+                    usernames.insert(typename TUsernameMap::value_type(uid, std::string(PQgetvalue(res, row, 2))));
+                }
+            }
+            PQclear(res);
+        }
+    }
 };
 
 #endif // IMPORTER_DBADAPTER_HPP
@@ -43,7 +43,7 @@ public:
         {
             // show the error message, close the connection and throw out
             std::cerr << PQerrorMessage(conn) << std::endl;
-            PQfinish(conn);
+            close();
             throw std::runtime_error("connection to database failed");
         }
 
@@ -57,7 +57,7 @@ public:
             // show the error message, close the connection and throw out
             std::cerr << PQerrorMessage(conn) << std::endl;
             PQclear(res);
-            PQfinish(conn);
+            close();
             throw std::runtime_error("setting synchronous_commit to off failed");
         }
 
@@ -92,7 +92,7 @@ public:
             // show the error message, close the connection and throw out
             std::cerr << PQresultErrorMessage(res) << std::endl;
             PQclear(res);
-            PQfinish(conn);
+            close();
             throw std::runtime_error("command failed");
         }
 
@@ -2,17 +2,34 @@
  * The importer populates a postgres-database. It uses COPY streams to
  * pipe data into the server. This class controls a COPY pipe into the
  * database.
+ *
+ * While the pipe is open, the connection is owned by a writer thread,
+ * which sends the data in non-blocking mode. The chunks of data are
+ * handed to it through a bounded queue, so the importer can go on
+ * parsing and building geometries while the server is busy. Only when
+ * the queue is full, the importer waits for the server; how often and
+ * how long it waited is counted.
+ *
+ * Instead of the database, the pipe can also write into a gzip-compressed
+ * file, which can be loaded later with COPY FROM STDIN. The writer thread
+ * then does the compression.
  */
 
 #ifndef IMPORTER_DBCONNECTION_HPP
 #define IMPORTER_DBCONNECTION_HPP
 
 #include <libpq-fe.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include <deque>
 #include <fstream>
 #include <stdexcept>
 #include <sstream>
-
-#include <boost/algorithm/string/replace.hpp>
+#include <vector>
 
 #include "dbconn.hpp"
 
@@ -20,33 +37,323 @@
  * Controls a COPY pipe into the database.
  */
 class DbCopyConn : DbConn {
+private:
+    /**
+     * is the COPY pipe using the binary format?
+     */
+    bool m_binary;
+
+    /**
+     * is the COPY pipe open?
+     */
+    bool m_copying;
+
+    /**
+     * the COPY command of the pipe, it's issued again after a checkpoint
+     */
+    std::string m_command;
+
+    /**
+     * number of chunks waiting for the writer thread, before the
+     * importer has to wait
+     */
+    static const size_t QUEUE_LENGTH = 16;
+
+    pthread_t m_writer;
+
+    /**
+     * is the writer thread running?
+     */
+    bool m_writing;
+
+    /**
+     * the chunks waiting to be sent and the sent chunks, that can be
+     * filled again
+     */
+    std::deque<std::string*> m_queue;
+    std::vector<std::string*> m_free;
+
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_filled, m_drained;
+
+    /**
+     * the writer thread should exit after sending the queued chunks or
+     * right away
+     */
+    bool m_ending, m_aborting;
+
+    /**
+     * the error message of the connection, if the writer thread failed
+     */
+    std::string m_error;
+
+    /**
+     * how often and how long the importer waited for a full queue
+     */
+    uint64_t m_stalls;
+    double m_stalledSeconds;
+
+    /**
+     * the file written instead of the database, if any, and the number of
+     * (uncompressed) bytes copied into the pipe
+     */
+    gzFile m_file;
+    uint64_t m_bytes;
+
+    static double now() {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+
+    static void* run(void *arg) {
+        static_cast< DbCopyConn* >(arg)->write();
+        return NULL;
+    }
+
+    /**
+     * the writer thread: send the queued chunks until the pipe is ended
+     */
+    void write() {
+        pthread_mutex_lock(&m_mutex);
+        while(true) {
+            while(m_queue.empty() && !m_ending && !m_aborting) {
+                pthread_cond_wait(&m_filled, &m_mutex);
+            }
+            if(m_aborting || m_queue.empty()) {
+                break;
+            }
+
+            std::string *chunk = m_queue.front();
+            m_queue.pop_front();
+            pthread_cond_signal(&m_drained);
+            pthread_mutex_unlock(&m_mutex);
+
+            bool sent = m_file ? write(*chunk) : send(*chunk);
+
+            pthread_mutex_lock(&m_mutex);
+            m_free.push_back(chunk);
+            if(!sent) {
+                if(m_file) {
+                    int err;
+                    m_error = gzerror(m_file, &err);
+                } else {
+                    m_error = PQerrorMessage(conn);
+                }
+                pthread_cond_signal(&m_drained);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /**
+     * compress a chunk into the file
+     */
+    bool write(const std::string& chunk) {
+        return gzwrite(m_file, chunk.data(), chunk.size()) == static_cast< int >(chunk.size());
+    }
+
+    /**
+     * send a chunk through the non-blocking connection, waiting for the
+     * socket whenever libpq can't take more data
+     */
+    bool send(const std::string& chunk) {
+        int res;
+        while((res = PQputCopyData(conn, chunk.data(), chunk.size())) == 0) {
+            if(!waitForSocket()) {
+                return false;
+            }
+        }
+        if(res == -1) {
+            return false;
+        }
+
+        while((res = PQflush(conn)) == 1) {
+            if(!waitForSocket()) {
+                return false;
+            }
+        }
+        return res == 0;
+    }
+
+    /**
+     * wait until the socket can be written to, consuming the messages
+     * the server sends in the meantime, as the libpq docs advise
+     */
+    bool waitForSocket() {
+        struct pollfd pfd;
+        pfd.fd = PQsocket(conn);
+        pfd.events = POLLIN | POLLOUT;
+        pfd.revents = 0;
+
+        if(poll(&pfd, 1, -1) < 0) {
+            return errno == EINTR;
+        }
+
+        if(pfd.revents & POLLIN) {
+            return PQconsumeInput(conn) == 1;
+        }
+        return true;
+    }
+
+    void startWriter() {
+        m_ending = m_aborting = false;
+        if(pthread_create(&m_writer, NULL, &DbCopyConn::run, this) != 0) {
+            throw std::runtime_error("can't start COPY writer thread");
+        }
+        m_writing = true;
+    }
+
+    /**
+     * let the writer thread send the queued chunks or abort it, and wait
+     * until it has exited
+     */
+    void stopWriter(bool abort) {
+        if(!m_writing) return;
+
+        pthread_mutex_lock(&m_mutex);
+        m_ending = true;
+        m_aborting = abort;
+        pthread_cond_signal(&m_filled);
+        pthread_mutex_unlock(&m_mutex);
+
+        pthread_join(m_writer, NULL);
+        m_writing = false;
+    }
+
+    /**
+     * start the COPY command in the open transaction and hand the
+     * connection to the writer thread
+     */
+    void startCopy() {
+        // query results are stored in this result pointer
+        PGresult *res;
+
+        // try to start the copy mode
+        res = PQexec(conn, m_command.c_str());
+
+        // check, that the query succeeded
+        if(PQresultStatus(res) != PGRES_COPY_IN)
+        {
+            // show the error message, close the connection and throw out
+            std::cerr << PQresultErrorMessage(res) << std::endl;
+            PQclear(res);
+            DbConn::close();
+            throw std::runtime_error("COPY FROM STDIN command failed");
+        }
+
+        // clear result
+        PQclear(res);
+
+        // from now on the writer thread sends the data
+        if(PQsetnonblocking(conn, 1) != 0) {
+            std::cerr << PQerrorMessage(conn) << std::endl;
+            DbConn::close();
+            throw std::runtime_error("switching to non-blocking mode failed");
+        }
+
+        try {
+            startWriter();
+        } catch(std::runtime_error&) {
+            DbConn::close();
+            throw;
+        }
+        m_copying = true;
+
+        // the binary format starts with a header
+        if(m_binary) {
+            // signature, flags and the length of the (empty) header extension area
+            copy(std::string("PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0", 19));
+        }
+    }
+
 public:
     /**
      * Create a new, unconnected COPY pipe controller
      */
-    DbCopyConn() : DbConn() {}
+    DbCopyConn() :
+            DbConn(),
+            m_binary(false),
+            m_copying(false),
+            m_command(),
+            m_writer(),
+            m_writing(false),
+            m_queue(),
+            m_free(),
+            m_ending(false),
+            m_aborting(false),
+            m_error(),
+            m_stalls(0),
+            m_stalledSeconds(0),
+            m_file(NULL),
+            m_bytes(0) {
+        pthread_mutex_init(&m_mutex, NULL);
+        pthread_cond_init(&m_filled, NULL);
+        pthread_cond_init(&m_drained, NULL);
+    }
 
     /**
      * Delete the controller, rollback the copied data and disconnect
      * the copy-pipe controller
      */
     ~DbCopyConn() {
+        stopWriter(true);
         DbConn::close();
+        if(m_file) {
+            gzclose(m_file);
+        }
+
+        for(size_t i = 0; i < m_queue.size(); i++) {
+            delete m_queue[i];
+        }
+        for(size_t i = 0; i < m_free.size(); i++) {
+            delete m_free[i];
+        }
+
+        pthread_cond_destroy(&m_drained);
+        pthread_cond_destroy(&m_filled);
+        pthread_mutex_destroy(&m_mutex);
     }
 
-    static std::string escape_string(const std::string &string) {
-        std::string copy = string;
-        boost::replace_all(copy, "\\", "\\\\");
-        boost::replace_all(copy, "\t", "\\t");
-        return copy;
+    /**
+     * escape a string for the text format of the COPY pipe and append it
+     * to out, which can be anything with an append-method like
+     * std::string or RowBuffer
+     */
+    template <class TOut>
+    static void escape(const char* str, TOut& out) {
+        for(const char* c = str; *c; c++) {
+            switch(*c) {
+                case '\\':
+                    out.append("\\\\", 2);
+                    break;
+                case '\t':
+                    out.append("\\t", 2);
+                    break;
+                case '\n':
+                    out.append("\\n", 2);
+                    break;
+                case '\r':
+                    out.append("\\r", 2);
+                    break;
+                default:
+                    out.append(c, 1);
+                    break;
+            }
+        }
     }
 
     /**
      * Connect the controller to a database specified by the dsn, start
      * a (fast) transaction and open the COPY pipe to the table specified
-     * by prefix and table
+     * by prefix and table, either in text or in binary format
+     *
+     * when multiple pipes copy into the same table, only one of them could
+     * truncate it, the others would wait for its lock until it commits. So
+     * they are opened without truncate.
      */
-    void open(const std::string& dsn, const std::string& prefix, const std::string& table) {
+    void open(const std::string& dsn, const std::string& prefix, const std::string& table, bool binary = false, bool truncate = true) {
         // connect to the database
         DbConn::open(dsn);
 
@@ -65,55 +372,75 @@ public:
             // show the error message, close the connection and throw out
             std::cerr << PQerrorMessage(conn) << std::endl;
             PQclear(res);
-            PQfinish(conn);
+            DbConn::close();
             throw std::runtime_error("starting transaction failed");
         }
 
         // clear the postgres result
         PQclear(res);
 
-        // issue a TRUNCATE statement
-        //   this tells postgres that it can throw away the new data in
-        //   case of an error which in turn disables the WriteAheadLog
-        //   for this transaction. See 14.2.2 in the postgres-docs:
-        //   http://www.postgresql.org/docs/9.1/static/populate.html
-        cmd << "TRUNCATE TABLE " << prefix << table << ";";
-
-        // try to truncate the table
-        res = PQexec(conn, cmd.str().c_str());
+        if(truncate) {
+            // issue a TRUNCATE statement
+            //   this tells postgres that it can throw away the new data in
+            //   case of an error which in turn disables the WriteAheadLog
+            //   for this transaction. See 14.2.2 in the postgres-docs:
+            //   http://www.postgresql.org/docs/9.1/static/populate.html
+            cmd << "TRUNCATE TABLE " << prefix << table << ";";
+
+            // try to truncate the table
+            res = PQexec(conn, cmd.str().c_str());
+
+            // check, that the query succeeded
+            if(PQresultStatus(res) != PGRES_COMMAND_OK)
+            {
+                // show the error message, close the connection and throw out
+                std::cerr << PQerrorMessage(conn) << std::endl;
+                PQclear(res);
+                DbConn::close();
+                throw std::runtime_error("truncating table failed");
+            }
 
-        // check, that the query succeeded
-        if(PQresultStatus(res) != PGRES_COMMAND_OK)
-        {
-            // show the error message, close the connection and throw out
-            std::cerr << PQerrorMessage(conn) << std::endl;
+            // clear the command buffer and the result
             PQclear(res);
-            PQfinish(conn);
-            throw std::runtime_error("truncating table failed");
+            cmd.str("");
         }
 
-        // clear the command buffer and the result
-        PQclear(res);
-        cmd.str().clear();
-
         // assemble the COPY command
-        cmd << "COPY " << prefix << table << " FROM STDIN;";
+        cmd << "COPY " << prefix << table << " FROM STDIN";
+        if(binary) {
+            cmd << " (FORMAT binary)";
+        }
+        cmd << ";";
 
-        // try to start the copy mode
-        res = PQexec(conn, cmd.str().c_str());
+        m_command = cmd.str();
+        m_binary = binary;
+        startCopy();
+    }
 
-        // check, that the query succeeded
-        if(PQresultStatus(res) != PGRES_COPY_IN)
-        {
-            // show the error message, close the connection and throw out
-            std::cerr << PQresultErrorMessage(res) << std::endl;
-            PQclear(res);
-            PQfinish(conn);
-            throw std::runtime_error("COPY FROM STDIN command failed");
+    /**
+     * Open a COPY pipe into a gzip-compressed file at path instead of the
+     * database, in text or in binary format
+     */
+    void openFile(const std::string& path, bool binary = false) {
+        // favour speed over size, the file is only stored until it's loaded
+        m_file = gzopen(path.c_str(), "wb1");
+        if(!m_file) {
+            throw std::runtime_error("can't open " + path);
         }
 
-        // clear result
-        PQclear(res);
+        try {
+            startWriter();
+        } catch(std::runtime_error&) {
+            gzclose(m_file);
+            m_file = NULL;
+            throw;
+        }
+        m_copying = true;
+
+        m_binary = binary;
+        if(m_binary) {
+            copy(std::string("PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0", 19));
+        }
     }
 
     /**
@@ -121,9 +448,53 @@ public:
      * connection to the database
      */
     void close() {
+        finish();
+
         // but only if there is a opened connection
         if(!conn) return;
 
+        commit();
+
+        // close the connection to the database
+        DbConn::close();
+    }
+
+    /**
+     * Finish the COPY pipe and check that the server accepted all rows,
+     * the transaction stays open until commit is called
+     */
+    void finish() {
+        // but only if there is a opened pipe
+        if(!m_copying) return;
+
+        // the binary format ends with a trailer
+        if(m_binary) {
+            // a field-count of -1
+            copy(std::string("\377\377", 2));
+        }
+        m_copying = false;
+
+        // wait until the writer thread has sent everything, then the
+        // connection is used here in blocking mode again
+        stopWriter(false);
+        if(!m_error.empty()) {
+            std::cerr << m_error << std::endl;
+            DbConn::close();
+            throw std::runtime_error("COPY data-transfer failed");
+        }
+
+        // a file is complete, when it's closed
+        if(m_file) {
+            int res = gzclose(m_file);
+            m_file = NULL;
+            if(res != Z_OK) {
+                throw std::runtime_error("closing COPY file failed");
+            }
+            return;
+        }
+
+        PQsetnonblocking(conn, 0);
+
         // finish the COPY pipe
         int cpres = PQputCopyEnd(conn, NULL);
 
@@ -132,7 +503,7 @@ public:
         {
             // show the error message, close the connection and throw out
             std::cerr << PQerrorMessage(conn) << std::endl;
-            PQfinish(conn);
+            DbConn::close();
             throw std::runtime_error("COPY FROM STDIN finilization failed");
         }
 
@@ -157,7 +528,7 @@ public:
                 default:
                     std::cerr << "PQresultStatus=" << status << std::endl;
                     PQclear(res);
-                    PQfinish(conn);
+                    DbConn::close();
                     throw std::runtime_error("COPY FROM STDIN finilization failed");
             }
 
@@ -165,6 +536,17 @@ public:
             PQclear(res);
             res = PQgetResult(conn);
         }
+    }
+
+    /**
+     * Commit the transaction of a finished COPY pipe
+     */
+    void commit() {
+        // but only if there is a opened connection
+        if(!conn) return;
+
+        // query results are stored in this result pointer
+        PGresult *res;
 
         // try to commit the open transaction
         res = PQexec(conn, "COMMIT;");
@@ -175,30 +557,114 @@ public:
             // show the error message, close the connection and throw out
             std::cerr << PQerrorMessage(conn) << std::endl;
             PQclear(res);
-            PQfinish(conn);
+            DbConn::close();
             throw std::runtime_error("comitting transaction failed");
         }
 
         PQclear(res);
+    }
 
-        // close the connection to the database
-        DbConn::close();
+    /**
+     * Finish the COPY pipe, commit the rows copied so far and open the
+     * pipe again in a new transaction, so an import that is aborted
+     * later keeps them
+     */
+    void checkpoint() {
+        // files are only complete when they are closed
+        if(!conn || !m_copying) return;
+
+        finish();
+        commit();
+        DbConn::exec("BEGIN;");
+        startCopy();
+    }
+
+    /**
+     * is the COPY pipe using the binary format?
+     */
+    bool isBinary() {
+        return m_binary;
     }
 
     /**
      * copy a chunk of data into the COPY pipe
      */
     void copy(const std::string& data) {
-        // copy data into the pipe
-        int res = PQputCopyData(conn, data.c_str(), data.size());
+        copy(data.c_str(), data.size());
+    }
+
+    /**
+     * copy a chunk of data into the COPY pipe, the data is queued for
+     * the writer thread and can be reused when this returns
+     */
+    void copy(const char* data, size_t size) {
+        // a finished pipe has no writer thread, that would send the data
+        if(!m_copying) {
+            throw std::runtime_error("COPY pipe is not open");
+        }
+
+        pthread_mutex_lock(&m_mutex);
+
+        // wait for the writer thread, if the server can't keep up
+        if(m_queue.size() >= QUEUE_LENGTH && m_error.empty()) {
+            double start = now();
+            while(m_queue.size() >= QUEUE_LENGTH && m_error.empty()) {
+                pthread_cond_wait(&m_drained, &m_mutex);
+            }
+            m_stalls++;
+            m_stalledSeconds += now() - start;
+        }
 
         // check if the copying succeeded
-        if(-1 == res) {
+        if(!m_error.empty()) {
+            pthread_mutex_unlock(&m_mutex);
+
             // show the error message, close the connection and throw out
-            std::cerr << PQerrorMessage(conn) << std::endl;
-            PQfinish(conn);
+            std::cerr << m_error << std::endl;
+            stopWriter(true);
+            m_copying = false;
+            DbConn::close();
             throw std::runtime_error("COPY data-transfer failed");
         }
+
+        std::string *chunk;
+        if(m_free.empty()) {
+            chunk = new std::string();
+        } else {
+            chunk = m_free.back();
+            m_free.pop_back();
+        }
+        pthread_mutex_unlock(&m_mutex);
+
+        chunk->assign(data, size);
+        m_bytes += size;
+
+        pthread_mutex_lock(&m_mutex);
+        m_queue.push_back(chunk);
+        pthread_cond_signal(&m_filled);
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /**
+     * how often the importer had to wait for the server, because the
+     * queue of the writer thread was full
+     */
+    uint64_t stalls() {
+        return m_stalls;
+    }
+
+    /**
+     * number of bytes copied into the pipe, before compression
+     */
+    uint64_t bytes() {
+        return m_bytes;
+    }
+
+    /**
+     * how many seconds the importer waited for the server
+     */
+    double stalledSeconds() {
+        return m_stalledSeconds;
     }
 };
 
@@ -0,0 +1,210 @@
+/**
+ * A single COPY pipe is processed by a single backend on the server, so
+ * the database can only use one core per table while importing. The
+ * DbShardedCopyConn opens multiple COPY pipes into the same table, each
+ * on its own connection, and distributes the rows over them by their id.
+ * All versions of an entity are sent through the same pipe.
+ *
+ * The pipes are finished one after the other and only when all of them
+ * have been accepted by the server, their transactions are committed.
+ */
+
+#ifndef IMPORTER_DBSHARDEDCOPYCONN_HPP
+#define IMPORTER_DBSHARDEDCOPYCONN_HPP
+
+#include <ostream>
+#include <sstream>
+#include <vector>
+
+#include "dbcopyconn.hpp"
+#include "rowbuffer.hpp"
+
+/**
+ * Controls multiple COPY pipes into the same table
+ */
+class DbShardedCopyConn {
+private:
+    /**
+     * number of COPY pipes
+     */
+    size_t m_shards;
+
+    /**
+     * are the COPY pipes using the binary format?
+     */
+    bool m_binary;
+
+    std::vector<DbCopyConn*> m_conns;
+    std::vector<RowBuffer*> m_rows;
+
+    /**
+     * the name of the table and, when the pipes write into files, the
+     * names of the files
+     */
+    std::string m_table;
+    std::vector<std::string> m_files;
+
+    void clear() {
+        for(size_t i = 0; i < m_conns.size(); i++) {
+            delete m_rows[i];
+            delete m_conns[i];
+        }
+        m_rows.clear();
+        m_conns.clear();
+        m_files.clear();
+    }
+
+    /**
+     * add the row buffer of the last opened pipe
+     */
+    void addRows(DbCopyConn *conn) {
+        RowBuffer *rows = new RowBuffer(conn);
+        rows->binary(m_binary);
+        m_rows.push_back(rows);
+    }
+
+public:
+    /**
+     * Create a new, unconnected controller with one COPY pipe
+     */
+    DbShardedCopyConn() : m_shards(1), m_binary(false), m_conns(), m_rows(), m_table(), m_files() {}
+
+    /**
+     * Delete the controller, rollback the copied data and disconnect
+     * all COPY pipes
+     */
+    ~DbShardedCopyConn() {
+        clear();
+    }
+
+    size_t shards() {
+        return m_shards;
+    }
+
+    /**
+     * set the number of COPY pipes, needs to be called before open
+     */
+    void shards(size_t numShards) {
+        m_shards = numShards > 0 ? numShards : 1;
+    }
+
+    bool isBinary() {
+        return m_binary;
+    }
+
+    /**
+     * set the format of the COPY pipes, needs to be called before open
+     */
+    void binary(bool shouldBeBinary) {
+        m_binary = shouldBeBinary;
+    }
+
+    /**
+     * Open the COPY pipes to the table specified by prefix and table
+     *
+     * with more then one pipe the table is not truncated, it has just
+     * been created by 00-before.sql anyway. When rows are added to an
+     * existing table, truncate is false.
+     */
+    void open(const std::string& dsn, const std::string& prefix, const std::string& table, bool truncate = true) {
+        clear();
+        m_table = prefix + table;
+
+        for(size_t i = 0; i < m_shards; i++) {
+            DbCopyConn *conn = new DbCopyConn();
+            m_conns.push_back(conn);
+            conn->open(dsn, prefix, table, m_binary, truncate && m_shards == 1);
+            addRows(conn);
+        }
+    }
+
+    /**
+     * Open the COPY pipes into compressed files in dir instead of the
+     * database, one file per pipe, named after the table
+     */
+    void openFiles(const std::string& dir, const std::string& prefix, const std::string& table) {
+        clear();
+        m_table = prefix + table;
+
+        for(size_t i = 0; i < m_shards; i++) {
+            std::ostringstream name;
+            name << m_table << '.' << i << (m_binary ? ".bin.gz" : ".copy.gz");
+            m_files.push_back(name.str());
+
+            DbCopyConn *conn = new DbCopyConn();
+            m_conns.push_back(conn);
+            conn->openFile(dir + "/" + name.str(), m_binary);
+            addRows(conn);
+        }
+    }
+
+    /**
+     * write a line for each file of the closed pipes to the manifest of
+     * a dump: the table, the file and the number of uncompressed bytes
+     */
+    void manifest(std::ostream& out) {
+        for(size_t i = 0; i < m_files.size(); i++) {
+            out << "copy\t" << m_table << '\t' << m_files[i] << '\t' << m_conns[i]->bytes() << '\n';
+        }
+    }
+
+    /**
+     * the row buffer of the COPY pipe, the rows of the entity with the
+     * given id are sent to
+     */
+    RowBuffer& rows(osm_object_id_t id) {
+        return *m_rows[static_cast< uint64_t >(id) % m_rows.size()];
+    }
+
+    /**
+     * how often the importer had to wait for the server on one of the
+     * COPY pipes, see DbCopyConn::stalls
+     */
+    uint64_t stalls() {
+        uint64_t count = 0;
+        for(size_t i = 0; i < m_conns.size(); i++) {
+            count += m_conns[i]->stalls();
+        }
+        return count;
+    }
+
+    /**
+     * how many seconds the importer waited for the server on all COPY
+     * pipes together
+     */
+    double stalledSeconds() {
+        double seconds = 0;
+        for(size_t i = 0; i < m_conns.size(); i++) {
+            seconds += m_conns[i]->stalledSeconds();
+        }
+        return seconds;
+    }
+
+    /**
+     * Send the buffered rows and commit them, pipe by pipe, the pipes
+     * stay open in new transactions
+     */
+    void checkpoint() {
+        for(size_t i = 0; i < m_conns.size(); i++) {
+            m_rows[i]->flush();
+            m_conns[i]->checkpoint();
+        }
+    }
+
+    /**
+     * Send the remaining rows, finish all COPY pipes, commit their
+     * transactions and close the connections
+     */
+    void close() {
+        for(size_t i = 0; i < m_conns.size(); i++) {
+            m_rows[i]->flush();
+            m_conns[i]->finish();
+        }
+
+        for(size_t i = 0; i < m_conns.size(); i++) {
+            m_conns[i]->close();
+        }
+    }
+};
+
+#endif // IMPORTER_DBSHARDEDCOPYCONN_HPP
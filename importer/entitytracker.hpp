@@ -17,74 +17,85 @@
  * a method to shift the entities into the next state and manages
  * freeing of the entities. It is templated to allow nodes, ways
  * and relations as child objects.
+ *
+ * The entities are kept in a ring of three slots. Shifting them only
+ * moves the position of the current slot and the accessors return
+ * references, so the reference count of an entity is only touched when
+ * it is fed in and when it is released two shifts later.
  */
 template <class TObject>
 class EntityTracker {
 
 private:
     /**
-     * pointer to the current entity
+     * the slots of the previous, the current and the next entity
      */
-    shared_ptr<TObject const> m_prev;
+    shared_ptr<TObject const> m_slots[3];
 
     /**
-     * pointer to the current entity
+     * index of the slot of the current entity, the next entity is in the
+     * slot after it and the previous entity in the slot before it
      */
-    shared_ptr<TObject const> m_cur;
+    int m_cur;
 
-    /**
-     * pointer to the next entity
-     */
-    shared_ptr<TObject const> m_next;
+    int nextSlot() const {
+        return m_cur == 2 ? 0 : m_cur + 1;
+    }
+
+    int prevSlot() const {
+        return m_cur == 0 ? 2 : m_cur - 1;
+    }
 
 public:
+    EntityTracker() : m_cur(0) {}
+
     /**
      * get the pointer to the previous entity
      */
-    const shared_ptr<TObject const> prev() {
-        return m_prev;
+    const shared_ptr<TObject const>& prev() const {
+        return m_slots[prevSlot()];
     }
 
     /**
      * get the pointer to the current entity
      */
-    const shared_ptr<TObject const> cur() {
-        return m_cur;
+    const shared_ptr<TObject const>& cur() const {
+        return m_slots[m_cur];
     }
 
     /**
      * get the pointer to the next entity
      */
-    const shared_ptr<TObject const> next() {
-        return m_next;
+    const shared_ptr<TObject const>& next() const {
+        return m_slots[nextSlot()];
     }
 
     /**
      * returns if the tracker currently tracks a previous entity
      */
-    bool has_prev() {
-        return static_cast<bool>(m_prev);
+    bool has_prev() const {
+        return static_cast<bool>(prev());
     }
 
     /**
      * returns if the tracker currently tracks a current entity
      */
-    bool has_cur() {
-        return static_cast<bool>(m_cur);
+    bool has_cur() const {
+        return static_cast<bool>(cur());
     }
 
     /**
      * returns if the tracker currently tracks a "next" entity
      */
-    bool has_next() {
-        return static_cast<bool>(m_next);
+    bool has_next() const {
+        return static_cast<bool>(next());
     }
 
     /**
      * returns if the tracker currently tracks a "current" and a "previous"
      * entity with the same id
      */
-    bool prev_is_same_entity() {
+    bool prev_is_same_entity() const {
         return has_cur() && has_prev() && (cur()->id() == prev()->id());
     }
 
@@ -92,7 +103,7 @@ public:
      * returns if the tracker currently tracks a "current" and a "next"
      * entity with the same id
      */
-    bool next_is_same_entity() {
+    bool next_is_same_entity() const {
         return has_cur() && has_next() && (cur()->id() == next()->id());
     }
 
@@ -103,19 +114,19 @@ public:
      * assertation error, because the next enity needs to be swapped
      * away using the swap-method below, before feeding in a new one.
      */
-    void feed(const shared_ptr<TObject const> obj) {
-        assert(!m_next);
-        m_next = obj;
+    void feed(const shared_ptr<TObject const>& obj) {
+        assert(!has_next());
+        m_slots[nextSlot()] = obj;
     }
 
     /**
-     * copy the current entity to previous and the next entity to current.
-     * clear the next entity pointer
+     * make the current entity the previous and the next entity the
+     * current one. The previous entity is released, its slot is the
+     * one for the next entity now.
      */
     void swap() {
-        m_prev = m_cur;
-        m_cur = m_next;
-        m_next.reset();
+        m_cur = nextSlot();
+        m_slots[nextSlot()].reset();
     }
 };
 
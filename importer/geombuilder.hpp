@@ -1,14 +1,23 @@
 /**
  * Geometries are built from a given list of nodes at a given timestamp.
- * This class builds a geos geometry from this information, depending
- * on the tags, a way could possibly be a polygon. This information is
+ * This class collects the coordinates of the nodes into a WayGeometry,
+ * depending on the tags, a way could possibly be a polygon. This information is
  * added additionally when building a portugal.
+ *
+ * A way version and its minor versions are built incrementally: the
+ * coordinates are looked up once for the time of the way version, then
+ * the versions of its nodes are applied one after another, in the order
+ * of their timestamps. Building a minor version only needs to patch the
+ * coordinates of the nodes that moved, not to look up all nodes again.
  */
 
 #ifndef IMPORTER_GEOMBUILDER_HPP
 #define IMPORTER_GEOMBUILDER_HPP
 
+#include <iterator>
+
 #include "project.hpp"
+#include "waygeometry.hpp"
 
 class GeomBuilder {
 private:
@@ -17,22 +26,133 @@ private:
     bool m_isupdate, m_keepLatLng;
     bool m_debug, m_showerrors;
 
-protected:
-    GeomBuilder(Nodestore *nodestore, DbAdapter *adapter, bool isUpdate): m_nodestore(nodestore), m_adapter(adapter), m_isupdate(isUpdate), m_debug(false), m_showerrors(false) {}
+    /**
+     * which coordinates of the way could be projected
+     */
+    std::vector<unsigned char> m_valid;
 
-public:
-    geos::geom::Geometry* forWay(const Osmium::OSM::WayNodeList &nodes, time_t t, bool looksLikePolygon) {
-        // shorthand to the geometry factory
-        geos::geom::GeometryFactory *f = Osmium::Geometry::geos_geometry_factory();
+    /**
+     * a later version of one of the nodes of the way
+     */
+    struct NodeEvent {
+        time_t t;
+
+        /**
+         * index of the node in the way
+         */
+        size_t ref;
+
+        double x, y;
+        bool valid;
+
+        bool operator<(const NodeEvent& a) const {
+            return t < a.t;
+        }
+    };
+
+    /**
+     * the current coordinates of all nodes of the way, while building
+     * the way and its minor versions
+     */
+    std::vector<double> m_refX, m_refY;
+    std::vector<unsigned char> m_refValid;
+
+    /**
+     * the later versions of the nodes, ordered by time, and the next one
+     * that has not yet been applied
+     */
+    std::vector<NodeEvent> m_events;
+    size_t m_nextEvent;
+
+    /**
+     * walks over the versions of the nodes
+     */
+    Nodestore::VersionCursor m_cursor;
 
-        // pointer to coordinate vector
-        std::vector<geos::geom::Coordinate> *c = new std::vector<geos::geom::Coordinate>();
+    /**
+     * scratch space to project the coordinates of the events in one call
+     */
+    std::vector<double> m_lon, m_lat;
+    bool m_looksLikePolygon;
+
+    /**
+     * project count coordinates in place, valid is set to 0 for those that
+     * can't be projected. When the nodestore already stored them projected,
+     * they only need to be checked.
+     */
+    void project(double *x, double *y, unsigned char *valid, size_t count) {
+        if(m_nodestore->isStoringProjected()) {
+            for(size_t i = 0; i < count; i++) {
+                valid[i] = (x[i] == x[i]);
+            }
+        } else if(!m_keepLatLng) {
+            Project::toMercator(x, y, valid, count);
+        } else {
+            for(size_t i = 0; i < count; i++) {
+                valid[i] = 1;
+            }
+        }
+    }
+
+    /**
+     * check if geom has enough coordinates and if it's a polygon
+     */
+    bool finish(WayGeometry &geom, bool looksLikePolygon) {
+        // if less then 2 nodes could be found in the store, no valid way
+        // can be assembled and we need to skip it
+        size_t count = geom.size();
+        if(count < 2) {
+            if(m_showerrors) {
+                std::cerr << "found only " << count << " valid coordinates, skipping way" << std::endl;
+            }
+            return false;
+        }
+
+        // tags say it could be a polygon, the way is closed and has
+        // at least 3 *different* coordinates
+        geom.isPolygon = looksLikePolygon && count >= 4 &&
+            geom.x[0] == geom.x[count - 1] && geom.y[0] == geom.y[count - 1];
+
+        return true;
+    }
+
+    /**
+     * collect the current, valid coordinates of the nodes into geom
+     */
+    bool assemble(WayGeometry &geom) {
+        geom.clear();
+
+        size_t count = m_refValid.size();
+        for(size_t i = 0; i < count; i++) {
+            if(m_refValid[i]) {
+                geom.x.push_back(m_refX[i]);
+                geom.y.push_back(m_refY[i]);
+            }
+        }
+
+        return finish(geom, m_looksLikePolygon);
+    }
+
+    static osm_object_id_t nodeRef(const Osmium::OSM::WayNode &node) {
+        return node.ref();
+    }
+
+    static osm_object_id_t nodeRef(osm_object_id_t id) {
+        return id;
+    }
+
+    /**
+     * collect the coordinates of the nodes between begin and end at time t
+     * into geom
+     */
+    template <class TIterator>
+    bool collect(TIterator begin, TIterator end, time_t t, bool looksLikePolygon, WayGeometry &geom) {
+        geom.clear();
 
         // iterate over all nodes
-        Osmium::OSM::WayNodeList::const_iterator end = nodes.end();
-        for(Osmium::OSM::WayNodeList::const_iterator it = nodes.begin(); it != end; ++it) {
+        for(TIterator it = begin; it != end; ++it) {
             // the id
-            osm_object_id_t id = it->ref();
+            osm_object_id_t id = nodeRef(*it);
 
             // was the node found in the store?
             bool found;
@@ -48,59 +168,205 @@ public:
                 std::cerr << "node #" << id << " at tstamp " << t << " references node at POINT(" << std::setprecision(8) << lon << ' ' << lat << ')' << std::endl;
             }
 
-            // create a coordinate-object and add it to the vector
-            if(!m_keepLatLng) {
-                if(!Project::toMercator(&lon, &lat))
-                    continue;
+            geom.x.push_back(lon);
+            geom.y.push_back(lat);
+        }
+
+        // project all coordinates at once
+        size_t count = geom.size();
+        m_valid.resize(count);
+        if(count > 0) {
+            project(&geom.x[0], &geom.y[0], &m_valid[0], count);
+        }
+
+        // drop the coordinates that could not be projected
+        size_t n = 0;
+        for(size_t i = 0; i < count; i++) {
+            if(m_valid[i]) {
+                geom.x[n] = geom.x[i];
+                geom.y[n] = geom.y[i];
+                n++;
             }
-            c->push_back(geos::geom::Coordinate(lon, lat, DoubleNotANumber));
         }
+        geom.x.resize(n);
+        geom.y.resize(n);
 
-        // if less then 2 nodes could be found in the store, no valid way
-        // can be assembled and we need to skip it
-        if(c->size() < 2) {
-            if(m_showerrors) {
-                std::cerr << "found only " << c->size() << " valid coordinates, skipping way" << std::endl;
+        return finish(geom, looksLikePolygon);
+    }
+
+    /**
+     * look up the coordinates of the nodes between begin and end at time
+     * t into m_refX and m_refY and collect their later versions up to
+     * until (or all, if until is 0) as events
+     */
+    template <class TIterator>
+    void prepare(TIterator begin, TIterator end, time_t t, time_t until) {
+        size_t count = std::distance(begin, end);
+        m_refX.assign(count, 0);
+        m_refY.assign(count, 0);
+        m_refValid.assign(count, 0);
+        m_events.clear();
+        m_nextEvent = 0;
+
+        bool collectEvents = (until == 0 || until > t);
+
+        size_t i = 0;
+        for(TIterator it = begin; it != end; ++it, ++i) {
+            if(!m_nodestore->versions(nodeRef(*it), m_cursor)) {
+                continue;
+            }
+
+            // the version valid at t, like Nodestore::lookup(id, t) finds it:
+            // the youngest version not younger then t, or the first version
+            bool valid = false, before = false;
+            time_t validTime = 0, last = 0;
+            Nodestore::Nodeinfo info = Nodestore::Nodeinfo();
+            while(m_cursor.next()) {
+                time_t vt = m_cursor.t;
+
+                if(vt <= t) {
+                    if(!before || vt > validTime) {
+                        info = m_cursor.info;
+                        validTime = vt;
+                        before = true;
+                    }
+                } else if(!before && (!valid || vt < validTime)) {
+                    info = m_cursor.info;
+                    validTime = vt;
+                }
+                valid = true;
+
+                // all later versions up to until, a version with the same
+                // time as the one before it is shadowed by it
+                if(collectEvents && vt > t && (until == 0 || vt <= until) && vt != last) {
+                    NodeEvent event = {vt, i, m_cursor.info.lon, m_cursor.info.lat, true};
+                    m_events.push_back(event);
+                }
+                last = vt;
+            }
+
+            if(!valid) {
+                continue;
+            }
+
+            m_refX[i] = info.lon;
+            m_refY[i] = info.lat;
+            m_refValid[i] = 1;
+
+            if(m_debug) {
+                std::cerr << "node at index " << i << " at tstamp " << t << " references node at POINT(" << std::setprecision(8) << m_refX[i] << ' ' << m_refY[i] << ')' << std::endl;
             }
-            delete c;
-            return NULL;
         }
 
-        // the resulting geometry
-        geos::geom::Geometry* geom;
-
-        // geos throws exception on bad geometries and such
-        try {
-            // tags say it could be a polygon, the way is closed and has
-            // at least 3 *different* coordinates
-            if(looksLikePolygon && c->front() == c->back() && c->size() >= 4) {
-                // build a polygon
-                geom = f->createPolygon(
-                    f->createLinearRing(
-                        f->getCoordinateSequenceFactory()->create(c)
-                    ),
-                    NULL
-                );
-            } else {
-                // build a linestring
-                geom = f->createLineString(
-                    f->getCoordinateSequenceFactory()->create(c)
-                );
+        // project the coordinates of the nodes at t and all later versions
+        if(count > 0) {
+            m_valid.resize(count);
+            project(&m_refX[0], &m_refY[0], &m_valid[0], count);
+            for(size_t i = 0; i < count; i++) {
+                m_refValid[i] = m_refValid[i] && m_valid[i];
             }
-        } catch(geos::util::GEOSException e) {
-            if(m_showerrors) {
-                std::cerr << "error creating polygon: " << e.what() << std::endl;
+        }
+
+        size_t events = m_events.size();
+        if(events > 0) {
+            m_lon.resize(events);
+            m_lat.resize(events);
+            m_valid.resize(events);
+            for(size_t i = 0; i < events; i++) {
+                m_lon[i] = m_events[i].x;
+                m_lat[i] = m_events[i].y;
             }
-            delete c;
-            return NULL;
+
+            project(&m_lon[0], &m_lat[0], &m_valid[0], events);
+
+            for(size_t i = 0; i < events; i++) {
+                m_events[i].x = m_lon[i];
+                m_events[i].y = m_lat[i];
+                m_events[i].valid = m_valid[i];
+            }
+
+            std::stable_sort(m_events.begin(), m_events.end());
+        }
+    }
+
+protected:
+    GeomBuilder(Nodestore *nodestore, DbAdapter *adapter, bool isUpdate): m_nodestore(nodestore), m_adapter(adapter), m_isupdate(isUpdate), m_debug(false), m_showerrors(false), m_nextEvent(0), m_cursor(), m_looksLikePolygon(false) {}
+
+public:
+    /**
+     * collect the coordinates of the nodes at time t into geom
+     *
+     * returns false, if less then 2 valid coordinates were found.
+     */
+    bool forWay(const Osmium::OSM::WayNodeList &nodes, time_t t, bool looksLikePolygon, WayGeometry &geom) {
+        return collect(nodes.begin(), nodes.end(), t, looksLikePolygon, geom);
+    }
+
+    /**
+     * collect the coordinates of the nodes with the given ids at time t
+     * into geom, like forWay
+     */
+    bool forNodes(const std::vector<osm_object_id_t> &nodes, time_t t, bool looksLikePolygon, WayGeometry &geom) {
+        return collect(nodes.begin(), nodes.end(), t, looksLikePolygon, geom);
+    }
+
+    /**
+     * start building a way and its minor versions
+     *
+     * geom is set to the way at time t, later versions of the nodes up to
+     * until (or all, if until is 0) are prepared to be applied by advance.
+     * Returns false, if the way at time t has less then 2 valid coordinates.
+     */
+    bool begin(const Osmium::OSM::WayNodeList &nodes, time_t t, time_t until, bool looksLikePolygon, WayGeometry &geom) {
+        m_looksLikePolygon = looksLikePolygon;
+        prepare(nodes.begin(), nodes.end(), t, until);
+        return assemble(geom);
+    }
+
+    /**
+     * start following the coordinates of the nodes with the given ids from
+     * time t to until, like begin, without assembling them to a way. The
+     * coordinates are read with coordinate, after seek moved them in time.
+     */
+    void beginNodes(const std::vector<osm_object_id_t> &nodes, time_t t, time_t until) {
+        m_looksLikePolygon = false;
+        prepare(nodes.begin(), nodes.end(), t, until);
+    }
+
+    /**
+     * apply the versions of the nodes up to time t, which must not be
+     * before the time of the previous call to begin, beginNodes or seek
+     */
+    void seek(time_t t) {
+        size_t events = m_events.size();
+        while(m_nextEvent < events && m_events[m_nextEvent].t <= t) {
+            const NodeEvent &event = m_events[m_nextEvent++];
+            m_refX[event.ref] = event.x;
+            m_refY[event.ref] = event.y;
+            m_refValid[event.ref] = event.valid;
         }
+    }
 
-        // enforce srid
-        if(geom) {
-            geom->setSRID(900913);
+    /**
+     * the current coordinates of the node at index ref, returns false if
+     * the node is unknown or its coordinates could not be projected
+     */
+    bool coordinate(size_t ref, double &x, double &y) const {
+        if(!m_refValid[ref]) {
+            return false;
         }
+        x = m_refX[ref];
+        y = m_refY[ref];
+        return true;
+    }
 
-        return geom;
+    /**
+     * set geom to the way at time t, which must not be before the time of
+     * the previous call to begin or advance
+     */
+    bool advance(time_t t, WayGeometry &geom) {
+        seek(t);
+        return assemble(geom);
     }
 
     bool isKeepingLatLng() {
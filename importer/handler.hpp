@@ -1,7 +1,14 @@
 #ifndef IMPORTER_HANDLER_HPP
 #define IMPORTER_HANDLER_HPP
 
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
 #include <fstream>
+#include <iterator>
+#include <sstream>
 
 #include <libpq-fe.h>
 
@@ -9,25 +16,25 @@
 #include <osmium/handler/progress.hpp>
 #include <osmium/osm/types.hpp>
 
-#include <geos/algorithm/InteriorPointArea.h>
-#include <geos/io/WKBWriter.h>
-
 #include "dbconn.hpp"
-#include "dbcopyconn.hpp"
+#include "dbshardedcopyconn.hpp"
 #include "dbadapter.hpp"
+#include "indexbuilder.hpp"
 
 #include "nodestore.hpp"
 #include "nodestore/stl.hpp"
 #include "nodestore/sparse.hpp"
+#include "nodestore/mmap.hpp"
 
 #include "entitytracker.hpp"
-#include "polygonidentifyer.hpp"
-#include "zordercalculator.hpp"
 #include "hstore.hpp"
 #include "timestamp.hpp"
-#include "geombuilder.hpp"
-#include "minortimescalculator.hpp"
+#include "waywriter.hpp"
+#include "waystore.hpp"
+#include "relationwriter.hpp"
+#include "writerpool.hpp"
 #include "sorttest.hpp"
+#include "checkpoint.hpp"
 #include "project.hpp"
 
 
@@ -36,44 +43,73 @@ private:
     Osmium::Handler::Progress m_progress;
     EntityTracker<Osmium::OSM::Node> m_node_tracker;
     EntityTracker<Osmium::OSM::Way> m_way_tracker;
+    EntityTracker<Osmium::OSM::Relation> m_relation_tracker;
 
     Nodestore *m_store;
     DbAdapter m_adapter;
-    ImportGeomBuilder m_geom;
-    ImportMinorTimesCalculator m_mtimes;
     SortTest m_sorttest;
 
     DbConn m_general;
-    DbCopyConn m_point, m_line, m_polygon;
+    DbShardedCopyConn m_point, m_line, m_polygon, m_way;
+
+    std::string m_dsn, m_prefix, m_indexMemory, m_outputDir, m_checkpointFile;
+    int m_indexWorkers;
+    bool m_debug, m_storeerrors, m_interior, m_keepLatLng, m_binary, m_multipolygons, m_update, m_partitioned, m_resume, m_keepWayNodes;
+    size_t m_threads;
 
-    geos::io::WKBWriter wkb;
+    /**
+     * seconds between two checkpoints and the time of the last one
+     */
+    time_t m_checkpointInterval, m_lastCheckpoint;
 
-    std::string m_dsn, m_prefix;
-    bool m_debug, m_storeerrors, m_interior, m_keepLatLng;
+    /**
+     * when resuming: the checkpoint the import continues after
+     */
+    Checkpoint m_resumeFrom;
 
-    std::map<osm_user_id_t, std::string> m_username_map;
+    WayWriter::username_map_t m_username_map;
     typedef std::pair<osm_user_id_t, std::string> username_pair_t;
 
+    /**
+     * writes the way versions in the main thread
+     */
+    WayWriter m_way_writer;
 
-    void write_node() {
-        const shared_ptr<Osmium::OSM::Node const> next = m_node_tracker.next();
-        const shared_ptr<Osmium::OSM::Node const> cur = m_node_tracker.cur();
+    typedef WriterPool<Osmium::OSM::Way, WayWriter> WayPool;
+    typedef WriterPool<Osmium::OSM::Relation, RelationWriter> RelationPool;
 
-        if(m_debug) {
-            std::cout << "node n" << cur->id() << 'v' << cur->version() << " at tstamp " << cur->timestamp() << " (" << Timestamp::format(cur->timestamp()) << ")" << std::endl;
-        }
+    /**
+     * writes the way versions in worker threads, if more then one thread is used
+     */
+    WayPool *m_way_pool;
 
-        std::string valid_from(cur->timestamp_as_string());
-        std::string valid_to("\\N");
+    /**
+     * the node lists of all way versions, only filled when the
+     * multipolygon relations are built
+     */
+    Waystore m_waystore;
 
-        // if this is another version of the same entity, the end-timestamp of the current entity is the timestamp of the next one
-        if(m_node_tracker.next_is_same_entity()) {
-            valid_to = next->timestamp_as_string();
-        }
+    /**
+     * writes the multipolygon relation versions in the main thread or in
+     * worker threads, if more then one thread is used
+     */
+    RelationWriter m_relation_writer;
+    RelationPool *m_relation_pool;
 
-        // if the current version is deleted, it's end-timestamp is the same as its creation-timestamp
-        else if(!cur->visible()) {
-            valid_to = valid_from;
+    /**
+     * in update mode: the ids of the nodes with new versions and the new
+     * way versions, which are written after all ways have been read
+     */
+    std::vector< osm_object_id_t > m_changedNodes;
+    std::vector< shared_ptr<Osmium::OSM::Way const> > m_changedWays;
+
+
+    void write_node() {
+        const shared_ptr<Osmium::OSM::Node const>& next = m_node_tracker.next();
+        const shared_ptr<Osmium::OSM::Node const>& cur = m_node_tracker.cur();
+
+        if(m_debug) {
+            std::cout << "node n" << cur->id() << 'v' << cur->version() << " at tstamp " << cur->timestamp() << " (" << Timestamp::format(cur->timestamp()) << ")" << std::endl;
         }
 
         // some xml-writers write deleted nodes without corrdinates, some write 0/0 as coorinate
@@ -85,260 +121,388 @@ private:
             lat = cur->lat();
         }
 
+        // project the coordinates, a nodestore storing projected coordinates records them projected
+        double x = lon, y = lat;
+        bool projected = true;
+        if(!m_keepLatLng) {
+            projected = Project::toMercator(&x, &y);
+        }
+
         // if this node is not-deleted (ie visible), write it to the nodestore
         // some osm-writers write invisible nodes with 0/0 coordinates which would screw up rendering, if not ignored in the nodestore
         // see https://github.com/MaZderMind/osm-history-renderer/issues/8
         if(cur->visible())
         {
-            m_store->record(cur->id(), cur->uid(), cur->timestamp(), lon, lat);
+            if(!m_store->isStoringProjected()) {
+                m_store->record(cur->id(), cur->uid(), cur->timestamp(), lon, lat);
+            } else if(projected) {
+                m_store->record(cur->id(), cur->uid(), cur->timestamp(), x, y);
+            } else {
+                // keep the version, so the minor versions stay the same, but mark its coordinates as invalid
+                double nan = std::numeric_limits< double >::quiet_NaN();
+                m_store->record(cur->id(), cur->uid(), cur->timestamp(), nan, nan);
+            }
         }
 
-        m_username_map.insert( username_pair_t(cur->uid(), std::string(cur->user()) ) );
+        if(m_username_map.find(cur->uid()) == m_username_map.end()) {
+            m_username_map.insert( username_pair_t(cur->uid(), std::string(cur->user()) ) );
+        }
 
-        if(!m_keepLatLng) {
-            if(!Project::toMercator(&lon, &lat))
-                return;
-        }
-
-        // SPEED: sum up 64k of data, before sending them to the database
-        // SPEED: instead of stringstream, which does dynamic allocation, use a fixed buffer and snprintf
-        std::stringstream line;
-        line << std::setprecision(8) <<
-            cur->id() << '\t' <<
-            cur->version() << '\t' <<
-            (cur->visible() ? 't' : 'f') << '\t' <<
-            cur->uid() << '\t' <<
-            DbCopyConn::escape_string(cur->user()) << '\t' <<
-            valid_from << '\t' <<
-            valid_to << '\t' <<
-            HStore::format(cur->tags()) << '\t';
+        // the first new version of a node ends the open row in the database
+        if(m_update && !(m_node_tracker.has_prev() && m_node_tracker.prev()->id() == cur->id())) {
+            m_adapter.closeNode(cur->id(), cur->timestamp());
+            m_changedNodes.push_back(cur->id());
+        }
+
+        if(!projected) {
+            return;
+        }
+
+        // the rows of the nodes before the checkpoint are in the database
+        if(m_resumeFrom.covers(NODE, cur->id())) {
+            return;
+        }
+
+        RowBuffer& rows = m_point.rows(cur->id());
+
+        rows.beginRow(9);
+        rows.addInt64(cur->id());
+        rows.addInt16(cur->version());
+        rows.addBool(cur->visible());
+        rows.addInt32(cur->uid());
+        rows.addText(cur->user());
+        rows.addTimestamp(cur->timestamp());
+
+        // if this is another version of the same entity, the end-timestamp of the current entity is the timestamp of the next one
+        if(m_node_tracker.next_is_same_entity()) {
+            rows.addTimestamp(next->timestamp());
+        }
+
+        // if the current version is deleted, it's end-timestamp is the same as its creation-timestamp
+        else if(!cur->visible()) {
+            rows.addTimestamp(cur->timestamp());
+        }
+
+        else {
+            rows.addNull();
+        }
+
+        rows.addHStore(cur->tags());
 
         if(cur->visible()) {
-            line << "SRID=900913;POINT(" << lon << ' ' << lat << ')';
+            rows.addPoint(x, y, 900913);
         } else {
-            line << "\\N";
+            rows.addNull();
         }
 
-        line << '\n';
-        m_point.copy(line.str());
+        rows.endRow();
     }
 
     void write_way() {
-        const shared_ptr<Osmium::OSM::Way const> next = m_way_tracker.next();
-        const shared_ptr<Osmium::OSM::Way const> cur = m_way_tracker.cur();
+        if(m_keepWayNodes) {
+            write_way_row(m_way_tracker.cur().get(), m_way_tracker.next().get());
+        }
+        write_way_geometries(m_way_tracker.prev(), m_way_tracker.cur(), m_way_tracker.next());
+    }
 
-        if(m_debug) {
-            std::cout << "way w" << cur->id() << 'v' << cur->version() << " at tstamp " << cur->timestamp() << " (" << Timestamp::format(cur->timestamp()) << ")" << std::endl;
+    /**
+     * write the row of the way version to the way table, which keeps the
+     * node lists for the update mode. It's only written with
+     * --keep-way-nodes and in the update mode itself.
+     */
+    void write_way_row(const Osmium::OSM::Way *cur, const Osmium::OSM::Way *next) {
+        RowBuffer& rows = m_way.rows(cur->id());
+
+        rows.beginRow(9);
+        rows.addInt64(cur->id());
+        rows.addInt16(cur->version());
+        rows.addBool(cur->visible());
+        rows.addInt32(cur->uid());
+        rows.addText(cur->user());
+        rows.addTimestamp(cur->timestamp());
+
+        // the same end-timestamps as for the nodes
+        if(next && next->id() == cur->id()) {
+            rows.addTimestamp(next->timestamp());
+        } else if(!cur->visible()) {
+            rows.addTimestamp(cur->timestamp());
+        } else {
+            rows.addNull();
         }
 
-        time_t valid_from = cur->timestamp();
-        time_t valid_to = 0;
+        rows.addHStore(cur->tags());
+        rows.addNodeList(cur->nodes());
+        rows.endRow();
+    }
 
-        std::vector<MinorTimesCalculator::MinorTimesInfo> *minor_times = NULL;
-        if(cur->visible()) {
-            if(m_way_tracker.next_is_same_entity()) {
-                if(cur->timestamp() > next->timestamp()) {
-                    if(m_storeerrors) {
-                        std::cerr << "inverse timestamp-order in way " << cur->id() << " between v" << cur->version() << " and v" << next->version() << ", skipping minor ways" << std::endl;
-                    }
-                } else {
-                    // collect minor ways between current and next
-                    minor_times = m_mtimes.forWay(cur->nodes(), cur->timestamp(), next->timestamp());
-                }
+    void write_way_geometries(const shared_ptr<Osmium::OSM::Way const>& prev, const shared_ptr<Osmium::OSM::Way const>& cur, const shared_ptr<Osmium::OSM::Way const>& next) {
+        if(m_way_pool) {
+            m_way_pool->add(prev, cur, next);
+        } else {
+            m_way_writer.write(prev.get(), cur.get(), next.get(), m_line.rows(cur->id()), m_polygon.rows(cur->id()));
+        }
+    }
+
+    /**
+     * in update mode: write the new way versions and write the current
+     * versions of the ways with changed nodes again, so their minor
+     * versions include the new node versions
+     */
+    void update_ways() {
+        typedef shared_ptr<Osmium::OSM::Way const> way_ptr;
+
+        // the changes of the nodes need to be in the database before
+        // the ways containing them are searched
+        m_adapter.flush();
+
+        std::vector< osm_object_id_t > ids;
+        m_adapter.waysWithNodes(m_changedNodes, ids);
+        for(std::vector< way_ptr >::const_iterator it = m_changedWays.begin(); it != m_changedWays.end(); ++it) {
+            ids.push_back((*it)->id());
+        }
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        std::vector< way_ptr > current;
+        m_adapter.currentWays(ids, current);
+
+        // all versions of the ways, ordered by id and version, and whether
+        // they came from the database
+        std::vector< way_ptr > versions;
+        std::vector< bool > stored;
+        versions.reserve(current.size() + m_changedWays.size());
+        size_t c = 0, w = 0;
+        while(c < current.size() || w < m_changedWays.size()) {
+            if(w == m_changedWays.size() || (c < current.size() && current[c]->id() <= m_changedWays[w]->id())) {
+                versions.push_back(current[c++]);
+                stored.push_back(true);
             } else {
-                // collect minor ways between current and the end
-                minor_times = m_mtimes.forWay(cur->nodes(), cur->timestamp());
+                versions.push_back(m_changedWays[w++]);
+                stored.push_back(false);
             }
         }
 
-        // if there are minor ways, it's the timestamp of the first minor way
-        if(minor_times && minor_times->size() > 0) {
-            valid_to = (*minor_times->begin()).t;
+        // the nodes of these versions with all their versions
+        std::vector< osm_object_id_t > nodes;
+        for(std::vector< way_ptr >::const_iterator it = versions.begin(); it != versions.end(); ++it) {
+            const Osmium::OSM::WayNodeList &wnl = (*it)->nodes();
+            for(Osmium::OSM::WayNodeList::const_iterator nit = wnl.begin(); nit != wnl.end(); ++nit) {
+                nodes.push_back(nit->ref());
+            }
         }
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        m_adapter.nodeHistories(nodes, m_store, m_username_map);
+
+        // the stored versions are written again, so their rows are replaced
+        // and the rows of the way table are closed by new versions
+        for(size_t i = 0; i < versions.size(); i++) {
+            if(!stored[i] || !versions[i]->visible()) {
+                continue;
+            }
+            m_adapter.deleteWayRows(versions[i]->id(), versions[i]->version());
+            if(i + 1 < versions.size() && versions[i+1]->id() == versions[i]->id()) {
+                m_adapter.closeWay(versions[i]->id(), versions[i+1]->timestamp());
+            }
+        }
+        m_adapter.flush();
 
-        // if this is another version of the same entity, the end-timestamp of the current entity is the timestamp of the next one
-        else if(m_way_tracker.next_is_same_entity()) {
-            valid_to = next->timestamp();
+        if(m_threads > 1 && !m_way_pool) {
+            m_way_pool = new WayPool(m_threads, m_way_writer, &m_line, &m_polygon);
         }
 
-        // if the current version is deleted, it's end-timestamp is the same as its creation-timestamp
-        else if(!cur->visible()) {
-            valid_to = valid_from;
-        }
-
-        // write the main way version
-        write_way_to_db(
-            cur->id(),
-            cur->version(),
-            0 /*minor*/,
-            cur->visible(),
-            cur->uid(),
-            cur->user(),
-            cur->timestamp(),
-            valid_from,
-            valid_to,
-            cur->tags(),
-            cur->nodes()
-        );
-
-        if(minor_times) {
-            // write the minor way versions of current between current & next
-            int minor = 1;
-            std::vector<MinorTimesCalculator::MinorTimesInfo>::const_iterator end = minor_times->end();
-            for(std::vector<MinorTimesCalculator::MinorTimesInfo>::const_iterator it = minor_times->begin(); it != end; it++) {
-                if(m_debug) {
-                    std::cout << "minor way w" << cur->id() << 'v' << cur->version() << '.' << minor << " at tstamp " << (*it).t << " (" << Timestamp::format( (*it).t ) << ")" << std::endl;
-                }
+        way_ptr none;
+        for(size_t i = 0; i < versions.size(); i++) {
+            const way_ptr& prev = i > 0 ? versions[i-1] : none;
+            const way_ptr& next = i + 1 < versions.size() ? versions[i+1] : none;
 
-                valid_from = (*it).t;
-                if(it == end-1) {
-                    if(m_way_tracker.next_is_same_entity()) {
-                        valid_to = next->timestamp();
-                    } else {
-                        valid_to = 0;
-                    }
-                } else {
-                    valid_to = ( *(it+1) ).t;
-                }
+            if(!stored[i]) {
+                write_way_row(versions[i].get(), next.get());
+            }
 
-                time_t t = (*it).t;
-                osm_user_id_t uid = (*it).uid;
-                const char* user = m_username_map[ uid ].c_str();
-
-                write_way_to_db(
-                    cur->id(),
-                    cur->version(),
-                    minor,
-                    true,
-                    uid,
-                    user,
-                    t,
-                    valid_from,
-                    valid_to,
-                    cur->tags(),
-                    cur->nodes()
-                );
-
-                minor++;
+            // a deleted stored version has no rows to replace
+            if(!stored[i] || versions[i]->visible()) {
+                write_way_geometries(prev, versions[i], next);
             }
-            delete minor_times;
-        }
-    }
-
-    void write_way_to_db(
-        osm_object_id_t id,
-        osm_version_t version,
-        osm_version_t minor,
-        bool visible,
-        osm_user_id_t user_id,
-        const char* user_name,
-        time_t timestamp,
-        time_t valid_from,
-        time_t valid_to,
-        const Osmium::OSM::TagList &tags,
-        const Osmium::OSM::WayNodeList &nodes
-    ) {
+        }
+
+        if(m_way_pool) {
+            m_way_pool->finish();
+        }
+
+        std::cerr << "updated " << m_changedNodes.size() << " nodes and " << ids.size() << " ways, " << current.size() << " of them were already in the database" << std::endl;
+    }
+
+    void write_relation() {
+        if(m_relation_pool) {
+            m_relation_pool->add(m_relation_tracker.prev(), m_relation_tracker.cur(), m_relation_tracker.next());
+        } else {
+            const Osmium::OSM::Relation *cur = m_relation_tracker.cur().get();
+            m_relation_writer.write(m_relation_tracker.prev().get(), cur, m_relation_tracker.next().get(), m_line.rows(cur->id()), m_polygon.rows(cur->id()));
+        }
+    }
+
+    /**
+     * take a checkpoint after the entity, whose versions have all been
+     * written, when the checkpoint interval has passed: the queued versions
+     * are written, the rows of all tables are committed and the position is
+     * saved into the checkpoint file
+     */
+    void checkpoint(osm_object_type_t type, osm_object_id_t id) {
+        if(m_checkpointFile.empty() || time(NULL) - m_lastCheckpoint < m_checkpointInterval) {
+            return;
+        }
+
+        if(m_way_pool) {
+            m_way_pool->finish();
+        }
+        if(m_relation_pool) {
+            m_relation_pool->finish();
+        }
+
+        m_point.checkpoint();
+        m_line.checkpoint();
+        m_polygon.checkpoint();
+        m_way.checkpoint();
+
+        Checkpoint position(type, id);
+        position.write(m_checkpointFile);
+        m_lastCheckpoint = time(NULL);
+
         if(m_debug) {
-            std::cerr << "forging geometry of way " << id << 'v' << version << '.' << minor << " at tstamp " << timestamp << std::endl;
+            std::cerr << "checkpoint after " << position.toString() << std::endl;
         }
+    }
 
-        geos::geom::Geometry* geom = NULL;
-        if(visible) {
-            bool looksLikePolygon = PolygonIdentifyer::looksLikePolygon(tags);
-            geom = m_geom.forWay(nodes, timestamp, looksLikePolygon);
-            if(!geom) {
-                if(m_debug) {
-                    std::cerr << "no valid geometry for way " << id << 'v' << version << '.' << minor << " at tstamp " << timestamp << std::endl;
+    /**
+     * when resuming: delete the rows, that were committed after the last
+     * checkpoint, because an abort can happen between the commits of the
+     * tables. They are written again. The relations are in the polygon
+     * table with their negated ids.
+     */
+    void delete_after_checkpoint() {
+        std::ostringstream cmd;
+        osm_object_id_t id = m_resumeFrom.id();
+
+        switch(m_resumeFrom.type()) {
+            case NODE:
+                cmd << "DELETE FROM " << m_prefix << "point WHERE id > " << id << ";"
+                    << "DELETE FROM " << m_prefix << "line;"
+                    << "DELETE FROM " << m_prefix << "polygon;";
+                if(m_keepWayNodes) {
+                    cmd << "DELETE FROM " << m_prefix << "way;";
                 }
-                return;
-            }
+                break;
+            case WAY:
+                cmd << "DELETE FROM " << m_prefix << "line WHERE id > " << id << " OR id < 0;"
+                    << "DELETE FROM " << m_prefix << "polygon WHERE id > " << id << " OR id < 0;";
+                if(m_keepWayNodes) {
+                    cmd << "DELETE FROM " << m_prefix << "way WHERE id > " << id << ";";
+                }
+                break;
+            default:
+                cmd << "DELETE FROM " << m_prefix << "line WHERE id < " << -id << ";"
+                    << "DELETE FROM " << m_prefix << "polygon WHERE id < " << -id << ";";
+                break;
         }
 
-        // SPEED: sum up 64k of data, before sending them to the database
-        // SPEED: instead of stringstream, which does dynamic allocation, use a fixed buffer and snprintf
-        std::stringstream line;
-        line << std::setprecision(8) <<
-            id << '\t' <<
-            version << '\t' <<
-            minor << '\t' <<
-            (visible ? 't' : 'f') << '\t' <<
-            user_id << '\t' <<
-            DbCopyConn::escape_string(user_name) << '\t' <<
-            Timestamp::formatDb(valid_from) << '\t' <<
-            Timestamp::formatDb(valid_to) << '\t' <<
-            HStore::format(tags) << '\t' <<
-            ZOrderCalculator::calculateZOrder(tags) << '\t';
-
-        if(geom == NULL) {
-            // this entity is deleted, we have no nd-refs and no tags from it to devide whether it once was a line or an areas
-            if(m_way_tracker.prev_is_same_entity()) {
-                // if we have a previous version of this way (which we should have or this way has already been deleted in its initial version)
-                // we can use the previous version to decide between line and area
-
-                const shared_ptr<Osmium::OSM::Way const> prev = m_way_tracker.prev();
-
-                bool looksLikePolygon = PolygonIdentifyer::looksLikePolygon(prev->tags());
-                geom = m_geom.forWay(prev->nodes(), prev->timestamp(), looksLikePolygon);
-
-                if(!geom) {
-                    if(m_debug) {
-                        std::cerr << "no valid geometry for way of " << prev->id() << 'v' << prev->version() << " which was consulted to determine if the deleted way " <<
-                            id << "v" << version << " once was an area or a line. skipping that double-deleted way." << std::endl;
-                    }
-                    return;
-                }
+        m_general.exec(cmd.str());
+    }
 
-                if(geom->getGeometryTypeId() == geos::geom::GEOS_POLYGON) {
-                    line << /*area*/ "0\t" << /* geom */ "\\N\t" << /* center */ "\\N\n";
-                    m_polygon.copy(line.str());
-                } else {
-                    line << /* geom */ "\\N\n";
-                    m_line.copy(line.str());
-                }
-            }
+    /**
+     * the table the rows of name are copied into
+     */
+    std::string copy_table(const char *name) {
+        return m_update ? DbAdapter::stagingTable(name) : std::string(name);
+    }
+
+    /**
+     * close the COPY pipes of the table and report how long the importer
+     * waited for the server while writing to it
+     */
+    void close_table(const char *name, DbShardedCopyConn& table) {
+        std::cerr << "closing " << name << "-table..." << std::endl;
+        table.close();
+
+        if(table.stalls() > 0) {
+            std::cerr << "  waited " << table.stalledSeconds() << "s for the server, " << table.stalls() << " times the queue of the COPY pipes was full" << std::endl;
         }
-        else if(geom->getGeometryTypeId() == geos::geom::GEOS_POLYGON) {
-            const geos::geom::Polygon* poly = dynamic_cast<const geos::geom::Polygon*>(geom);
-
-            // a polygon, polygon-meta to table
-            line << poly->getArea() << '\t';
-
-            // write geometry to polygon table
-            wkb.writeHEX(*geom, line);
-            line << '\t';
-
-            // calculate interior point
-            if(m_interior) {
-                try {
-                    // will leak with invalid geometries on old geos code:
-                    //  http://trac.osgeo.org/geos/ticket/475
-                    geos::geom::Coordinate center;
-                    geos::algorithm::InteriorPointArea interior_calculator(poly);
-                    interior_calculator.getInteriorPoint(center);
-
-                    // write interior point
-                    line << "SRID=900913;POINT(" << center.x << ' ' << center.x << ')';
-                } catch(geos::util::GEOSException e) {
-                    std::cerr << "error calculating interior point: " << e.what() << std::endl;
-                    line << "\\N";
-                }
-            }
-            else
-            {
-                line << "\\N";
-            }
+    }
 
-            line << '\n';
-            m_polygon.copy(line.str());
-        } else {
-            // a linestring, write geometry to line-table
-            wkb.writeHEX(*geom, line);
+    /**
+     * write the rows into compressed files in the output directory, next
+     * to the sql-files of the scheme, which are needed to load them
+     */
+    void open_dump() {
+        if(mkdir(m_outputDir.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("can't create output directory " + m_outputDir);
+        }
 
-            line << '\n';
-            m_line.copy(line.str());
+        copy_scheme("00-before");
+        copy_scheme("99-after");
 
+        m_point.openFiles(m_outputDir, m_prefix, "point");
+        m_line.openFiles(m_outputDir, m_prefix, "line");
+        m_polygon.openFiles(m_outputDir, m_prefix, "polygon");
+        if(m_keepWayNodes) {
+            m_way.openFiles(m_outputDir, m_prefix, "way");
         }
-        delete geom;
+    }
+
+    /**
+     * copy the sql-file of the scheme into the output directory
+     */
+    void copy_scheme(const std::string& name) {
+        std::ofstream out((m_outputDir + "/" + name + ".sql").c_str());
+        out << read_scheme(name);
+        if(!out)
+            throw std::runtime_error("can't write " + name + ".sql into the output directory");
+    }
+
+    /**
+     * list the format and the files of the dump in its manifest, which is
+     * read by load-dump.sh
+     */
+    void write_manifest() {
+        std::ofstream out((m_outputDir + "/manifest").c_str());
+        out << "format\t" << (m_binary ? "binary" : "text") << '\n';
+        m_point.manifest(out);
+        m_line.manifest(out);
+        m_polygon.manifest(out);
+        m_way.manifest(out);
+
+        if(!out)
+            throw std::runtime_error("can't write the manifest into the output directory");
+
+        std::cerr << "wrote the dump to " << m_outputDir << ", load it with load-dump.sh" << std::endl;
+    }
+
+    /**
+     * read the sql-file of the scheme with the given name, or of its
+     * partitioned variant. With --keep-way-nodes the sql-file of the way
+     * table follows, separated by an empty line.
+     */
+    std::string read_scheme(const std::string& name) {
+        std::string sql = read_scheme_file(name + (m_partitioned ? "-partitioned.sql" : ".sql"));
+        if(m_keepWayNodes) {
+            sql += "\n" + read_scheme_file(name + "-way.sql");
+        }
+        return sql;
+    }
+
+    std::string read_scheme_file(const std::string& file) {
+        if(m_debug) {
+            std::cerr << "reading scheme/" << file << std::endl;
+        }
+
+        std::ifstream sqlfile(("scheme/" + file).c_str());
+        if(!sqlfile)
+            sqlfile.open(("/usr/share/osm-history-importer/scheme/" + file).c_str());
+
+        if(!sqlfile)
+            throw std::runtime_error("can't find " + file);
+
+        return std::string((std::istreambuf_iterator<char>(sqlfile)), std::istreambuf_iterator<char>());
     }
 
 public:
@@ -347,13 +511,38 @@ public:
             m_node_tracker(),
             m_store(nodestore),
             m_adapter(),
-            m_geom(m_store, &m_adapter),
-            m_mtimes(m_store, &m_adapter),
             m_sorttest(),
-            wkb(),
-            m_prefix("hist_") {}
-
-    ~ImportHandler() {}
+            m_point(),
+            m_line(),
+            m_polygon(),
+            m_prefix("hist_"),
+            m_indexMemory(),
+            m_outputDir(),
+            m_checkpointFile(),
+            m_indexWorkers(-1),
+            m_binary(false),
+            m_multipolygons(false),
+            m_update(false),
+            m_partitioned(false),
+            m_resume(false),
+            m_keepWayNodes(false),
+            m_threads(1),
+            m_checkpointInterval(300),
+            m_lastCheckpoint(0),
+            m_resumeFrom(),
+            m_username_map(),
+            m_way_writer(m_store, &m_adapter, &m_username_map),
+            m_way_pool(NULL),
+            m_waystore(),
+            m_relation_writer(m_store, &m_waystore, &m_adapter, &m_username_map),
+            m_relation_pool(NULL),
+            m_changedNodes(),
+            m_changedWays() {}
+
+    ~ImportHandler() {
+        delete m_way_pool;
+        delete m_relation_pool;
+    }
 
     std::string dsn() {
         return m_dsn;
@@ -378,6 +567,7 @@ public:
     void printStoreErrors(bool shouldPrintStoreErrors) {
         m_storeerrors = shouldPrintStoreErrors;
         m_store->printStoreErrors(shouldPrintStoreErrors);
+        m_way_writer.printStoreErrors(shouldPrintStoreErrors);
     }
 
     bool isCalculatingInterior() {
@@ -386,6 +576,8 @@ public:
 
     void calculateInterior(bool shouldCalculateInterior) {
         m_interior = shouldCalculateInterior;
+        m_way_writer.calculateInterior(shouldCalculateInterior);
+        m_relation_writer.calculateInterior(shouldCalculateInterior);
     }
 
     bool isKeepingLatLng() {
@@ -394,7 +586,20 @@ public:
 
     void keepLatLng(bool shouldKeepLatLng) {
         m_keepLatLng = shouldKeepLatLng;
-        m_geom.keepLatLng(shouldKeepLatLng);
+        m_way_writer.keepLatLng(shouldKeepLatLng);
+        m_relation_writer.keepLatLng(shouldKeepLatLng);
+    }
+
+    bool isCopyingBinary() {
+        return m_binary;
+    }
+
+    void copyBinary(bool shouldCopyBinary) {
+        m_binary = shouldCopyBinary;
+        m_point.binary(shouldCopyBinary);
+        m_line.binary(shouldCopyBinary);
+        m_polygon.binary(shouldCopyBinary);
+        m_way.binary(shouldCopyBinary);
     }
 
     bool isPrintingDebugMessages() {
@@ -404,63 +609,286 @@ public:
     void printDebugMessages(bool shouldPrintDebugMessages) {
         m_debug = shouldPrintDebugMessages;
         m_store->printDebugMessages(shouldPrintDebugMessages);
-        m_geom.printDebugMessages(shouldPrintDebugMessages);
+        m_way_writer.printDebugMessages(shouldPrintDebugMessages);
+        m_relation_writer.printDebugMessages(shouldPrintDebugMessages);
+    }
+
+    time_t minorGranularity() {
+        return m_way_writer.minorGranularity();
+    }
+
+    /**
+     * set the length of the time buckets in seconds, node changes in the
+     * same bucket make only one minor version
+     */
+    void minorGranularity(time_t seconds) {
+        m_way_writer.minorGranularity(seconds);
+        m_relation_writer.minorGranularity(seconds);
+    }
+
+    bool isBuildingMultipolygons() {
+        return m_multipolygons;
+    }
+
+    /**
+     * build the geometries of the multipolygon relations, this needs the
+     * node lists of all way versions to be kept in memory
+     */
+    void buildMultipolygons(bool shouldBuildMultipolygons) {
+        m_multipolygons = shouldBuildMultipolygons;
+    }
+
+    uint64_t waystoreMemory() {
+        return m_waystore.limit();
+    }
+
+    /**
+     * set the number of bytes the waystore may use for the multipolygons,
+     * 0 for no limit
+     */
+    void waystoreMemory(uint64_t bytes) {
+        m_waystore.limit(bytes);
+    }
+
+    bool isUpdating() {
+        return m_update;
+    }
+
+    /**
+     * apply a change file to an imported database instead of importing a
+     * file into a new one
+     */
+    void update(bool shouldUpdate) {
+        m_update = shouldUpdate;
+    }
+
+    bool isKeepingWayNodes() {
+        return m_keepWayNodes;
+    }
+
+    /**
+     * write the tags and node lists of all way versions into the way
+     * table, which --update needs to find and rebuild the ways
+     */
+    void keepWayNodes(bool shouldKeepWayNodes) {
+        m_keepWayNodes = shouldKeepWayNodes;
+    }
+
+    bool isPartitioned() {
+        return m_partitioned;
+    }
+
+    /**
+     * create the tables with the partitioned variant of the scheme
+     */
+    void partitioned(bool shouldBePartitioned) {
+        m_partitioned = shouldBePartitioned;
+    }
+
+    std::string indexMemory() {
+        return m_indexMemory;
+    }
+
+    /**
+     * set the maintenance_work_mem of each connection building indexes
+     */
+    void indexMemory(const std::string& memory) {
+        m_indexMemory = memory;
+    }
+
+    int indexWorkers() {
+        return m_indexWorkers;
+    }
+
+    /**
+     * set the max_parallel_maintenance_workers of each connection
+     * building indexes, a negative number keeps the default
+     */
+    void indexWorkers(int workers) {
+        m_indexWorkers = workers;
+    }
+
+    std::string outputDir() {
+        return m_outputDir;
+    }
+
+    /**
+     * write the rows into compressed files in this directory instead of
+     * the database, an empty string writes into the database
+     */
+    void outputDir(const std::string& dir) {
+        m_outputDir = dir;
+    }
+
+    std::string checkpointFile() {
+        return m_checkpointFile;
+    }
+
+    /**
+     * take checkpoints and save their positions into this file, an empty
+     * string takes no checkpoints
+     */
+    void checkpointFile(const std::string& file) {
+        m_checkpointFile = file;
+    }
+
+    time_t checkpointInterval() {
+        return m_checkpointInterval;
+    }
+
+    /**
+     * set the number of seconds between two checkpoints
+     */
+    void checkpointInterval(time_t seconds) {
+        m_checkpointInterval = seconds;
+    }
+
+    bool isResuming() {
+        return m_resume;
+    }
+
+    /**
+     * continue an aborted import after the checkpoint in the checkpoint file
+     */
+    void resume(bool shouldResume) {
+        m_resume = shouldResume;
+    }
+
+    size_t copyStreams() {
+        return m_point.shards();
+    }
+
+    /**
+     * set the number of COPY pipes per table
+     */
+    void copyStreams(size_t numStreams) {
+        m_point.shards(numStreams);
+        m_line.shards(numStreams);
+        m_polygon.shards(numStreams);
+        m_way.shards(numStreams);
+    }
+
+    size_t threads() {
+        return m_threads;
+    }
+
+    /**
+     * set the number of threads building the way and relation geometries
+     */
+    void threads(size_t numThreads) {
+        m_threads = numThreads;
     }
 
 
 
     void init(Osmium::OSM::Meta& meta) {
-        if(m_debug) {
-            std::cerr << "connecting to database using dsn: " << m_dsn << std::endl;
+        if(!m_outputDir.empty()) {
+            open_dump();
+            m_progress.init(meta);
+            return;
         }
 
-        m_general.open(m_dsn);
         if(m_debug) {
-            std::cerr << "running scheme/00-before.sql" << std::endl;
+            std::cerr << "connecting to database using dsn: " << m_dsn << std::endl;
         }
 
-        std::ifstream sqlfile("scheme/00-before.sql");
-        if(!sqlfile)
-            sqlfile.open("/usr/share/osm-history-importer/scheme/00-before.sql");
+        if(m_update) {
+            // the rows are added to the tables and the open rows are changed
+            m_adapter.open(m_dsn, m_prefix);
+        } else if(m_resume) {
+            // the tables keep the rows written before the checkpoint
+            m_resumeFrom.read(m_checkpointFile);
+            std::cerr << "resuming after " << m_resumeFrom.toString() << ", the entities before it are read but not written again" << std::endl;
 
-        if(!sqlfile)
-            throw std::runtime_error("can't find 00-before.sql");
-
-        m_general.execfile(sqlfile);
+            m_general.open(m_dsn);
+            delete_after_checkpoint();
+        } else {
+            m_general.open(m_dsn);
+            m_general.exec(read_scheme("00-before"));
+        }
 
-        m_point.open(m_dsn, m_prefix, "point");
-        m_line.open(m_dsn, m_prefix, "line");
-        m_polygon.open(m_dsn, m_prefix, "polygon");
+        // in update mode the rows are copied into the staging tables of the
+        // adapter, which moves them into the tables when it commits
+        bool truncate = !m_update && !m_resume;
+        m_point.open(m_dsn, m_prefix, copy_table("point"), truncate);
+        m_line.open(m_dsn, m_prefix, copy_table("line"), truncate);
+        m_polygon.open(m_dsn, m_prefix, copy_table("polygon"), truncate);
+        if(m_keepWayNodes || m_update) {
+            m_way.open(m_dsn, m_prefix, copy_table("way"), truncate);
+        }
 
+        m_lastCheckpoint = time(NULL);
         m_progress.init(meta);
-
-        wkb.setIncludeSRID(true);
     }
 
     void final() {
+        if(m_way_pool) {
+            m_way_pool->finish();
+        }
+
+        if(m_relation_pool) {
+            m_relation_pool->finish();
+        }
+
         m_progress.final();
 
-        std::cerr << "closing point-table..." << std::endl;
-        m_point.close();
+        uint64_t minorWritten = m_way_writer.minorVersionsWritten();
+        uint64_t minorSuppressed = m_way_writer.minorVersionsSuppressed();
+        if(m_way_pool) {
+            minorWritten += m_way_pool->minorVersionsWritten();
+            minorSuppressed += m_way_pool->minorVersionsSuppressed();
+        }
+        std::cerr << "wrote " << minorWritten << " minor way versions, " << minorSuppressed << " minor way versions with an unchanged geometry were merged into the version before them" << std::endl;
+
+        if(m_multipolygons) {
+            uint64_t relationsWritten = m_relation_writer.versionsWritten();
+            minorWritten = m_relation_writer.minorVersionsWritten();
+            minorSuppressed = m_relation_writer.minorVersionsSuppressed();
+            if(m_relation_pool) {
+                relationsWritten += m_relation_pool->versionsWritten();
+                minorWritten += m_relation_pool->minorVersionsWritten();
+                minorSuppressed += m_relation_pool->minorVersionsSuppressed();
+            }
+            std::cerr << "wrote " << relationsWritten << " multipolygon rows, including " << minorWritten << " minor versions, " << minorSuppressed << " minor versions with an unchanged geometry were merged into the version before them" << std::endl;
+        }
 
-        std::cerr << "closing line-table..." << std::endl;
-        m_line.close();
+        close_table("point", m_point);
+        close_table("line", m_line);
+        close_table("polygon", m_polygon);
+        if(m_keepWayNodes || m_update) {
+            close_table("way", m_way);
+        }
 
-        std::cerr << "closing polygon-table..." << std::endl;
-        m_polygon.close();
+        if(!m_outputDir.empty()) {
+            write_manifest();
+            return;
+        }
 
-        if(m_debug) {
-            std::cerr << "running scheme/99-after.sql" << std::endl;
+        // the staged rows are committed, now the adapter can replace the
+        // rows in the tables in its transaction
+        if(m_update) {
+            std::cerr << "moving the new rows into the tables..." << std::endl;
+            m_adapter.commit();
+            if(m_debug) {
+                std::cerr << "disconnecting from database" << std::endl;
+            }
+            m_adapter.close();
+            return;
         }
 
-        std::ifstream sqlfile("scheme/99-after.sql");
-        if(!sqlfile)
-            sqlfile.open("/usr/share/osm-history-importer/scheme/99-after.sql");
+        // the indexes of the tables are built at the same time
+        std::istringstream sqlfile(read_scheme("99-after"));
 
-        if(!sqlfile)
-            throw std::runtime_error("can't find 99-after.sql");
+        IndexBuilder indexes(m_dsn);
+        indexes.memory(m_indexMemory);
+        indexes.workers(m_indexWorkers);
+        indexes.printDebugMessages(m_debug);
+        indexes.execfile(sqlfile);
 
-        m_general.execfile(sqlfile);
+        // the import is complete, there's nothing left to resume
+        if(!m_checkpointFile.empty()) {
+            unlink(m_checkpointFile.c_str());
+        }
 
         if(m_debug) {
             std::cerr << "disconnecting from database" << std::endl;
@@ -477,6 +905,10 @@ public:
         // we're always writing the one-off node
         if(m_node_tracker.has_cur()) {
             write_node();
+
+            if(!m_node_tracker.next_is_same_entity() && !m_resumeFrom.covers(NODE, m_node_tracker.cur()->id())) {
+                checkpoint(NODE, m_node_tracker.cur()->id());
+            }
         }
 
         m_node_tracker.swap();
@@ -489,15 +921,46 @@ public:
         }
 
         m_node_tracker.swap();
+        m_store->printAccuracyReport();
+    }
+
+    void before_ways() {
+        // the workers are started after the nodes have been read, so they
+        // see the complete nodestore and username map. In update mode both
+        // are completed from the database after the ways are read.
+        if(m_threads > 1 && !m_way_pool && !m_update) {
+            m_way_pool = new WayPool(m_threads, m_way_writer, &m_line, &m_polygon);
+        }
     }
 
     void way(const shared_ptr<Osmium::OSM::Way const>& way) {
         m_sorttest.test(way);
+
+        if(m_update) {
+            m_changedWays.push_back(way);
+            m_progress.way(way);
+            return;
+        }
+
+        if(m_multipolygons) {
+            m_waystore.record(*way);
+        }
+
+        // the ways before the checkpoint are only needed in the waystore
+        if(m_resumeFrom.covers(WAY, way->id())) {
+            m_progress.way(way);
+            return;
+        }
+
         m_way_tracker.feed(way);
 
         // we're always writing the one-off way
         if(m_way_tracker.has_cur()) {
             write_way();
+
+            if(!m_way_tracker.next_is_same_entity()) {
+                checkpoint(WAY, m_way_tracker.cur()->id());
+            }
         }
 
         m_way_tracker.swap();
@@ -505,11 +968,65 @@ public:
     }
 
     void after_ways() {
+        if(m_update) {
+            update_ways();
+            return;
+        }
+
         if(m_way_tracker.has_cur()) {
             write_way();
         }
 
         m_way_tracker.swap();
+
+        if(m_way_pool) {
+            m_way_pool->finish();
+        }
+
+        if(m_multipolygons) {
+            std::cerr << "recorded " << m_waystore.size() << " way versions in " << (m_waystore.memoryUsage() / 1024 / 1024) << " MB for the multipolygons" << std::endl;
+        }
+    }
+
+    void before_relations() {
+        // the waystore is complete when the relations are read
+        if(m_multipolygons && m_threads > 1 && !m_relation_pool) {
+            m_relation_pool = new RelationPool(m_threads, m_relation_writer, &m_line, &m_polygon);
+        }
+    }
+
+    void relation(const shared_ptr<Osmium::OSM::Relation const>& relation) {
+        m_sorttest.test(relation);
+        m_progress.relation(relation);
+
+        if(!m_multipolygons || m_resumeFrom.covers(RELATION, relation->id())) {
+            return;
+        }
+
+        m_relation_tracker.feed(relation);
+
+        // we're always writing the one-off relation
+        if(m_relation_tracker.has_cur()) {
+            write_relation();
+
+            if(!m_relation_tracker.next_is_same_entity()) {
+                checkpoint(RELATION, m_relation_tracker.cur()->id());
+            }
+        }
+
+        m_relation_tracker.swap();
+    }
+
+    void after_relations() {
+        if(m_relation_tracker.has_cur()) {
+            write_relation();
+        }
+
+        m_relation_tracker.swap();
+
+        if(m_relation_pool) {
+            m_relation_pool->finish();
+        }
     }
 };
 
@@ -21,11 +21,11 @@ class HStore {
 private:
     /**
      * escake a key or a value for using it in the quoted external notation
+     * and append it to out, which can be anything with an append-method
+     * like std::string or RowBuffer
      */
-    static std::string escape(const char* str) {
-        // SPEED: instead of stringstream, which does dynamic allocation, use a fixed buffer
-        std::stringstream escaped;
-
+    template <class TOut>
+    static void escape(const char* str, TOut& out) {
         // iterate over all chars, one by one
         for(int i = 0; ; i++) {
             // the current char
@@ -34,24 +34,24 @@ private:
             // look for special cases
             switch(c) {
                 case '\\':
-                    escaped << "\\\\\\\\";
+                    out.append("\\\\\\\\", 4);
                     break;
                 case '"':
-                    escaped << "\\\\\"";
+                    out.append("\\\\\"", 3);
                     break;
                 case '\t':
-                    escaped << "\\\t";
+                    out.append("\\\t", 2);
                     break;
                 case '\r':
-                    escaped << "\\\r";
+                    out.append("\\\r", 2);
                     break;
                 case '\n':
-                    escaped << "\\\n";
+                    out.append("\\\n", 2);
                     break;
                 case '\0':
-                    return escaped.str();
+                    return;
                 default:
-                    escaped << c;
+                    out.append(&c, 1);
                     break;
             }
         }
@@ -59,29 +59,33 @@ private:
 
 public:
     /**
-     * format a taglist as external hstore noration
+     * format a taglist as external hstore noration and append it to out
      */
-    static std::string format(const Osmium::OSM::TagList& tags) {
-        // SPEED: instead of stringstream, which does dynamic allocation, use a fixed buffer
-        std::stringstream hstore;
-
+    template <class TOut>
+    static void format(const Osmium::OSM::TagList& tags, TOut& out) {
         // iterate over all tags
         for(Osmium::OSM::TagList::const_iterator it = tags.begin(); it != tags.end(); ++it) {
-            // escape key and value
-            std::string k = escape(it->key());
-            std::string v = escape(it->value());
-
-            // add to string representation
-            hstore << '"' << k << "\"=>\"" << v << '"';
+            // add escaped key and value to string representation
+            out.append("\"", 1);
+            escape(it->key(), out);
+            out.append("\"=>\"", 4);
+            escape(it->value(), out);
+            out.append("\"", 1);
 
             // if necessary, add a delimiter
             if(it+1 != tags.end()) {
-                hstore << ',';
+                out.append(",", 1);
             }
         }
+    }
 
-        // return the generated string
-        return hstore.str();
+    /**
+     * format a taglist as external hstore noration
+     */
+    static std::string format(const Osmium::OSM::TagList& tags) {
+        std::string hstore;
+        format(tags, hstore);
+        return hstore;
     }
 };
 
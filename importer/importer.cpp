@@ -8,6 +8,7 @@
  */
 
 #include <getopt.h>
+#include <unistd.h>
 
 #define OSMIUM_MAIN
 #define OSMIUM_WITH_PBF_INPUT
@@ -29,9 +30,11 @@
  */
 int main(int argc, char *argv[]) {
     // local variables for the options/switches on the commandline
-    std::string filename, nodestore = "stl", dsn, prefix = "hist_";
+    std::string filename, nodestore = "stl", mmapDir = ".", nodestoreIndex = "sparse", copyFormat = "text", dsn, prefix = "hist_", minorGranularity = "second", indexMemory, outputDir, checkpointFile;
     bool printDebugMessages = false, printStoreErrors = false, calculateInterior = false;
-    bool showHelp = false, keepLatLng = false;
+    bool showHelp = false, keepLatLng = false, compressNodes = false, projectedNodes = false, useProj4 = false, multipolygons = false, keepWayNodes = false, update = false, partitioned = false, resume = false;
+    int threads = 1, copyStreams = 1, indexWorkers = -1, checkpointInterval = 300;
+    long waystoreMemory = sysconf(_SC_PHYS_PAGES) / 1024 * sysconf(_SC_PAGESIZE) / 1024;
 
     // options configuration array for getopt
     static struct option long_options[] = {
@@ -41,15 +44,35 @@ int main(int argc, char *argv[]) {
         {"interior",            no_argument, 0, 'i'},
         {"latlng",              no_argument, 0, 'l'},
         {"latlon",              no_argument, 0, 'l'},
+        {"proj4",               no_argument, 0, 'j'},
         {"nodestore",           required_argument, 0, 'S'},
+        {"mmap-dir",            required_argument, 0, 'M'},
+        {"nodestore-index",     required_argument, 0, 'N'},
+        {"compress-nodes",      no_argument, 0, 'C'},
+        {"projected-nodes",     no_argument, 0, 'G'},
         {"dsn",                 required_argument, 0, 'D'},
         {"prefix",              required_argument, 0, 'P'},
+        {"copy-format",         required_argument, 0, 'F'},
+        {"threads",             required_argument, 0, 'T'},
+        {"copy-streams",        required_argument, 0, 'K'},
+        {"minor-granularity",   required_argument, 0, 'g'},
+        {"multipolygons",       no_argument, 0, 'R'},
+        {"waystore-memory",     required_argument, 0, 'w'},
+        {"keep-way-nodes",      no_argument, 0, 'k'},
+        {"update",              no_argument, 0, 'U'},
+        {"partitioned",         no_argument, 0, 'p'},
+        {"index-memory",        required_argument, 0, 'm'},
+        {"index-workers",       required_argument, 0, 'W'},
+        {"output-dir",          required_argument, 0, 'o'},
+        {"checkpoint",          required_argument, 0, 'c'},
+        {"checkpoint-interval", required_argument, 0, 'I'},
+        {"resume",              no_argument, 0, 'r'},
         {0, 0, 0, 0}
     };
 
     // walk through the options
     while(1) {
-        int c = getopt_long(argc, argv, "hdeilS:D:P:", long_options, 0);
+        int c = getopt_long(argc, argv, "hdeiljS:M:N:CGD:P:F:T:K:g:Rw:kUpm:W:o:c:I:r", long_options, 0);
         if (c == -1)
             break;
 
@@ -81,11 +104,36 @@ int main(int argc, char *argv[]) {
                 keepLatLng = true;
                 break;
 
+            // project using proj4 instead of the built-in projection
+            case 'j':
+                useProj4 = true;
+                break;
+
             // set the nodestore
             case 'S':
                 nodestore = optarg;
                 break;
 
+            // set the directory the mmap nodestore places its files in
+            case 'M':
+                mmapDir = optarg;
+                break;
+
+            // set the id index used by the sparse nodestore
+            case 'N':
+                nodestoreIndex = optarg;
+                break;
+
+            // store the node versions of the sparse nodestore as compressed chains
+            case 'C':
+                compressNodes = true;
+                break;
+
+            // store the node coordinates already projected to mercator
+            case 'G':
+                projectedNodes = true;
+                break;
+
             // set the database dsn, check the postgres documentation for syntax
             case 'D':
                 dsn = optarg;
@@ -95,6 +143,81 @@ int main(int argc, char *argv[]) {
             case 'P':
                 prefix = optarg;
                 break;
+
+            // set the format of the COPY pipes
+            case 'F':
+                copyFormat = optarg;
+                break;
+
+            // set the number of threads building the way geometries
+            case 'T':
+                threads = atoi(optarg);
+                break;
+
+            // set the number of COPY pipes per table
+            case 'K':
+                copyStreams = atoi(optarg);
+                break;
+
+            // set the granularity of the minor versions
+            case 'g':
+                minorGranularity = optarg;
+                break;
+
+            // build the history of the multipolygon relations
+            case 'R':
+                multipolygons = true;
+                break;
+
+            // limit the memory of the way versions kept for the multipolygons
+            case 'w':
+                waystoreMemory = atol(optarg);
+                break;
+
+            // write the node lists of the way versions, so the database can be updated
+            case 'k':
+                keepWayNodes = true;
+                break;
+
+            // apply a change file to an imported database
+            case 'U':
+                update = true;
+                break;
+
+            // create partitioned tables with validity ranges
+            case 'p':
+                partitioned = true;
+                break;
+
+            // set the maintenance_work_mem of the connections building the indexes
+            case 'm':
+                indexMemory = optarg;
+                break;
+
+            // set the parallel workers of the connections building the indexes
+            case 'W':
+                indexWorkers = atoi(optarg);
+                break;
+
+            // write the rows into files instead of the database
+            case 'o':
+                outputDir = optarg;
+                break;
+
+            // commit the rows from time to time and save the position of the import
+            case 'c':
+                checkpointFile = optarg;
+                break;
+
+            // set the number of seconds between two checkpoints
+            case 'I':
+                checkpointInterval = atoi(optarg);
+                break;
+
+            // continue an aborted import after its last checkpoint
+            case 'r':
+                resume = true;
+                break;
         }
     }
 
@@ -115,19 +238,108 @@ int main(int argc, char *argv[]) {
             << "       calculate the interior-point ans store it in the database" << std::endl
             << "  -l|--latlng" << std::endl
             << "       keep lat/lng ant don't transform to mercator" << std::endl
+            << "  -j|--proj4" << std::endl
+            << "       transform to mercator using proj4 instead of the built-in projection," << std::endl
+            << "       which is slower but can be used to verify the results" << std::endl
             << "  -s|--nodestore" << std::endl
             << "       set the nodestore type [defaults to '" << nodestore << "']" << std::endl
             << "       possible values: " << std::endl
             << "          stl    (needs more memory but is more robust and a little faster)" << std::endl
             << "          sparse (needs much, much less memory but is still experimental)" << std::endl
+            << "          mmap   (like sparse, but backed by files, so the kernel can page out cold nodes)" << std::endl
+            << "  -M|--mmap-dir" << std::endl
+            << "       set the directory the mmap nodestore places its files in [defaults to '" << mmapDir << "']" << std::endl
+            << "  -N|--nodestore-index" << std::endl
+            << "       set the id index of the sparse nodestore [defaults to '" << nodestoreIndex << "']" << std::endl
+            << "       possible values: " << std::endl
+            << "          sparse (a sparsetable, only needs memory for used ids, best for extracts)" << std::endl
+            << "          dense  (a flat array of 5 bytes per id, faster and smaller for a planet)" << std::endl
+            << "  -C|--compress-nodes" << std::endl
+            << "       store the node versions of the sparse nodestore as delta-compressed chains," << std::endl
+            << "       needs around half the memory but lookups are a little slower" << std::endl
+            << "  -G|--projected-nodes" << std::endl
+            << "       store the node coordinates in the nodestore already projected to mercator," << std::endl
+            << "       so they are not projected again for each way version (ignored with --latlng)" << std::endl
             << "  -D|--dsn" << std::endl
             << "       set the database dsn, check the postgres documentation for syntax" << std::endl
             << "  -P|--prefix" << std::endl
-            << "       set the table-prefix [defaults to '"  << prefix << "']" << std::endl;
+            << "       set the table-prefix [defaults to '"  << prefix << "']" << std::endl
+            << "  -F|--copy-format" << std::endl
+            << "       set the format of the COPY pipes into the database [defaults to '"  << copyFormat << "']" << std::endl
+            << "       possible values: " << std::endl
+            << "          text   (the human readable text format)" << std::endl
+            << "          binary (less bytes and less parsing work for the database server)" << std::endl
+            << "  -T|--threads" << std::endl
+            << "       set the number of threads building the way geometries [defaults to " << threads << "]" << std::endl
+            << "  -K|--copy-streams" << std::endl
+            << "       set the number of COPY pipes (and database connections) per table [defaults to " << copyStreams << "]" << std::endl
+            << "  -g|--minor-granularity" << std::endl
+            << "       merge the node changes within this time into one minor way version [defaults to '" << minorGranularity << "']" << std::endl
+            << "       possible values: " << std::endl
+            << "          second, minute, hour, day, week" << std::endl
+            << "          a number of seconds, optionally followed by a unit s, m, h, d or w, like 15m or 2d" << std::endl
+            << "  -R|--multipolygons" << std::endl
+            << "       build the geometries of the multipolygon relations and their minor versions," << std::endl
+            << "       needs to keep the node lists of all way versions in memory" << std::endl
+            << "  -w|--waystore-memory" << std::endl
+            << "       abort, when the node lists of the way versions need more then this number of MB," << std::endl
+            << "       0 for no limit [defaults to the physical memory, " << waystoreMemory << " MB]" << std::endl
+            << "  -k|--keep-way-nodes" << std::endl
+            << "       write the tags and node lists of all way versions into the way table, which" << std::endl
+            << "       --update needs later on to find the ways of the changed nodes" << std::endl
+            << "  -U|--update" << std::endl
+            << "       apply a sorted change file to a database imported with --keep-way-nodes," << std::endl
+            << "       the stl nodestore is used and the multipolygons are not updated" << std::endl
+            << "  -p|--partitioned" << std::endl
+            << "       create the tables partitioned by the year of valid_from, with a validity range" << std::endl
+            << "       column and a GIST index on it (needs postgresql 12, render with --partitioned)" << std::endl
+            << "  -m|--index-memory" << std::endl
+            << "       set the maintenance_work_mem of each connection building the indexes of a table" << std::endl
+            << "       after the import, like 2GB [defaults to the setting of the server]" << std::endl
+            << "  -W|--index-workers" << std::endl
+            << "       set the max_parallel_maintenance_workers of each connection building the indexes" << std::endl
+            << "       of a table [defaults to the setting of the server]" << std::endl
+            << "  -o|--output-dir" << std::endl
+            << "       don't connect to the database, write gzip-compressed COPY files, the scheme and" << std::endl
+            << "       a manifest into this directory instead, load them later with load-dump.sh" << std::endl
+            << "  -c|--checkpoint" << std::endl
+            << "       take checkpoints: commit the rows written so far and save the position of the" << std::endl
+            << "       import into this file, so an aborted import can be resumed" << std::endl
+            << "  -I|--checkpoint-interval" << std::endl
+            << "       set the number of seconds between two checkpoints [defaults to " << checkpointInterval << "]" << std::endl
+            << "  -r|--resume" << std::endl
+            << "       continue an aborted import after the checkpoint in the --checkpoint file," << std::endl
+            << "       with the same input file and options" << std::endl;
 
         return 1;
     }
 
+    if(update && outputDir.size()) {
+        std::cerr << "--update needs the database and can't be used with --output-dir" << std::endl;
+        return 1;
+    }
+
+    if(compressNodes && (update || nodestore != "sparse")) {
+        std::cerr << "--compress-nodes only works with the sparse nodestore, which --update doesn't use" << std::endl;
+        return 1;
+    }
+
+    if(checkpointFile.size() && (update || outputDir.size())) {
+        std::cerr << "--checkpoint commits into the database and can't be used with --update or --output-dir" << std::endl;
+        return 1;
+    }
+
+    if(resume && checkpointFile.empty()) {
+        std::cerr << "--resume needs the --checkpoint file of the aborted import" << std::endl;
+        return 1;
+    }
+
+    time_t granularity = MinorTimesCalculator::parseGranularity(minorGranularity);
+    if(!granularity) {
+        std::cerr << "invalid minor granularity: " << minorGranularity << std::endl;
+        return 1;
+    }
+
     // strip off the filename
     filename = argv[optind];
 
@@ -136,11 +348,24 @@ int main(int argc, char *argv[]) {
 
     // create an instance of the import-handler
     Nodestore *store;
-    if(nodestore == "sparse")
-        store = new NodestoreSparse();
+    if(update)
+        // the histories read from the database are added out of order
+        store = new NodestoreStl();
+    else if(nodestore == "sparse")
+        store = new NodestoreSparse(nodestoreIndex == "dense", compressNodes);
+    else if(nodestore == "mmap")
+        store = new NodestoreMmap(mmapDir);
     else
         store = new NodestoreStl();
 
+    // store projected coordinates, unless the coordinates are not projected at all
+    store->storeProjected(projectedNodes && !keepLatLng);
+
+    // the coordinates in the database are projected
+    if(update) {
+        store->storeProjected(!keepLatLng);
+    }
+
     // create an instance of the import-handler
     ImportHandler handler(store);
 
@@ -155,6 +380,22 @@ int main(int argc, char *argv[]) {
     handler.printStoreErrors(printStoreErrors);
     handler.calculateInterior(calculateInterior);
     handler.keepLatLng(keepLatLng);
+    Project::useProj4(useProj4);
+    handler.copyBinary(copyFormat == "binary");
+    handler.threads(threads > 1 ? threads : 1);
+    handler.copyStreams(copyStreams > 1 ? copyStreams : 1);
+    handler.minorGranularity(granularity);
+    handler.buildMultipolygons(multipolygons && !update);
+    handler.waystoreMemory(waystoreMemory > 0 ? static_cast< uint64_t >(waystoreMemory) * 1024 * 1024 : 0);
+    handler.keepWayNodes(keepWayNodes && !update);
+    handler.update(update);
+    handler.partitioned(partitioned);
+    handler.indexMemory(indexMemory);
+    handler.indexWorkers(indexWorkers);
+    handler.outputDir(outputDir);
+    handler.checkpointFile(checkpointFile);
+    handler.checkpointInterval(checkpointInterval > 0 ? checkpointInterval : 1);
+    handler.resume(resume);
 
     // read the input-file to the handler
     Osmium::Input::read(infile, handler);
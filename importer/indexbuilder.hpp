@@ -0,0 +1,237 @@
+/**
+ * After the import 99-after.sql adds the primary keys and builds the
+ * indexes of the tables. Run on one connection, the tables are handled
+ * one after another and most of the server is idle. The IndexBuilder
+ * runs the statements of each table on its own connection, in its own
+ * thread, so the tables are indexed at the same time. The statements of
+ * one table still run one after another, because adding a primary key
+ * locks the whole table.
+ *
+ * The statements of a table are the statements of a block in the
+ * sql-file, blocks are separated by empty lines. Comment lines are
+ * skipped. Each session can be given its own maintenance_work_mem and
+ * number of parallel maintenance workers, and the wall time of every
+ * statement is reported.
+ */
+
+#ifndef IMPORTER_INDEXBUILDER_HPP
+#define IMPORTER_INDEXBUILDER_HPP
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dbconn.hpp"
+
+/**
+ * Runs the blocks of an sql-file on parallel connections
+ */
+class IndexBuilder {
+private:
+    /**
+     * the statements of one table, run by one thread on one connection
+     */
+    struct Block {
+        IndexBuilder *builder;
+        pthread_t thread;
+        std::vector<std::string> statements;
+
+        /**
+         * the message of the exception that stopped the block, if any
+         */
+        std::string error;
+
+        Block(IndexBuilder *b) : builder(b), thread(), statements(), error() {}
+    };
+
+    std::string m_dsn, m_memory;
+    int m_workers;
+    bool m_debug;
+
+    /**
+     * serializes the reports of the threads
+     */
+    pthread_mutex_t m_mutex;
+
+    static double now() {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+
+    static bool isBlank(const std::string& line) {
+        return line.find_first_not_of(" \t\r") == std::string::npos;
+    }
+
+    static void* run(void *arg) {
+        Block *block = static_cast< Block* >(arg);
+        block->builder->build(block);
+        return NULL;
+    }
+
+    static std::string formatSeconds(double seconds) {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1) << seconds << 's';
+        return out.str();
+    }
+
+    void report(double seconds, const std::string& statement) {
+        pthread_mutex_lock(&m_mutex);
+        std::cerr << "  " << formatSeconds(seconds) << ' ' << statement << std::endl;
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    void build(Block *block) {
+        try {
+            DbConn conn;
+            conn.open(m_dsn);
+
+            if(!m_memory.empty()) {
+                conn.exec("SET maintenance_work_mem TO '" + m_memory + "';");
+            }
+
+            if(m_workers >= 0) {
+                std::ostringstream cmd;
+                cmd << "SET max_parallel_maintenance_workers TO " << m_workers << ";";
+                conn.exec(cmd.str());
+            }
+
+            for(std::vector<std::string>::const_iterator it = block->statements.begin(); it != block->statements.end(); ++it) {
+                double start = now();
+                conn.exec(*it);
+                report(now() - start, *it);
+            }
+
+            conn.close();
+        } catch(std::exception& e) {
+            block->error = e.what();
+        }
+    }
+
+    /**
+     * split the sql-file into blocks of statements
+     */
+    void parse(std::istream& f, std::vector<Block*>& blocks) {
+        Block *block = NULL;
+        std::string line, statement;
+
+        while(std::getline(f, line)) {
+            if(isBlank(line)) {
+                block = NULL;
+                continue;
+            }
+
+            if(line.compare(0, 2, "--") == 0) {
+                continue;
+            }
+
+            if(!block) {
+                block = new Block(this);
+                blocks.push_back(block);
+            }
+
+            statement += line;
+
+            // a statement ends with a semicolon at the end of its last line
+            size_t end = line.find_last_not_of(" \t\r");
+            if(line[end] == ';') {
+                block->statements.push_back(statement);
+                statement.clear();
+            } else {
+                statement += '\n';
+            }
+        }
+
+        if(!isBlank(statement)) {
+            for(size_t i = 0; i < blocks.size(); i++) {
+                delete blocks[i];
+            }
+            blocks.clear();
+            throw std::runtime_error("unterminated statement at the end of the sql-file");
+        }
+    }
+
+public:
+    /**
+     * Create a builder connecting to the database specified by the dsn
+     */
+    IndexBuilder(const std::string& dsn) :
+            m_dsn(dsn),
+            m_memory(),
+            m_workers(-1),
+            m_debug(false) {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    ~IndexBuilder() {
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    /**
+     * set the maintenance_work_mem of each connection, like '2GB', an
+     * empty string keeps the default of the server
+     */
+    void memory(const std::string& memory) {
+        m_memory = memory;
+    }
+
+    /**
+     * set the max_parallel_maintenance_workers of each connection, a
+     * negative number keeps the default of the server
+     */
+    void workers(int workers) {
+        m_workers = workers;
+    }
+
+    void printDebugMessages(bool shouldPrintDebugMessages) {
+        m_debug = shouldPrintDebugMessages;
+    }
+
+    /**
+     * Run the blocks of the sql-file in parallel and wait for all of them
+     */
+    void execfile(std::istream& f) {
+        std::vector<Block*> blocks;
+        parse(f, blocks);
+
+        if(m_debug) {
+            std::cerr << "building indexes on " << blocks.size() << " connections" << std::endl;
+        }
+
+        double start = now();
+        size_t started = 0;
+        for(; started < blocks.size(); started++) {
+            if(pthread_create(&blocks[started]->thread, NULL, &IndexBuilder::run, blocks[started]) != 0) {
+                break;
+            }
+        }
+
+        std::string error;
+        if(started < blocks.size()) {
+            error = "can't start index thread";
+        }
+
+        for(size_t i = 0; i < blocks.size(); i++) {
+            if(i < started) {
+                pthread_join(blocks[i]->thread, NULL);
+            }
+            if(error.empty() && !blocks[i]->error.empty()) {
+                error = blocks[i]->error;
+            }
+            delete blocks[i];
+        }
+
+        if(!error.empty()) {
+            throw std::runtime_error(error);
+        }
+
+        std::cerr << "built the indexes in " << formatSeconds(now() - start) << std::endl;
+    }
+};
+
+#endif // IMPORTER_INDEXBUILDER_HPP
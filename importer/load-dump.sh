@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# load a dump written by osm-history-importer --output-dir into a database:
+# the tables are created with the scheme of the dump, the COPY files are
+# loaded in parallel and the indexes of the tables are built in parallel,
+# each block of 99-after.sql on its own connection
+#
+# settings for the sessions, like maintenance_work_mem, can be passed in
+# PGOPTIONS, eg. PGOPTIONS='-c maintenance_work_mem=2GB'
+#
+set -e
+
+JOBS=4
+if [ "$1" = "-j" ]; then
+    JOBS=$2
+    shift 2
+fi
+
+if [ $# -lt 1 ] || [ ! -f "$1/manifest" ]; then
+    echo "Usage: $0 [-j JOBS] DUMPDIR [DSN]" >&2
+    echo "  loads the dump in DUMPDIR with JOBS parallel connections [defaults to $JOBS]" >&2
+    exit 1
+fi
+
+DIR=$1
+DSN=$2
+
+FORMAT=`awk -F '\t' '$1 == "format" { print $2 }' "$DIR/manifest"`
+COPYOPTIONS=""
+if [ "$FORMAT" = "binary" ]; then
+    COPYOPTIONS=" (FORMAT binary)"
+fi
+export DIR DSN COPYOPTIONS
+
+echo "creating the tables"
+psql -q -v ON_ERROR_STOP=1 ${DSN:+"$DSN"} -f "$DIR/00-before.sql"
+
+echo "loading the rows"
+awk -F '\t' '$1 == "copy" { print $2, $3 }' "$DIR/manifest" | xargs -n 2 -P "$JOBS" sh -c '
+    echo "  $1"
+    gzip -dc "$DIR/$1" | psql -q -v ON_ERROR_STOP=1 ${DSN:+"$DSN"} -c "COPY $0 FROM STDIN$COPYOPTIONS;"'
+
+echo "building the indexes"
+BLOCKS=`mktemp -d`
+trap 'rm -rf "$BLOCKS"' EXIT
+# one file per block that is more than comments
+awk -v dir="$BLOCKS" 'BEGIN { RS = "" } {
+    n = split($0, lines, "\n")
+    for(i = 1; i <= n; i++) {
+        if(lines[i] !~ /^--/) {
+            print > (dir "/" NR ".sql")
+            break
+        }
+    }
+}' "$DIR/99-after.sql"
+ls "$BLOCKS"/*.sql | xargs -n 1 -P "$JOBS" sh -c '
+    START=`date +%s`
+    psql -q -v ON_ERROR_STOP=1 ${DSN:+"$DSN"} -f "$0"
+    echo "  $((`date +%s` - START))s `grep -v "^--" "$0" | head -n 1`"'
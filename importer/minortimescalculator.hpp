@@ -8,8 +8,14 @@ private:
     bool m_isupdate;
     bool m_showerrors;
 
+    /**
+     * length of the time buckets in seconds, node changes in the same
+     * bucket make only one minor version
+     */
+    time_t m_granularity;
+
 protected:
-    MinorTimesCalculator(Nodestore *nodestore, DbAdapter *adapter, bool isUpdate): m_nodestore(nodestore), m_adapter(adapter), m_isupdate(isUpdate), m_showerrors(false) {}
+    MinorTimesCalculator(Nodestore *nodestore, DbAdapter *adapter, bool isUpdate): m_nodestore(nodestore), m_adapter(adapter), m_isupdate(isUpdate), m_showerrors(false), m_granularity(1), m_cursors(), m_heap() {}
 
 public:
     struct MinorTimesInfo {
@@ -27,39 +33,220 @@ public:
         }
     };
 
-    std::vector<MinorTimesInfo> *forWay(const Osmium::OSM::WayNodeList &nodes, time_t from, time_t to) {
-        std::vector<MinorTimesInfo> *minor_times = new std::vector<MinorTimesInfo>();
+private:
+    /**
+     * the next version of a node in the heap merge, the heap is ordered
+     * by time and then by the index of the node in the way
+     */
+    struct HeapEntry {
+        time_t t;
+        size_t ref;
+
+        // std::*_heap build a max-heap, so the order is reversed
+        bool operator<(const HeapEntry& a) const
+        {
+            return t > a.t || (t == a.t && ref > a.ref);
+        }
+    };
 
-        for(Osmium::OSM::WayNodeList::const_iterator nodeit = nodes.begin(); nodeit != nodes.end(); nodeit++) {
-            osm_object_id_t id = nodeit->ref();
+    /**
+     * reused between the calls, to avoid allocations
+     */
+    std::vector<Nodestore::VersionCursor> m_cursors;
+    std::vector<HeapEntry> m_heap;
 
-            bool found = false;
-            Nodestore::timemap_ptr tmap = m_nodestore->lookup(id, found);
-            if(!found) {
-                continue;
+    /**
+     * the number of the time bucket t falls into
+     *
+     * buckets of whole weeks start on mondays, all others at the epoch,
+     * so days start at midnight utc
+     */
+    time_t bucket(time_t t) {
+        if(m_granularity % WEEK == 0) {
+            t -= 4 * DAY; // 1970-01-01 was a thursday
+        }
+        return t >= 0 ? t / m_granularity : (t + 1) / m_granularity - 1;
+    }
+
+    /**
+     * merge the minor times in the same bucket into the last one of them,
+     * which carries the geometry and the user of the last change
+     */
+    void collapse(std::vector<MinorTimesInfo> &minor_times) {
+        if(m_granularity <= 1 || minor_times.empty()) {
+            return;
+        }
+
+        size_t n = 0;
+        for(size_t i = 1; i < minor_times.size(); i++) {
+            if(bucket(minor_times[i].t) != bucket(minor_times[n].t)) {
+                n++;
             }
+            minor_times[n] = minor_times[i];
+        }
+        minor_times.resize(n + 1);
+    }
+
+    static osm_object_id_t nodeRef(const Osmium::OSM::WayNode &node) {
+        return node.ref();
+    }
+
+    static osm_object_id_t nodeRef(osm_object_id_t id) {
+        return id;
+    }
+
+    /**
+     * the heap merge behind forWay and forNodes, over the count nodes
+     * between begin and end
+     */
+    template <class TIterator>
+    void collect(TIterator begin, TIterator end, size_t count, time_t from, time_t to, std::vector<MinorTimesInfo> &minor_times) {
+        minor_times.clear();
+        m_heap.clear();
 
-            Nodestore::timemap_cit lower = tmap->lower_bound(from);
-            Nodestore::timemap_cit upper = to == 0 ? tmap->end() : tmap->upper_bound(to);
-            for(Nodestore::timemap_cit it = lower; it != upper; it++) {
-                /*
-                 * lower_bound returns elements *not lower then* from, so it can return times == from
-                 * this results in minor with timestamps and information equal to the original way
-                 */
-                if(it->first == from) continue;
-                MinorTimesInfo info = {it->first, it->second.uid};
-                minor_times->push_back(info);
+        if(m_cursors.size() < count) {
+            m_cursors.resize(count);
+        }
+
+        // the version chains are written in the order of the input, which
+        // should be the order of time. if it isn't, the result is sorted
+        // afterwards
+        bool ordered = true;
+
+        size_t i = 0;
+        for(TIterator nodeit = begin; nodeit != end; nodeit++, i++) {
+            Nodestore::VersionCursor &cursor = m_cursors[i];
+            if(m_nodestore->versions(nodeRef(*nodeit), cursor) && cursor.next()) {
+                HeapEntry entry = {cursor.t, i};
+                m_heap.push_back(entry);
             }
         }
+        std::make_heap(m_heap.begin(), m_heap.end());
 
-        std::sort(minor_times->begin(), minor_times->end());
-        minor_times->erase(std::unique(minor_times->begin(), minor_times->end()), minor_times->end());
+        while(!m_heap.empty()) {
+            std::pop_heap(m_heap.begin(), m_heap.end());
+            HeapEntry &entry = m_heap.back();
+            Nodestore::VersionCursor &cursor = m_cursors[entry.ref];
 
-        return minor_times;
+            /*
+             * versions at from are part of the original way, they don't
+             * make a minor way
+             */
+            if(cursor.t > from && (to == 0 || cursor.t <= to)) {
+                if(minor_times.empty() || minor_times.back().t != cursor.t) {
+                    MinorTimesInfo info = {cursor.t, cursor.info.uid};
+                    minor_times.push_back(info);
+                }
+            }
+
+            time_t last = cursor.t;
+            if(cursor.next()) {
+                if(cursor.t < last) {
+                    ordered = false;
+                }
+                entry.t = cursor.t;
+                std::push_heap(m_heap.begin(), m_heap.end());
+            } else {
+                m_heap.pop_back();
+            }
+        }
+
+        if(!ordered) {
+            std::stable_sort(minor_times.begin(), minor_times.end());
+            minor_times.erase(std::unique(minor_times.begin(), minor_times.end()), minor_times.end());
+        }
+
+        collapse(minor_times);
+    }
+
+public:
+    static const time_t HOUR = 60 * 60;
+    static const time_t DAY = 24 * HOUR;
+    static const time_t WEEK = 7 * DAY;
+
+    /**
+     * parse a granularity: "second", "minute", "hour", "day", "week" or a
+     * number of seconds, optionally followed by one of the units s, m, h,
+     * d or w. Returns 0 if the text can't be parsed.
+     */
+    static time_t parseGranularity(const std::string &text) {
+        if(text == "second" || text == "seconds") return 1;
+        if(text == "minute") return 60;
+        if(text == "hour") return HOUR;
+        if(text == "day") return DAY;
+        if(text == "week") return WEEK;
+
+        char *end;
+        long n = strtol(text.c_str(), &end, 10);
+        if(end == text.c_str() || n <= 0) {
+            return 0;
+        }
+
+        std::string unit(end);
+        if(unit == "" || unit == "s") return n;
+        if(unit == "m") return n * 60;
+        if(unit == "h") return n * HOUR;
+        if(unit == "d") return n * DAY;
+        if(unit == "w") return n * WEEK;
+        return 0;
+    }
+
+    time_t granularity() const {
+        return m_granularity;
+    }
+
+    /**
+     * set the length of the time buckets in seconds
+     */
+    void granularity(time_t seconds) {
+        m_granularity = seconds > 0 ? seconds : 1;
+    }
+
+    /**
+     * collect the times between from and to (or all after from, if to is
+     * 0) at which a node of the way changed into minor_times, ordered by
+     * time and with the user who made the change
+     *
+     * The versions of each node are read with a Nodestore::VersionCursor
+     * and merged with a small heap holding the next version of every node,
+     * so no timemaps are built and the buffer can be reused by the caller.
+     * When two nodes changed at the same time, the user of the first of
+     * them in the way is taken.
+     *
+     * With a granularity of more then a second, all changes in the same
+     * time bucket are merged into the last of them.
+     */
+    void forWay(const Osmium::OSM::WayNodeList &nodes, time_t from, time_t to, std::vector<MinorTimesInfo> &minor_times) {
+        collect(nodes.begin(), nodes.end(), nodes.size(), from, to, minor_times);
+    }
+
+    void forWay(const Osmium::OSM::WayNodeList &nodes, time_t from, std::vector<MinorTimesInfo> &minor_times) {
+        forWay(nodes, from, 0, minor_times);
+    }
+
+    /**
+     * collect the times at which one of the nodes with the given ids
+     * changed, like forWay
+     */
+    void forNodes(const std::vector<osm_object_id_t> &nodes, time_t from, time_t to, std::vector<MinorTimesInfo> &minor_times) {
+        collect(nodes.begin(), nodes.end(), nodes.size(), from, to, minor_times);
     }
 
-    std::vector<MinorTimesInfo> *forWay(const Osmium::OSM::WayNodeList &nodes, time_t from) {
-        return forWay(nodes, from, 0);
+    /**
+     * add the times in other to minor_times, both ordered by time. When
+     * both contain the same time, the one in minor_times is kept.
+     */
+    void merge(std::vector<MinorTimesInfo> &minor_times, const std::vector<MinorTimesInfo> &other) {
+        if(other.empty()) {
+            return;
+        }
+
+        size_t middle = minor_times.size();
+        minor_times.insert(minor_times.end(), other.begin(), other.end());
+        std::inplace_merge(minor_times.begin(), minor_times.begin() + middle, minor_times.end());
+        minor_times.erase(std::unique(minor_times.begin(), minor_times.end()), minor_times.end());
+
+        collapse(minor_times);
     }
 };
 
@@ -0,0 +1,508 @@
+/**
+ * The geometry of a multipolygon relation at a given time is assembled
+ * from the versions of its member ways that were valid at that time:
+ *
+ *  1. the node lists of the member ways are looked up in the Waystore
+ *  2. ways that are not closed are joined at their common end nodes,
+ *     until the rings are closed
+ *  3. the coordinates of the nodes of each ring are looked up in the
+ *     nodestore, like for a way
+ *  4. each ring becomes an outer or an inner ring by the number of rings
+ *     it is contained in: rings inside an even number of rings are outer
+ *     rings, the others are the inner rings of the smallest ring around
+ *     them
+ *
+ * The roles of the members are not used, they are often wrong or missing
+ * in old versions of the relations. Rings that can't be closed are
+ * skipped, so a broken relation still shows its valid parts.
+ *
+ * A relation version and its minor versions are built incrementally, like
+ * a way by the GeomBuilder: the versions of the member ways are read from
+ * the Waystore once, the rings are joined from the versions valid at the
+ * time of the relation version and the coordinates of all of their nodes
+ * are looked up once. Building a minor version only applies the later
+ * versions of the nodes and of the member ways up to its time, the rings
+ * are only joined again when a member way changed.
+ */
+
+#ifndef IMPORTER_MULTIPOLYGONBUILDER_HPP
+#define IMPORTER_MULTIPOLYGONBUILDER_HPP
+
+#include <algorithm>
+#include <vector>
+
+#include "areageometry.hpp"
+#include "geombuilder.hpp"
+#include "minortimescalculator.hpp"
+#include "waystore.hpp"
+
+/**
+ * Builds the geometry of a multipolygon relation at a given time
+ */
+class MultipolygonBuilder {
+private:
+    const Waystore *m_waystore;
+    ImportGeomBuilder m_geom;
+    bool m_debug;
+
+    /**
+     * the nodes of the versions of the member ways that are used between
+     * the time of the relation version and until, one after another, and
+     * the decoded nodes of a single way version
+     */
+    std::vector<osm_object_id_t> m_wayNodes, m_validNodes, m_versionNodes;
+
+    /**
+     * the ids of all nodes in m_wayNodes, sorted and unique. m_geom
+     * follows the coordinates of the nodes in this order.
+     */
+    std::vector<osm_object_id_t> m_nodes;
+
+    /**
+     * the nodes of the version of a member way that is valid at the
+     * current time in m_wayNodes, begin and end are equal, if there is none
+     */
+    struct Segment {
+        osm_object_id_t way;
+        size_t begin, end;
+        bool used;
+    };
+    std::vector<Segment> m_segments;
+
+    /**
+     * a later version of one of the member ways
+     */
+    struct WayEvent {
+        time_t t;
+        osm_user_id_t uid;
+
+        /**
+         * index of the member and its nodes in m_wayNodes
+         */
+        size_t member;
+        size_t begin, end;
+
+        bool operator<(const WayEvent& a) const {
+            return t < a.t;
+        }
+    };
+
+    /**
+     * the later versions of the member ways, ordered by time, and the
+     * next one that has not yet been applied
+     */
+    std::vector<WayEvent> m_wayEvents;
+    size_t m_nextWayEvent;
+
+    Waystore::VersionCursor m_cursor;
+
+    /**
+     * the end nodes of the segments that are not closed, with twice the
+     * index of the segment, plus one for the last node
+     */
+    typedef std::pair<osm_object_id_t, size_t> endpoint_t;
+    std::vector<endpoint_t> m_endpoints;
+
+    /**
+     * the nodes of the ring that is currently joined
+     */
+    std::vector<osm_object_id_t> m_ring;
+
+    /**
+     * the nodes of all joined rings as indexes into m_nodes and the index
+     * behind the last node of each ring
+     */
+    std::vector<size_t> m_ringRefs, m_ringEnds;
+
+    /**
+     * the coordinates of the ring that is currently built
+     */
+    WayGeometry m_ringGeom;
+
+    /**
+     * a closed ring, its coordinates are stored in m_x and m_y
+     */
+    struct Ring {
+        size_t begin, end;
+        double area;
+        double minX, minY, maxX, maxY;
+
+        /**
+         * the number of rings around this ring and the smallest of them
+         */
+        size_t depth, parent;
+    };
+    std::vector<Ring> m_rings;
+    std::vector<double> m_x, m_y;
+
+    /**
+     * the indexes of the rings, ordered by their area, largest first
+     */
+    std::vector<size_t> m_order;
+
+    struct LargerArea {
+        const std::vector<Ring> *rings;
+
+        bool operator()(size_t a, size_t b) const {
+            return (*rings)[a].area > (*rings)[b].area;
+        }
+    };
+
+    /**
+     * append the segment connected to the end of the current ring to it,
+     * returns false if no segment is left to connect
+     */
+    bool extend() {
+        osm_object_id_t last = m_ring.back();
+
+        std::vector<endpoint_t>::const_iterator it = std::lower_bound(m_endpoints.begin(), m_endpoints.end(), endpoint_t(last, 0));
+        for(; it != m_endpoints.end() && it->first == last; ++it) {
+            Segment &segment = m_segments[it->second / 2];
+            if(segment.used) {
+                continue;
+            }
+            segment.used = true;
+
+            // the common node is already part of the ring
+            if(it->second % 2 == 0) {
+                m_ring.insert(m_ring.end(), m_wayNodes.begin() + segment.begin + 1, m_wayNodes.begin() + segment.end);
+            } else {
+                for(size_t i = segment.end - 1; i > segment.begin; i--) {
+                    m_ring.push_back(m_wayNodes[i - 1]);
+                }
+            }
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * join the current versions of the member ways to rings, closed ways
+     * are rings on their own
+     */
+    void join(time_t t) {
+        m_endpoints.clear();
+        m_ringRefs.clear();
+        m_ringEnds.clear();
+
+        for(size_t i = 0; i < m_segments.size(); i++) {
+            Segment &segment = m_segments[i];
+            segment.used = false;
+
+            if(segment.end - segment.begin < 2) {
+                if(m_debug) {
+                    std::cerr << "member way #" << segment.way << " is not valid at tstamp " << t << ", skipping it" << std::endl;
+                }
+                segment.used = true;
+                continue;
+            }
+
+            if(m_wayNodes[segment.begin] != m_wayNodes[segment.end - 1]) {
+                m_endpoints.push_back(endpoint_t(m_wayNodes[segment.begin], 2 * i));
+                m_endpoints.push_back(endpoint_t(m_wayNodes[segment.end - 1], 2 * i + 1));
+            }
+        }
+
+        std::sort(m_endpoints.begin(), m_endpoints.end());
+
+        for(size_t i = 0; i < m_segments.size(); i++) {
+            Segment &segment = m_segments[i];
+            if(segment.used) {
+                continue;
+            }
+            segment.used = true;
+
+            m_ring.assign(m_wayNodes.begin() + segment.begin, m_wayNodes.begin() + segment.end);
+            while(m_ring.front() != m_ring.back()) {
+                if(!extend()) {
+                    break;
+                }
+            }
+
+            if(m_ring.front() != m_ring.back()) {
+                if(m_debug) {
+                    std::cerr << "ring starting at node #" << m_ring.front() << " can't be closed at tstamp " << t << ", skipping it" << std::endl;
+                }
+                continue;
+            }
+
+            for(std::vector<osm_object_id_t>::const_iterator it = m_ring.begin(); it != m_ring.end(); ++it) {
+                m_ringRefs.push_back(std::lower_bound(m_nodes.begin(), m_nodes.end(), *it) - m_nodes.begin());
+            }
+            m_ringEnds.push_back(m_ringRefs.size());
+        }
+    }
+
+    /**
+     * collect the current coordinates of the ring between begin and end
+     * in m_ringRefs and store them, if they form a valid ring
+     */
+    void addRing(size_t begin, size_t end, time_t t) {
+        m_ringGeom.clear();
+        double x, y;
+        for(size_t i = begin; i < end; i++) {
+            if(m_geom.coordinate(m_ringRefs[i], x, y)) {
+                m_ringGeom.x.push_back(x);
+                m_ringGeom.y.push_back(y);
+            }
+        }
+
+        // like a polygon of a way, a ring needs at least 3 different, closed coordinates
+        size_t count = m_ringGeom.size();
+        if(count < 4 || m_ringGeom.x[0] != m_ringGeom.x[count - 1] || m_ringGeom.y[0] != m_ringGeom.y[count - 1]) {
+            if(m_debug) {
+                std::cerr << "ring with " << (end - begin) << " nodes starting at node #" << m_nodes[m_ringRefs[begin]] << " is not valid at tstamp " << t << ", skipping it" << std::endl;
+            }
+            return;
+        }
+        m_ringGeom.isPolygon = true;
+
+        Ring ring = {m_x.size(), m_x.size() + count, m_ringGeom.area(), m_ringGeom.x[0], m_ringGeom.y[0], m_ringGeom.x[0], m_ringGeom.y[0], 0, 0};
+        for(size_t i = 1; i < count; i++) {
+            ring.minX = std::min(ring.minX, m_ringGeom.x[i]);
+            ring.minY = std::min(ring.minY, m_ringGeom.y[i]);
+            ring.maxX = std::max(ring.maxX, m_ringGeom.x[i]);
+            ring.maxY = std::max(ring.maxY, m_ringGeom.y[i]);
+        }
+
+        m_x.insert(m_x.end(), m_ringGeom.x.begin(), m_ringGeom.x.end());
+        m_y.insert(m_y.end(), m_ringGeom.y.begin(), m_ringGeom.y.end());
+        m_rings.push_back(ring);
+    }
+
+    /**
+     * is the point inside the ring? (crossing number test)
+     */
+    bool contains(const Ring &ring, double px, double py) const {
+        if(px < ring.minX || px > ring.maxX || py < ring.minY || py > ring.maxY) {
+            return false;
+        }
+
+        bool inside = false;
+        for(size_t i = ring.begin, j = ring.end - 1; i < ring.end; j = i++) {
+            if((m_y[i] > py) != (m_y[j] > py) &&
+                px < (m_x[j] - m_x[i]) * (py - m_y[i]) / (m_y[j] - m_y[i]) + m_x[i]) {
+                inside = !inside;
+            }
+        }
+        return inside;
+    }
+
+    /**
+     * find the smallest ring around each ring
+     *
+     * a ring can only be inside a larger ring, so the rings are checked
+     * from the largest to the smallest. Rings of a multipolygon may touch
+     * each other, so the middle of the first edge is tested instead of a
+     * node, which could be shared with the ring around it.
+     */
+    void nest() {
+        m_order.resize(m_rings.size());
+        for(size_t i = 0; i < m_rings.size(); i++) {
+            m_order[i] = i;
+        }
+
+        LargerArea larger = {&m_rings};
+        std::stable_sort(m_order.begin(), m_order.end(), larger);
+
+        for(size_t k = 0; k < m_order.size(); k++) {
+            Ring &ring = m_rings[m_order[k]];
+            double px = (m_x[ring.begin] + m_x[ring.begin + 1]) / 2;
+            double py = (m_y[ring.begin] + m_y[ring.begin + 1]) / 2;
+
+            for(size_t l = k; l > 0; l--) {
+                const Ring &outer = m_rings[m_order[l - 1]];
+                if(outer.minX <= ring.minX && outer.maxX >= ring.maxX && outer.minY <= ring.minY && outer.maxY >= ring.maxY && contains(outer, px, py)) {
+                    ring.depth = outer.depth + 1;
+                    ring.parent = m_order[l - 1];
+                    break;
+                }
+            }
+        }
+    }
+
+    /**
+     * build the rings joined last into geom, with the current coordinates
+     */
+    bool assemble(time_t t, AreaGeometry &geom) {
+        geom.clear();
+        m_rings.clear();
+        m_x.clear();
+        m_y.clear();
+
+        size_t begin = 0;
+        for(size_t r = 0; r < m_ringEnds.size(); r++) {
+            addRing(begin, m_ringEnds[r], t);
+            begin = m_ringEnds[r];
+        }
+
+        nest();
+
+        // each ring with an even depth makes a polygon with the rings directly inside it
+        for(size_t k = 0; k < m_order.size(); k++) {
+            size_t outer = m_order[k];
+            const Ring &ring = m_rings[outer];
+            if(ring.depth % 2 != 0) {
+                continue;
+            }
+
+            geom.addRing(&m_x[ring.begin], &m_y[ring.begin], ring.end - ring.begin);
+            for(size_t l = k + 1; l < m_order.size(); l++) {
+                const Ring &inner = m_rings[m_order[l]];
+                if(inner.depth == ring.depth + 1 && inner.parent == outer) {
+                    geom.addRing(&m_x[inner.begin], &m_y[inner.begin], inner.end - inner.begin);
+                }
+            }
+            geom.endPolygon();
+        }
+
+        return geom.polygons() > 0;
+    }
+
+public:
+    MultipolygonBuilder(Nodestore *nodestore, const Waystore *waystore, DbAdapter *adapter) :
+            m_waystore(waystore),
+            m_geom(nodestore, adapter),
+            m_debug(false),
+            m_wayNodes(),
+            m_validNodes(),
+            m_versionNodes(),
+            m_nodes(),
+            m_segments(),
+            m_wayEvents(),
+            m_nextWayEvent(0),
+            m_cursor(),
+            m_endpoints(),
+            m_ring(),
+            m_ringRefs(),
+            m_ringEnds(),
+            m_ringGeom(),
+            m_rings(),
+            m_x(),
+            m_y(),
+            m_order() {}
+
+    /**
+     * start building a relation version with the given member ways and
+     * its minor versions
+     *
+     * geom is set to the multipolygon at time t, the later versions of the
+     * member ways and of their nodes up to until (or all, if until is 0)
+     * are prepared to be applied by advance. Returns false, if no valid
+     * ring could be built.
+     */
+    bool begin(const std::vector<osm_object_id_t> &ways, time_t t, time_t until, AreaGeometry &geom) {
+        m_wayNodes.clear();
+        m_segments.clear();
+        m_wayEvents.clear();
+        m_nextWayEvent = 0;
+
+        bool collectEvents = (until == 0 || until > t);
+
+        // walk once over the versions of each member way: the version valid
+        // at t is the youngest one not younger then t, like Waystore::lookup
+        // finds it, the later versions up to until become events
+        for(size_t i = 0; i < ways.size(); i++) {
+            bool valid = false;
+            time_t validTime = 0;
+            m_validNodes.clear();
+
+            if(m_waystore->versions(ways[i], m_cursor)) {
+                while(m_cursor.next()) {
+                    if(m_cursor.t <= t) {
+                        if(!valid || m_cursor.t >= validTime) {
+                            m_cursor.nodes(m_validNodes);
+                            validTime = m_cursor.t;
+                            valid = true;
+                        }
+                    } else if(collectEvents && (until == 0 || m_cursor.t <= until)) {
+                        m_cursor.nodes(m_versionNodes);
+                        WayEvent event = {m_cursor.t, m_cursor.uid, i, m_wayNodes.size(), m_wayNodes.size() + m_versionNodes.size()};
+                        m_wayNodes.insert(m_wayNodes.end(), m_versionNodes.begin(), m_versionNodes.end());
+                        m_wayEvents.push_back(event);
+                    }
+                }
+            }
+
+            Segment segment = {ways[i], m_wayNodes.size(), m_wayNodes.size() + m_validNodes.size(), false};
+            m_wayNodes.insert(m_wayNodes.end(), m_validNodes.begin(), m_validNodes.end());
+            m_segments.push_back(segment);
+        }
+
+        std::stable_sort(m_wayEvents.begin(), m_wayEvents.end());
+
+        m_nodes.assign(m_wayNodes.begin(), m_wayNodes.end());
+        std::sort(m_nodes.begin(), m_nodes.end());
+        m_nodes.erase(std::unique(m_nodes.begin(), m_nodes.end()), m_nodes.end());
+
+        m_geom.beginNodes(m_nodes, t, until);
+
+        join(t);
+        return assemble(t, geom);
+    }
+
+    /**
+     * set geom to the multipolygon at time t, which must not be before the
+     * time of the previous call to begin or advance
+     */
+    bool advance(time_t t, AreaGeometry &geom) {
+        m_geom.seek(t);
+
+        bool changed = false;
+        size_t events = m_wayEvents.size();
+        while(m_nextWayEvent < events && m_wayEvents[m_nextWayEvent].t <= t) {
+            const WayEvent &event = m_wayEvents[m_nextWayEvent++];
+            m_segments[event.member].begin = event.begin;
+            m_segments[event.member].end = event.end;
+            changed = true;
+        }
+
+        if(changed) {
+            join(t);
+        }
+        return assemble(t, geom);
+    }
+
+    /**
+     * the ids of the nodes of all member way versions between the times
+     * given to begin, sorted and unique
+     */
+    const std::vector<osm_object_id_t>& nodes() const {
+        return m_nodes;
+    }
+
+    /**
+     * the times and the users of the later versions of the member ways
+     * between the times given to begin, ordered by time, the first user
+     * of the versions with the same time wins
+     */
+    void wayTimes(std::vector<MinorTimesCalculator::MinorTimesInfo> &times) const {
+        times.clear();
+        for(std::vector<WayEvent>::const_iterator it = m_wayEvents.begin(); it != m_wayEvents.end(); ++it) {
+            if(times.empty() || times.back().t != it->t) {
+                MinorTimesCalculator::MinorTimesInfo info = {it->t, it->uid};
+                times.push_back(info);
+            }
+        }
+    }
+
+    bool isKeepingLatLng() {
+        return m_geom.isKeepingLatLng();
+    }
+
+    void keepLatLng(bool shouldKeepLatLng) {
+        m_geom.keepLatLng(shouldKeepLatLng);
+    }
+
+    bool isPrintingDebugMessages() {
+        return m_debug;
+    }
+
+    void printDebugMessages(bool shouldPrintDebugMessages) {
+        m_debug = shouldPrintDebugMessages;
+        m_geom.printDebugMessages(shouldPrintDebugMessages);
+    }
+};
+
+#endif // IMPORTER_MULTIPOLYGONBUILDER_HPP
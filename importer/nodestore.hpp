@@ -16,6 +16,11 @@
 #ifndef IMPORTER_NODESTORE_HPP
 #define IMPORTER_NODESTORE_HPP
 
+#include <math.h>
+#include <limits>
+
+#include "nodestore/varint.hpp"
+
 /**
  * Abstract baseclass for all nodestores
  */
@@ -56,11 +61,155 @@ public:
     typedef boost::shared_ptr< timemap > timemap_ptr;
 
 protected:
+    /**
+     * the information stored for each node, packed into ints
+     */
+    struct PackedNodeTimeinfo {
+        /**
+         * osmium gives us a time_t which is a signed int
+         * on 32 bit platformsm time_t is 4 bytes wide and it will overflow on year 2038
+         * on 64 bit platforms, time_t is 8 bytes wide and will not overflow during the next decades
+         * we know that osm did not exists before 1970, so there is no need to encode times prior to that point
+         * using this knowledge we can extend the reach of our unix timestamp by ~60 years by using an unsigned
+         * 8 byte int. this gives us best of both worlds: a smaller memory footprint and enough time to buy more ram
+         * (as of today's 2013: 93 years. should be enough for everybody.)
+         */
+        uint32_t t;
+
+        /**
+         * user-id used for assigning usernames and ids to minor ways
+         */
+        osm_user_id_t uid;
+
+        /**
+         * osmium handles lat/lon either as double (8 bytes) or as int32_t (4 byted). So we choose the smaller one.
+         * when the nodestore stores projected coordinates, this is the mercator y in centimeters, see toFix
+         */
+        int32_t lat;
+
+        /**
+         * same as for lat
+         */
+        int32_t lon;
+    };
+
+    /**
+     * size of the 0-marker separating the versions of two nodes in the
+     * packed nodestores
+     */
+    static const int nodeSeparatorSize = sizeof(((PackedNodeTimeinfo *)0)->t);
+
+    /**
+     * walks over the versions of one node in the packed nodestores, stored
+     * either as plain PackedNodeTimeinfo structs or as compressed chain,
+     * see nodestore/sparse.hpp
+     */
+    class ChainCursor {
+    private:
+        const char* m_ptr;
+        bool m_compressed, m_first;
+
+    public:
+        /**
+         * the current version
+         */
+        PackedNodeTimeinfo info;
+
+        ChainCursor() : m_ptr(NULL), m_compressed(false), m_first(false), info() {}
+
+        ChainCursor(const PackedNodeTimeinfo* start, bool compressed) : m_ptr(reinterpret_cast< const char* >(start)), m_compressed(compressed), m_first(true), info() {}
+
+        /**
+         * move to the next version, returns false at the end of the chain
+         */
+        bool next() {
+            if(!m_ptr) {
+                return false;
+            }
+
+            if(m_first) {
+                memcpy(&info, m_ptr, sizeof(PackedNodeTimeinfo));
+                m_ptr += sizeof(PackedNodeTimeinfo);
+                m_first = false;
+                return true;
+            }
+
+            if(!m_compressed) {
+                const PackedNodeTimeinfo* infoPtr = reinterpret_cast< const PackedNodeTimeinfo* >(m_ptr);
+                if(infoPtr->t == 0) {
+                    return false;
+                }
+                info = *infoPtr;
+                m_ptr += sizeof(PackedNodeTimeinfo);
+                return true;
+            }
+
+            if(*m_ptr == 0) {
+                return false;
+            }
+
+            info.t += Varint::unzigzag(Varint::read(m_ptr) - 1);
+            info.lat += Varint::unzigzag(Varint::read(m_ptr));
+            info.lon += Varint::unzigzag(Varint::read(m_ptr));
+            info.uid += Varint::unzigzag(Varint::read(m_ptr));
+            return true;
+        }
+    };
+
     /**
      * a Nodeinfo that equals null, returned in case of an error
      */
     const Nodeinfo nullinfo;
 
+    /**
+     * fixed-point value of a projected coordinate that could not be
+     * projected or is too large to be stored
+     */
+    static const int32_t INVALID_FIX = -2147483647 - 1;
+
+    /**
+     * convert a coordinate to the fixed-point value stored in the packed
+     * nodestores
+     *
+     * lat/lon is stored like osmium does, in units of 1e-7 degrees.
+     * Projected coordinates are stored in centimeters, which covers the
+     * mercator square with some room to spare: up to about 86 degrees
+     * of latitude. Nodes beyond that are stored as invalid.
+     */
+    int32_t toFix(double v) {
+        if(!m_projected) {
+            return Osmium::OSM::double_to_fix(v);
+        }
+
+        double fix = floor(v * 100 + .5);
+        if(!(fabs(fix) <= 2147483647.0)) {
+            // NaN marks coordinates that could not be projected
+            if(v == v) {
+                m_fixOutOfRange++;
+            }
+            return INVALID_FIX;
+        }
+
+        m_fixCount++;
+        m_fixMaxError = std::max(m_fixMaxError, fabs(fix / 100 - v));
+        return static_cast< int32_t >(fix);
+    }
+
+    /**
+     * convert a stored fixed-point value back to a coordinate, invalid
+     * projected coordinates are returned as NaN
+     */
+    double fromFix(int32_t fix) const {
+        if(!m_projected) {
+            return Osmium::OSM::fix_to_double(fix);
+        }
+
+        if(fix == INVALID_FIX) {
+            return std::numeric_limits< double >::quiet_NaN();
+        }
+        return fix / 100.0;
+    }
+
 private:
     /**
      * should messages because of store-misses be printed?
@@ -70,11 +219,107 @@ private:
      */
     bool m_debug, m_storeerrors;
 
+    /**
+     * are the coordinates projected to mercator, before they are recorded?
+     */
+    bool m_projected;
+
+    /**
+     * statistics about the conversion of projected coordinates to fixed-point
+     */
+    uint64_t m_fixCount, m_fixOutOfRange;
+    double m_fixMaxError;
+
+public:
+    /**
+     * walks over the versions of one node in the order they were recorded,
+     * without copying them into a timemap
+     *
+     * The cursor reads directly from the memory of the nodestore, it stays
+     * valid until the next call to record.
+     */
+    class VersionCursor {
+    private:
+        friend class Nodestore;
+
+        const Nodestore *m_store;
+
+        /**
+         * the stl nodestore keeps the versions in a timemap, the packed
+         * nodestores in a chain
+         */
+        const timemap *m_map;
+        timemap_cit m_it;
+        ChainCursor m_chain;
+
+    public:
+        /**
+         * the time and information of the current version
+         */
+        time_t t;
+        Nodeinfo info;
+
+        VersionCursor() : m_store(NULL), m_map(NULL), m_it(), m_chain(), t(0), info() {}
+
+        /**
+         * move to the next version, returns false after the last one
+         */
+        bool next() {
+            if(m_map) {
+                if(m_it == m_map->end()) {
+                    return false;
+                }
+                t = m_it->first;
+                info = m_it->second;
+                ++m_it;
+                return true;
+            }
+
+            if(!m_chain.next()) {
+                return false;
+            }
+            t = m_chain.info.t;
+            info.lat = m_store->fromFix(m_chain.info.lat);
+            info.lon = m_store->fromFix(m_chain.info.lon);
+            info.uid = m_chain.info.uid;
+            return true;
+        }
+    };
+
+protected:
+    /**
+     * point cursor to the versions in a timemap
+     */
+    void startCursor(VersionCursor &cursor, const timemap &tmap) const {
+        cursor.m_store = this;
+        cursor.m_map = &tmap;
+        cursor.m_it = tmap.begin();
+        cursor.m_chain = ChainCursor();
+    }
+
+    /**
+     * point cursor to the versions in a chain of a packed nodestore
+     */
+    void startCursor(VersionCursor &cursor, const PackedNodeTimeinfo* start, bool compressed) const {
+        cursor.m_store = this;
+        cursor.m_map = NULL;
+        cursor.m_chain = ChainCursor(start, compressed);
+    }
+
+    /**
+     * point cursor to no versions at all
+     */
+    void clearCursor(VersionCursor &cursor) const {
+        cursor.m_store = this;
+        cursor.m_map = NULL;
+        cursor.m_chain = ChainCursor();
+    }
+
 public:
     /**
      * initialize a new nodestore
      */
-    Nodestore() : nullinfo(), m_storeerrors(false) {}
+    Nodestore() : nullinfo(), m_storeerrors(false), m_projected(false), m_fixCount(0), m_fixOutOfRange(0), m_fixMaxError(0) {}
 
     virtual ~Nodestore() {}
 
@@ -106,6 +351,36 @@ public:
         m_storeerrors = shouldPrintStoreErrors;
     }
 
+    /**
+     * does this nodestore record projected coordinates
+     */
+    bool isStoringProjected() {
+        return m_projected;
+    }
+
+    /**
+     * should this nodestore record projected coordinates?
+     *
+     * the coordinates passed to record are then mercator x/y, coordinates
+     * that could not be projected are passed as NaN. They are returned as
+     * NaN from lookup, too.
+     */
+    void storeProjected(bool shouldStoreProjected) {
+        m_projected = shouldStoreProjected;
+    }
+
+    /**
+     * print how exact the projected coordinates have been stored
+     */
+    void printAccuracyReport() {
+        if(!m_projected) {
+            return;
+        }
+
+        std::cerr << "nodestore: stored " << m_fixCount << " projected coordinates with a maximum error of " <<
+            m_fixMaxError << " m, " << m_fixOutOfRange << " coordinates were out of range" << std::endl;
+    }
+
     /**
      * record information about a node
      */
@@ -124,6 +399,15 @@ public:
      * should not be used.
      */
     virtual Nodeinfo lookup(osm_object_id_t id, time_t t, bool &found) = 0;
+
+    /**
+     * point cursor to the versions of a node
+     *
+     * returns false, if the node was not found. Unlike lookup(id, found)
+     * this does not copy the versions, so it's the way to go for callers
+     * that only need to walk over them once.
+     */
+    virtual bool versions(osm_object_id_t id, VersionCursor &cursor) = 0;
 };
 
 #endif // IMPORTER_NODESTORE_HPP
@@ -0,0 +1,151 @@
+/**
+ * The sparse nodestore maps node ids to the position of their first version in its memory
+ * blocks. Those positions are stored as 40 bit offsets: the upper bits select the memory
+ * block, the lower bits the 4-byte word inside the block. An offset of 0 means that no
+ * version of the node has been stored.
+ *
+ * There are two implementations of this index:
+ *
+ *   The SparseIdIndex is built on top of the Google Sparsetable. It only needs memory for the
+ *   ids that are actually used, which makes it the right choice for extracts, where only a
+ *   small fraction of the id space is populated.
+ *
+ *   The DenseIdIndex is a flat array with 5 bytes per node id, indexed by the id itself. A
+ *   lookup is a single load without any bit-counting. On a planet, where nearly all ids are
+ *   used, it needs much less memory than the sparsetable with its 8 byte pointers.
+ */
+
+#ifndef IMPORTER_NODESTORE_IDINDEX_HPP
+#define IMPORTER_NODESTORE_IDINDEX_HPP
+
+#include <google/sparsetable>
+#include <sys/mman.h>
+#include <string.h>
+#include <new>
+
+/**
+ * a 40 bit offset into the memory blocks of the sparse nodestore
+ */
+typedef uint64_t nodestore_offset_t;
+
+/**
+ * maps node ids to offsets using a Google Sparsetable
+ */
+class SparseIdIndex {
+private:
+    google::sparsetable< nodestore_offset_t > m_table;
+
+public:
+    SparseIdIndex(osm_object_id_t size) : m_table(size) {}
+
+    /**
+     * number of ids the index can hold
+     */
+    osm_object_id_t size() const {
+        return m_table.size();
+    }
+
+    /**
+     * grow the index so that it can hold size ids
+     */
+    void resize(osm_object_id_t size) {
+        m_table.resize(size);
+    }
+
+    /**
+     * the offset stored for id or 0, if there is none
+     */
+    nodestore_offset_t get(osm_object_id_t id) const {
+        if(id < 0 || static_cast< size_t >(id) >= m_table.size() || !m_table.test(id)) {
+            return 0;
+        }
+        return m_table.get(id);
+    }
+
+    void set(osm_object_id_t id, nodestore_offset_t offset) {
+        m_table.set(id, offset);
+    }
+};
+
+/**
+ * maps node ids to offsets using a flat array of 5-byte entries
+ */
+class DenseIdIndex {
+private:
+    /**
+     * bytes per entry
+     */
+    static const size_t ENTRY_SIZE = 5;
+
+    unsigned char* m_table;
+    osm_object_id_t m_size;
+
+public:
+    DenseIdIndex(osm_object_id_t size) : m_table(NULL), m_size(0) {
+        resize(size);
+    }
+
+    ~DenseIdIndex() {
+        if(m_table) {
+            munmap(m_table, m_size * ENTRY_SIZE);
+        }
+    }
+
+    /**
+     * number of ids the index can hold
+     */
+    osm_object_id_t size() const {
+        return m_size;
+    }
+
+    /**
+     * grow the index so that it can hold size ids
+     *
+     * the entries live in an anonymous mapping, whose pages the kernel
+     * fills with zeros when they are first touched, so the grown part
+     * needs no memory until it's used. mremap moves the pages into the
+     * bigger mapping without copying the entries around.
+     */
+    void resize(osm_object_id_t size) {
+        if(size <= m_size) {
+            return;
+        }
+
+        void* table;
+        if(m_table) {
+            table = mremap(m_table, m_size * ENTRY_SIZE, size * ENTRY_SIZE, MREMAP_MAYMOVE);
+        } else {
+            table = mmap(NULL, size * ENTRY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        }
+
+        if(table == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+
+        m_table = static_cast< unsigned char* >(table);
+        m_size = size;
+    }
+
+    /**
+     * the offset stored for id or 0, if there is none
+     */
+    nodestore_offset_t get(osm_object_id_t id) const {
+        if(id < 0 || id >= m_size) {
+            return 0;
+        }
+
+        const unsigned char* entry = m_table + id * ENTRY_SIZE;
+        uint32_t low;
+        memcpy(&low, entry, sizeof(low));
+        return (static_cast< nodestore_offset_t >(entry[4]) << 32) | low;
+    }
+
+    void set(osm_object_id_t id, nodestore_offset_t offset) {
+        unsigned char* entry = m_table + id * ENTRY_SIZE;
+        uint32_t low = static_cast< uint32_t >(offset);
+        memcpy(entry, &low, sizeof(low));
+        entry[4] = static_cast< unsigned char >(offset >> 32);
+    }
+};
+
+#endif // IMPORTER_NODESTORE_IDINDEX_HPP
@@ -0,0 +1,334 @@
+/**
+ * The mmap nodestore uses the same on-memory layout as the sparse nodestore, but instead of
+ * malloc'ed memory blocks it writes the PackedNodeTimeinfo structs into a file which is mapped
+ * into memory. The id index is a second mapped file, containing one 64 bit offset into the data
+ * file for each node id. This way the kernel is free to page out node versions which have not
+ * been touched lately and the resident size of the importer stays bounded, even on a full
+ * history planet.
+ *
+ * The versions of one node are stored consecutive in the data file and are terminated by a
+ * 4-byte long marker containing only 0 bytes, just like in the sparse nodestore:
+ *
+ *   +---+-----------------------+--------+--------------
+ *   | 0 | n1v1 n1v2 n1v4 n1v5 0 | n2v1 0 | n3v1 n3v2 ...
+ *   +---+-----------------------+--------+--------------
+ *         ^                       ^        ^
+ *         |                       |        |
+ * n1------/                       |        |
+ * n2------------------------------/        |
+ * n3---------------------------------------/
+ *
+ * The data file starts with a 0-marker, so that the offset 0 in the index can be used to
+ * signal "no versions stored for this node". Because the input is sorted, the versions of a
+ * node never need to be moved. When the data file is full, it is grown by DATA_GROW_SIZE
+ * bytes and mapped again; because the index only contains offsets, it stays valid.
+ *
+ * The index file is grown the same way in steps of NODE_BUFFER_STEPS ids. The file is created
+ * sparse, so ids that are not used by the input do not occupy disk space.
+ */
+
+#ifndef IMPORTER_NODESTOREMMAP_HPP
+#define IMPORTER_NODESTOREMMAP_HPP
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "../timestamp.hpp"
+
+class NodestoreMmap : public Nodestore {
+private:
+    /**
+     * Number of bytes the data file grows, when it is full
+     */
+    const static size_t DATA_GROW_SIZE = 1024*1024*1024;
+    const static osm_object_id_t EST_MAX_NODE_ID = static_cast< osm_object_id_t >(1) << 31;
+    const static osm_object_id_t NODE_BUFFER_STEPS = static_cast< osm_object_id_t >(1) << 20;
+
+    /**
+     * an offset into the data file
+     */
+    typedef uint64_t offset_t;
+
+    /**
+     * a file mapped into memory
+     */
+    struct MappedFile {
+        std::string path;
+        int fd;
+        char* ptr;
+        size_t size;
+    };
+
+    /**
+     * file containing the PackedNodeTimeinfo structs
+     */
+    MappedFile data;
+
+    /**
+     * file containing the offsets into the data file, indexed by node id
+     */
+    MappedFile index;
+
+    /**
+     * number of bytes already used in the data file
+     */
+    offset_t dataPosition;
+
+    osm_object_id_t maxNodeId;
+    osm_object_id_t lastNodeId;
+
+
+    void openFile(MappedFile& file, const std::string& path, size_t size) {
+        file.path = path;
+        file.fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(file.fd == -1) {
+            std::cerr << "can't open nodestore file " << path << ": " << strerror(errno) << std::endl;
+            throw std::runtime_error("opening nodestore file failed");
+        }
+
+        file.ptr = NULL;
+        file.size = 0;
+        resizeFile(file, size);
+    }
+
+    void resizeFile(MappedFile& file, size_t size) {
+        if(file.ptr) {
+            munmap(file.ptr, file.size);
+            file.ptr = NULL;
+        }
+
+        if(ftruncate(file.fd, size) == -1) {
+            std::cerr << "can't resize nodestore file " << file.path << " to " << size << " bytes: " << strerror(errno) << std::endl;
+            throw std::runtime_error("resizing nodestore file failed");
+        }
+
+        void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+        if(ptr == MAP_FAILED) {
+            std::cerr << "can't map nodestore file " << file.path << " (" << size << " bytes): " << strerror(errno) << std::endl;
+            throw std::runtime_error("mapping nodestore file failed");
+        }
+
+        file.ptr = static_cast< char* >(ptr);
+        file.size = size;
+    }
+
+    void closeFile(MappedFile& file) {
+        if(file.ptr) {
+            munmap(file.ptr, file.size);
+            file.ptr = NULL;
+        }
+
+        if(file.fd != -1) {
+            close(file.fd);
+            unlink(file.path.c_str());
+            file.fd = -1;
+        }
+    }
+
+    offset_t* idMap() {
+        return reinterpret_cast< offset_t* >(index.ptr);
+    }
+
+    PackedNodeTimeinfo* infoAt(offset_t offset) {
+        return reinterpret_cast< PackedNodeTimeinfo* >(data.ptr + offset);
+    }
+
+    /**
+     * the offset of the first version of the node or 0, if the node is unknown
+     */
+    offset_t offsetOf(osm_object_id_t id) {
+        if(id < 0 || id > maxNodeId) {
+            return 0;
+        }
+        return idMap()[id];
+    }
+
+public:
+    /**
+     * create a new mmap nodestore with its files placed in the directory dir
+     */
+    NodestoreMmap(const std::string& dir) : Nodestore(), dataPosition(nodeSeparatorSize), maxNodeId(EST_MAX_NODE_ID), lastNodeId() {
+        std::stringstream pid;
+        pid << getpid();
+
+        openFile(data, dir + "/osm-history-importer-nodes." + pid.str() + ".data", DATA_GROW_SIZE);
+        openFile(index, dir + "/osm-history-importer-nodes." + pid.str() + ".index", (EST_MAX_NODE_ID + 1) * sizeof(offset_t));
+
+        // the files are read in random order, so read-ahead would only waste memory
+        madvise(data.ptr, data.size, MADV_RANDOM);
+        madvise(index.ptr, index.size, MADV_RANDOM);
+
+        infoAt(0)->t = 0;
+    }
+
+    ~NodestoreMmap() {
+        closeFile(data);
+        closeFile(index);
+    }
+
+    void record(osm_object_id_t id, osm_user_id_t uid, time_t t, double lon, double lat) {
+        // remember: sorting is guaranteed nodes, ways relations in ascending id and then version order
+        if(id < 0) {
+            if(isPrintingStoreErrors()) {
+                std::cerr << "the mmap nodestore can't store negative node id #" << id << ", skipping" << std::endl;
+            }
+            return;
+        }
+
+        // make sure there is space for the separator, the new version and the end-marker
+        if(dataPosition + nodeSeparatorSize + sizeof(PackedNodeTimeinfo) + nodeSeparatorSize > data.size) {
+            if(isPrintingDebugMessages()) {
+                std::cerr << "  -> data file is full (pos " << dataPosition << ", size " << data.size << "), growing by " << DATA_GROW_SIZE << " bytes" << std::endl;
+            }
+
+            resizeFile(data, data.size + DATA_GROW_SIZE);
+            madvise(data.ptr, data.size, MADV_RANDOM);
+        }
+
+        if(lastNodeId != id) {
+            // new node, skip over the 0-separator of the previous node
+            dataPosition += nodeSeparatorSize;
+
+            if(id > maxNodeId) {
+                maxNodeId = id + NODE_BUFFER_STEPS;
+
+                if(isPrintingDebugMessages()) {
+                    std::cerr << "  -> growing index file to " << maxNodeId << " node ids" << std::endl;
+                }
+
+                resizeFile(index, (maxNodeId + 1) * sizeof(offset_t));
+                madvise(index.ptr, index.size, MADV_RANDOM);
+            }
+
+            if(isPrintingDebugMessages()) {
+                std::cerr << "  -> assigning data file offset " << dataPosition << " to node id #" << id << std::endl;
+            }
+
+            idMap()[id] = dataPosition;
+        }
+
+        PackedNodeTimeinfo *infoPtr = infoAt(dataPosition);
+
+        if(isPrintingDebugMessages()) {
+            std::cerr << "  -> storing " << sizeof(PackedNodeTimeinfo) << " bytes of data at data file offset " << dataPosition << std::endl;
+        }
+
+        infoPtr->t = t;
+        infoPtr->uid = uid;
+        infoPtr->lat = toFix(lat);
+        infoPtr->lon = toFix(lon);
+
+        // mark end of memory for this node
+        infoPtr++;
+        infoPtr->t = 0;
+
+        dataPosition += sizeof(PackedNodeTimeinfo);
+        lastNodeId = id;
+    }
+
+    timemap_ptr lookup(osm_object_id_t id, bool &found) {
+        if(isPrintingStoreErrors()) {
+            std::cout << "lookup for timemap of node #" << id << std::endl;
+        }
+
+        offset_t offset = offsetOf(id);
+        if(!offset) {
+            if(isPrintingStoreErrors()) {
+                std::cerr << "  -> no data file offset assigned for node, skipping" << std::endl;
+            }
+
+            found = false;
+            return timemap_ptr();
+        }
+
+        PackedNodeTimeinfo *infoPtr = infoAt(offset);
+        timemap_ptr tMap(new timemap());
+
+        Nodeinfo info;
+        do {
+            info.lat = fromFix(infoPtr->lat);
+            info.lon = fromFix(infoPtr->lon);
+            info.uid = infoPtr->uid;
+            tMap->insert(timepair(infoPtr->t, info));
+        } while((++infoPtr)->t != 0);
+
+        if(isPrintingDebugMessages()) {
+            std::cerr << "  -> returning timemap with " << tMap->size() << " items" << std::endl;
+        }
+
+        found = true;
+        return tMap;
+    }
+
+    Nodeinfo lookup(osm_object_id_t id, time_t t, bool &found) {
+        if(isPrintingStoreErrors()) {
+            std::cout << "lookup for coords of oldest node #" << id << " younger-or-equal then " << t << " (" << Timestamp::format(t) << ")" << std::endl;
+        }
+
+        offset_t offset = offsetOf(id);
+        if(!offset) {
+            if(isPrintingStoreErrors()) {
+                std::cerr << "  -> no data file offset assigned for node, skipping" << std::endl;
+            }
+
+            found = false;
+            return nullinfo;
+        }
+
+        PackedNodeTimeinfo *basePtr = infoAt(offset), *infoPtr = basePtr;
+
+        Nodeinfo info = nullinfo;
+        time_t infoTime = 0;
+
+        // find the oldest node-version younger then t
+        do {
+            if(infoPtr->t <= t && infoPtr->t > infoTime) {
+                info.lat = fromFix(infoPtr->lat);
+                info.lon = fromFix(infoPtr->lon);
+                info.uid = infoPtr->uid;
+                infoTime = infoPtr->t;
+            }
+        } while((++infoPtr)->t != 0);
+
+        if(infoTime == 0) {
+            info.lat = fromFix(basePtr->lat);
+            info.lon = fromFix(basePtr->lon);
+            info.uid = basePtr->uid;
+            infoTime = basePtr->t;
+
+            if(isPrintingDebugMessages()) {
+                std::cerr << "  -> way is younger " << Timestamp::format(t) << " then the youngest available version of the node, using first version from " << infoTime << " (" << Timestamp::format(infoTime) << ")" << std::endl;
+            }
+        }
+        else {
+            if(isPrintingDebugMessages()) {
+                std::cerr << "  -> returning coords from " << infoTime << " (" << Timestamp::format(infoTime) << ")" << std::endl;
+            }
+        }
+
+        found = (infoTime > 0);
+        return info;
+    }
+
+    bool versions(osm_object_id_t id, VersionCursor &cursor) {
+        offset_t offset = offsetOf(id);
+        if(!offset) {
+            if(isPrintingStoreErrors()) {
+                std::cerr << "no data file offset assigned for node #" << id << ", skipping" << std::endl;
+            }
+
+            clearCursor(cursor);
+            return false;
+        }
+
+        startCursor(cursor, infoAt(offset), false);
+        return true;
+    }
+};
+
+#endif // IMPORTER_NODESTOREMMAP_HPP
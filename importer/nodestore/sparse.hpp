@@ -5,14 +5,16 @@
  * bugs. Sooner or later Sparse will become the defaul node-store, as it's your only option
  * to import larger extracts or even a whole planet.
  *
- * It used two main memory areas: a sparsetable and one or more malloc'ed memory blocks.
+ * It used two main memory areas: an id index and one or more malloc'ed memory blocks.
  * Each memory block is BLOCK_SIZE bytes big. Each node-version is stored as a PackedNodeTimeinfo
  * struct (currently 16 bytes) in the memory block. The versions of two nodes are separated using
  * a 4-byte long marker containing only 0 bytes.
  *
- * The sparsetable mapps the node-ids to those memory positions. To fetch all Versions of a node,
- * the code follows the pointer in the sparsetable to the first version of the node and checks
- * all memory locations until the 0 marker.
+ * The id index mapps the node-ids to those memory positions. To fetch all Versions of a node,
+ * the code follows the offset in the index to the first version of the node and checks
+ * all memory locations until the 0 marker. The offsets are 40 bit wide, see idindex.hpp for
+ * the two available index implementations (a sparsetable for extracts and a dense array for
+ * planets).
  *
  *   +-----------------------+--------+--------------
  *   | n1v1 n1v2 n1v4 n1v5 0 | n2v1 0 | n3v1 n3v2 ...
@@ -30,20 +32,33 @@
  * into it. Then a new memory block is allocated.
  *
  *   When the current node-id has not been seen before, nothing more is needed: the node is just
- *   placed into the new block and the pointer into this block is stored in the sparsetable.
+ *   placed into the new block and the offset into this block is stored in the id index.
  *
- *   When the current node-id already has a pointer in the sparsetable, all versions of the node
- *   are copied into the new block. The sparsetable-pointer is updated to the destination-location
+ *   When the current node-id already has an offset in the id index, all versions of the node
+ *   are copied into the new block. The offset in the index is updated to the destination-location
  *   in the new memory block. new versions can now be appended into the new block. the space in
  *   the old block is not reused.
+ *
+ * Optionally the versions of a node can be stored as a compressed chain. The first version is
+ * stored as full PackedNodeTimeinfo, all later versions only as zig-zag varint deltas of t, lat,
+ * lon and uid to the version before them. The chain is terminated by a single 0 byte (the encoded
+ * t-delta is stored +1, so it never starts with a 0 byte). Chains start at 4-byte boundaries, so
+ * the same offsets can be used in the id index.
+ *
+ *   +---------------------------------------+-----------+--------------
+ *   | n1v1 +dn1v2 +dn1v4 +dn1v5 0 (padding) | n2v1 0 .. | n3v1 +dn3v2 ...
+ *   +---------------------------------------+-----------+--------------
+ *
+ * Consecutive versions of a node usually differ only in a few bits, so a delta takes around 6
+ * instead of 16 bytes. Lookups decode the (short) chain on the fly.
  */
 
 #ifndef IMPORTER_NODESTORESPARSE_HPP
 #define IMPORTER_NODESTORESPARSE_HPP
 
-#include <google/sparsetable>
 #include <memory>
 #include "../timestamp.hpp"
+#include "idindex.hpp"
 
 class NodestoreSparse : public Nodestore {
 private:
@@ -51,8 +66,20 @@ private:
      * Size of one allocated memory block
      */
     const static size_t BLOCK_SIZE = 512*1024*1024;
-    const static osm_object_id_t EST_MAX_NODE_ID = 2^31; // soon 2^32
-    const static osm_object_id_t NODE_BUFFER_STEPS = 2^16; // soon 2^32
+    const static osm_object_id_t EST_MAX_NODE_ID = static_cast< osm_object_id_t >(1) << 31; // soon 1 << 32
+    const static osm_object_id_t NODE_BUFFER_STEPS = static_cast< osm_object_id_t >(1) << 16;
+
+    /**
+     * an offset consists of the number of the memory block in the upper
+     * bits and the number of the 4-byte word inside the block in the
+     * lower BLOCK_WORD_BITS bits
+     */
+    const static int BLOCK_WORD_BITS = 27;
+
+    /**
+     * maximum number of bytes one delta-encoded version takes in a compressed chain
+     */
+    const static size_t MAX_DELTA_SIZE = 4 * Varint::MAX_SIZE;
 
     typedef std::vector< char* > memoryBlocks_t;
     typedef std::vector< char* >::const_iterator memoryBlocks_cit;
@@ -72,6 +99,23 @@ private:
      */
     size_t currentMemoryBlockPosition;
 
+    /**
+     * store the versions of a node as compressed chain
+     */
+    bool compressed;
+
+    /**
+     * position of the first version of the last recorded node in the
+     * currentMemoryBlock (compressed chains only)
+     */
+    size_t currentChainStart;
+
+    /**
+     * the last recorded version, the next delta is calculated against it
+     * (compressed chains only)
+     */
+    PackedNodeTimeinfo lastInfo;
+
 
     char* allocateNewMemoryBlock() {
         currentMemoryBlock = static_cast< char* >(malloc(BLOCK_SIZE));
@@ -89,57 +133,181 @@ private:
     }
 
     /**
-     * the information stored for each node, packed into ints
+     * index, mapping node ids to their positions in a memory block
+     * exactly one of them is used
      */
-    struct PackedNodeTimeinfo {
-        /**
-         * osmium gives us a time_t which is a signed int
-         * on 32 bit platformsm time_t is 4 bytes wide and it will overflow on year 2038
-         * on 64 bit platforms, time_t is 8 bytes wide and will not overflow during the next decades
-         * we know that osm did not exists before 1970, so there is no need to encode times prior to that point
-         * using this knowledge we can extend the reach of our unix timestamp by ~60 years by using an unsigned
-         * 8 byte int. this gives us best of both worlds: a smaller memory footprint and enough time to buy more ram
-         * (as of today's 2013: 93 years. should be enough for everybody.)
-         */
-        uint32_t t;
-
-        /**
-         * user-id used for assigning usernames and ids to minor ways
-         */
-        osm_user_id_t uid;
-
-        /**
-         * osmium handles lat/lon either as double (8 bytes) or as int32_t (4 byted). So we choose the smaller one.
-         */
-        int32_t lat;
-
-        /**
-         * same as for lat
-         */
-        int32_t lon;
-    };
-
-    static const int nodeSeparatorSize = sizeof(((PackedNodeTimeinfo *)0)->t);
+    SparseIdIndex *sparseIdMap;
+    DenseIdIndex *denseIdMap;
+
+    osm_object_id_t maxNodeId;
+    osm_object_id_t lastNodeId;
 
     /**
-     * sparse table, mapping node ids to their positions in a memory block
+     * the offset of the current position in the current memory block
      */
-    google::sparsetable< PackedNodeTimeinfo* > idMap;
+    nodestore_offset_t currentOffset() {
+        return offsetOf(currentMemoryBlockPosition);
+    }
 
-    osm_object_id_t maxNodeId;
-    osm_object_id_t lastNodeId;
+    /**
+     * the offset of a position in the current memory block
+     */
+    nodestore_offset_t offsetOf(size_t position) {
+        return (static_cast< nodestore_offset_t >(memoryBlocks.size() - 1) << BLOCK_WORD_BITS) | (position / nodeSeparatorSize);
+    }
+
+    /**
+     * the memory position an offset points to
+     */
+    PackedNodeTimeinfo* infoAt(nodestore_offset_t offset) {
+        char* block = memoryBlocks[offset >> BLOCK_WORD_BITS];
+        return reinterpret_cast< PackedNodeTimeinfo* >(block + (offset & ((1 << BLOCK_WORD_BITS) - 1)) * nodeSeparatorSize);
+    }
+
+    /**
+     * the offset of the first version of a node or 0, if the node is unknown
+     */
+    nodestore_offset_t getOffset(osm_object_id_t id) {
+        if(denseIdMap) {
+            return denseIdMap->get(id);
+        }
+        return sparseIdMap->get(id);
+    }
+
+    void setOffset(osm_object_id_t id, nodestore_offset_t offset) {
+        if(id > maxNodeId) {
+            if(denseIdMap) {
+                // grow the dense index in bigger steps, its memory is not touched until it's used
+                maxNodeId = std::max(id + NODE_BUFFER_STEPS, maxNodeId + maxNodeId / 2);
+                denseIdMap->resize(maxNodeId + 1);
+            } else {
+                maxNodeId = id + NODE_BUFFER_STEPS;
+                sparseIdMap->resize(maxNodeId + 1);
+            }
+        }
+
+        if(denseIdMap) {
+            denseIdMap->set(id, offset);
+        } else {
+            sparseIdMap->set(id, offset);
+        }
+    }
+
+
+    /**
+     * record a node version into a compressed chain
+     */
+    void recordCompressed(osm_object_id_t id, osm_user_id_t uid, time_t t, double lon, double lat) {
+        PackedNodeTimeinfo info;
+        info.t = t;
+        info.uid = uid;
+        info.lat = toFix(lat);
+        info.lon = toFix(lon);
+
+        // a new chain starts on the next 4-byte boundary behind the 0 byte of the last chain,
+        // it needs space for the full version and its 0 byte
+        size_t needed = (lastNodeId != id) ? (nodeSeparatorSize + sizeof(PackedNodeTimeinfo) + 1) : (MAX_DELTA_SIZE + 1);
+
+        if(currentMemoryBlockPosition + needed >= BLOCK_SIZE) {
+            char* oldMemoryBlock = currentMemoryBlock;
+            size_t chainLength = currentMemoryBlockPosition - currentChainStart;
+
+            if(isPrintingDebugMessages()) {
+                std::cerr << "  -> memory block is full (pos " << currentMemoryBlockPosition << " + " << needed << " >= BLOCK_SIZE " << BLOCK_SIZE << ")" << std::endl;
+            }
+
+            allocateNewMemoryBlock();
+
+            if(lastNodeId == id) {
+                // same node as before, need to copy the chain into new memory block
+                if(chainLength + needed >= BLOCK_SIZE) {
+                    std::cerr << "  -> node #" << id << " has more versions then could fit into a block size of " << BLOCK_SIZE << ". It's very unlikely that this ever happens, but you could try to increase the BLOCK_SIZE..." << std::endl;
+                    throw new std::runtime_error("node does not fit into BLOCK_SIZE");
+                }
+
+                if(isPrintingDebugMessages()) {
+                    std::cerr << "  -> copying compressed chain of node #" << id << " (" << chainLength << " bytes) to new memory block at " << (void*)currentMemoryBlock << std::endl;
+                }
+
+                memcpy(currentMemoryBlock, oldMemoryBlock + currentChainStart, chainLength);
+                currentChainStart = 0;
+                currentMemoryBlockPosition = chainLength;
+                setOffset(id, offsetOf(currentChainStart));
+            }
+        }
+
+        if(lastNodeId != id) {
+            // new node, skip the 0 byte of the last chain and align to the next 4-byte boundary
+            if(currentMemoryBlockPosition > 0) {
+                currentMemoryBlockPosition = (currentMemoryBlockPosition + nodeSeparatorSize) & ~(nodeSeparatorSize - 1);
+            }
+
+            currentChainStart = currentMemoryBlockPosition;
+            setOffset(id, offsetOf(currentChainStart));
+
+            if(isPrintingDebugMessages()) {
+                std::cerr << "  -> starting compressed chain of node id #" << id << " at offset " << currentChainStart << std::endl;
+            }
+
+            memcpy(currentMemoryBlock + currentMemoryBlockPosition, &info, sizeof(PackedNodeTimeinfo));
+            currentMemoryBlockPosition += sizeof(PackedNodeTimeinfo);
+        }
+        else {
+            // same node, append the delta to the last version
+            char* ptr = currentMemoryBlock + currentMemoryBlockPosition;
+            ptr = Varint::write(ptr, Varint::zigzag(static_cast< int64_t >(info.t) - lastInfo.t) + 1);
+            ptr = Varint::write(ptr, Varint::zigzag(static_cast< int64_t >(info.lat) - lastInfo.lat));
+            ptr = Varint::write(ptr, Varint::zigzag(static_cast< int64_t >(info.lon) - lastInfo.lon));
+            ptr = Varint::write(ptr, Varint::zigzag(static_cast< int64_t >(info.uid) - lastInfo.uid));
+
+            if(isPrintingDebugMessages()) {
+                std::cerr << "  -> appending " << (ptr - currentMemoryBlock - currentMemoryBlockPosition) << " bytes of delta to compressed chain of node id #" << id << std::endl;
+            }
+
+            currentMemoryBlockPosition = ptr - currentMemoryBlock;
+        }
+
+        // mark end of the chain
+        currentMemoryBlock[currentMemoryBlockPosition] = 0;
+
+        lastInfo = info;
+        lastNodeId = id;
+    }
 
 
 public:
-    NodestoreSparse() : Nodestore(), memoryBlocks(), idMap(EST_MAX_NODE_ID), maxNodeId(EST_MAX_NODE_ID), lastNodeId() {
+    /**
+     * create a new sparse nodestore, either with a dense or with a sparse
+     * id index, storing the versions of a node either plain or as
+     * compressed chain
+     */
+    NodestoreSparse(bool denseIndex = false, bool compressedChains = false) : Nodestore(), memoryBlocks(), compressed(compressedChains), currentChainStart(0), lastInfo(), sparseIdMap(NULL), denseIdMap(NULL), maxNodeId(EST_MAX_NODE_ID), lastNodeId() {
+        if(denseIndex) {
+            // the dense index grows with the ids it sees
+            maxNodeId = NODE_BUFFER_STEPS;
+            denseIdMap = new DenseIdIndex(maxNodeId + 1);
+        } else {
+            sparseIdMap = new SparseIdIndex(EST_MAX_NODE_ID + 1);
+        }
+
         allocateNewMemoryBlock();
+
+        // the offset 0 signals "not found" in the index, so don't place a node there
+        currentMemoryBlockPosition = nodeSeparatorSize;
     }
     ~NodestoreSparse() {
+        delete sparseIdMap;
+        delete denseIdMap;
         freeAllMemoryBlocks();
     }
 
     void record(osm_object_id_t id, osm_user_id_t uid, time_t t, double lon, double lat) {
         // remember: sorting is guaranteed nodes, ways relations in ascending id and then version order
+        if(compressed) {
+            recordCompressed(id, uid, t, lon, lat);
+            return;
+        }
+
         PackedNodeTimeinfo *infoPtr;
 
         // test if there is enough space for another PackedNodeTimeinfo
@@ -167,18 +335,15 @@ public:
             }
             else {
                 // same node as before, need to copy old versions into new memory block
-                if(isPrintingDebugMessages()) {
-                    std::cerr << "  -> node " << id << " has already a memory position assigned (" << idMap[id] << ")" << std::endl;
-                }
-
-                PackedNodeTimeinfo* srcPtr = idMap[id];
+                PackedNodeTimeinfo* srcPtr = infoAt(getOffset(id));
                 PackedNodeTimeinfo* dstPtr = reinterpret_cast< PackedNodeTimeinfo* >(currentMemoryBlock + currentMemoryBlockPosition);
 
                 if(isPrintingDebugMessages()) {
-                    std::cerr << "  -> copying node versions from old position (" << idMap[id] << ") to new position (" << (void*)currentMemoryBlock << ", offset " << currentMemoryBlockPosition << ")" << std::endl;
+                    std::cerr << "  -> node " << id << " has already a memory position assigned (" << srcPtr << ")" << std::endl;
+                    std::cerr << "  -> copying node versions from old position (" << srcPtr << ") to new position (" << (void*)currentMemoryBlock << ", offset " << currentMemoryBlockPosition << ")" << std::endl;
                     std::cerr << "  -> re-assigning memory position " << dstPtr << " (offset: " << currentMemoryBlockPosition << ") to node id #" << id << std::endl;
                 }
-                idMap[id] = dstPtr;
+                setOffset(id, currentOffset());
 
                 do {
                     if(isPrintingDebugMessages()) {
@@ -218,11 +383,7 @@ public:
                 std::cerr << "  -> assigning memory position " << infoPtr << " (offset: " << currentMemoryBlockPosition << ") to node id #" << id << std::endl;
             }
 
-            if(id > maxNodeId) {
-                idMap.resize(id + NODE_BUFFER_STEPS + 1);
-                maxNodeId = id + NODE_BUFFER_STEPS;
-            }
-            idMap[id] = infoPtr;
+            setOffset(id, currentOffset());
         }
         else {
             // no memory segment for this node yet
@@ -235,8 +396,8 @@ public:
 
         infoPtr->t = t;
         infoPtr->uid = uid;
-        infoPtr->lat = Osmium::OSM::double_to_fix(lat);
-        infoPtr->lon = Osmium::OSM::double_to_fix(lon);
+        infoPtr->lat = toFix(lat);
+        infoPtr->lon = toFix(lon);
 
 
         // mark end of memory for this node
@@ -256,7 +417,8 @@ public:
             std::cout << "lookup for timemap of node #" << id << std::endl;
         }
 
-        if(!idMap.test(id)) {
+        nodestore_offset_t offset = getOffset(id);
+        if(!offset) {
             if(isPrintingStoreErrors()) {
                 std::cerr << "  -> no memory position assigned for node, skipping" << std::endl;
             }
@@ -265,23 +427,23 @@ public:
             return timemap_ptr();
         }
 
+        PackedNodeTimeinfo *basePtr = infoAt(offset);
         if(isPrintingDebugMessages()) {
-            std::cerr << "  idMap[id]=" << idMap[id] << std::endl;
+            std::cerr << "  idMap[id]=" << basePtr << std::endl;
         }
-
-        PackedNodeTimeinfo *basePtr = idMap[id], *infoPtr = basePtr;
         timemap_ptr tMap(new timemap());
 
+        ChainCursor cursor(basePtr, compressed);
         Nodeinfo info;
-        do {
+        while(cursor.next()) {
             if(isPrintingDebugMessages()) {
-                std::cerr << "  -> found node id #" << id << "at memory position " << infoPtr << " (node-offset " << ((char*)infoPtr-(char*)basePtr) << ")" << std::endl;
+                std::cerr << "  -> found node id #" << id << " at " << cursor.info.t << std::endl;
             }
-            info.lat = Osmium::OSM::fix_to_double(infoPtr->lat);
-            info.lon = Osmium::OSM::fix_to_double(infoPtr->lon);
-            info.uid = infoPtr->uid;
-            tMap->insert(timepair(infoPtr->t, info));
-        } while((++infoPtr)->t != 0);
+            info.lat = fromFix(cursor.info.lat);
+            info.lon = fromFix(cursor.info.lon);
+            info.uid = cursor.info.uid;
+            tMap->insert(timepair(cursor.info.t, info));
+        }
 
         if(isPrintingDebugMessages()) {
             std::cerr << "  -> returning timemap with " << tMap->size() << " items" << std::endl;
@@ -296,7 +458,8 @@ public:
             std::cout << "lookup for coords of oldest node #" << id << " younger-or-equal then " << t << " (" << Timestamp::format(t) << ")" << std::endl;
         }
 
-        if(!idMap.test(id)) {
+        nodestore_offset_t offset = getOffset(id);
+        if(!offset) {
             if(isPrintingStoreErrors()) {
                 std::cerr << "  -> no memory position assigned for node, skipping" << std::endl;
             }
@@ -305,35 +468,36 @@ public:
             return nullinfo;
         }
 
-        PackedNodeTimeinfo *basePtr = idMap[id], *infoPtr = basePtr;
+        PackedNodeTimeinfo *basePtr = infoAt(offset);
         if(isPrintingDebugMessages()) {
-            std::cerr << "  idMap[id]=" << idMap[id] << std::endl;
+            std::cerr << "  idMap[id]=" << basePtr << std::endl;
         }
 
         Nodeinfo info = nullinfo;
         time_t infoTime = 0;
 
         // find the oldest node-version younger then t
-        do {
+        ChainCursor cursor(basePtr, compressed);
+        while(cursor.next()) {
             if(isPrintingDebugMessages()) {
-                std::cerr << "  -> probing node id #" << id << " at " << infoPtr->t << " (" << Timestamp::format(infoPtr->t) << ") at memory position " << infoPtr << " (node-offset " << ((char*)infoPtr-(char*)basePtr) << ")" << std::endl;
+                std::cerr << "  -> probing node id #" << id << " at " << cursor.info.t << " (" << Timestamp::format(cursor.info.t) << ")" << std::endl;
             }
 
-            if(infoPtr->t <= t && infoPtr->t > infoTime) {
-                info.lat = Osmium::OSM::fix_to_double(infoPtr->lat);
-                info.lon = Osmium::OSM::fix_to_double(infoPtr->lon);
-                info.uid = infoPtr->uid;
-                infoTime = infoPtr->t;
+            if(cursor.info.t <= t && cursor.info.t > infoTime) {
+                info.lat = fromFix(cursor.info.lat);
+                info.lon = fromFix(cursor.info.lon);
+                info.uid = cursor.info.uid;
+                infoTime = cursor.info.t;
 
                 if(isPrintingDebugMessages()) {
                     std::cerr << "    -> match, copying data" << std::endl;
                 }
             }
-        } while((++infoPtr)->t != 0);
+        }
 
         if(infoTime == 0) {
-            info.lat = Osmium::OSM::fix_to_double(basePtr->lat);
-            info.lon = Osmium::OSM::fix_to_double(basePtr->lon);
+            info.lat = fromFix(basePtr->lat);
+            info.lon = fromFix(basePtr->lon);
             info.uid = basePtr->uid;
             infoTime = basePtr->t;
 
@@ -350,6 +514,21 @@ public:
         found = (infoTime > 0);
         return info;
     }
+
+    bool versions(osm_object_id_t id, VersionCursor &cursor) {
+        nodestore_offset_t offset = getOffset(id);
+        if(!offset) {
+            if(isPrintingStoreErrors()) {
+                std::cerr << "no memory position assigned for node #" << id << ", skipping" << std::endl;
+            }
+
+            clearCursor(cursor);
+            return false;
+        }
+
+        startCursor(cursor, infoAt(offset), compressed);
+        return true;
+    }
 };
 
 #endif // IMPORTER_NODESTORESPARSE_HPP
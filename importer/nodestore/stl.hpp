@@ -95,6 +95,20 @@ public:
         found = true;
         return tit->second;
     }
+
+    bool versions(osm_object_id_t id, VersionCursor &cursor) {
+        nodemap_cit nit = m_nodemap.find(id);
+        if(nit == m_nodemap.end()) {
+            if(isPrintingStoreErrors()) {
+                std::cerr << "no timemap for node #" << id << ", skipping node" << std::endl;
+            }
+            clearCursor(cursor);
+            return false;
+        }
+
+        startCursor(cursor, *nit->second);
+        return true;
+    }
 };
 
 #endif // IMPORTER_NODESTORESTL_HPP
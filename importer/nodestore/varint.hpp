@@ -0,0 +1,66 @@
+/**
+ * The compressed version chains of the sparse nodestore store the
+ * differences between two versions of a node as zig-zag encoded varints,
+ * the same way protobuf (and so the pbf format) does:
+ *   https://developers.google.com/protocol-buffers/docs/encoding#varints
+ *
+ * Small positive and negative numbers take only one or two bytes.
+ */
+
+#ifndef IMPORTER_NODESTORE_VARINT_HPP
+#define IMPORTER_NODESTORE_VARINT_HPP
+
+/**
+ * Encodes and decodes zig-zag varints
+ */
+class Varint {
+public:
+    /**
+     * maximum number of bytes one encoded 64 bit value can take
+     */
+    static const int MAX_SIZE = 10;
+
+    /**
+     * map signed to unsigned numbers, so that numbers with a small
+     * absolute value have a small encoding
+     */
+    static uint64_t zigzag(int64_t n) {
+        return (static_cast< uint64_t >(n) << 1) ^ static_cast< uint64_t >(n >> 63);
+    }
+
+    /**
+     * the reverse of zigzag
+     */
+    static int64_t unzigzag(uint64_t n) {
+        return static_cast< int64_t >(n >> 1) ^ -static_cast< int64_t >(n & 1);
+    }
+
+    /**
+     * write n to ptr and return the position after it
+     */
+    static char* write(char* ptr, uint64_t n) {
+        while(n >= 0x80) {
+            *ptr++ = static_cast< char >(n | 0x80);
+            n >>= 7;
+        }
+        *ptr++ = static_cast< char >(n);
+        return ptr;
+    }
+
+    /**
+     * read a value from ptr and advance ptr behind it
+     */
+    static uint64_t read(const char*& ptr) {
+        uint64_t n = 0;
+        int shift = 0;
+        unsigned char c;
+        do {
+            c = static_cast< unsigned char >(*ptr++);
+            n |= static_cast< uint64_t >(c & 0x7f) << shift;
+            shift += 7;
+        } while(c & 0x80);
+        return n;
+    }
+};
+
+#endif // IMPORTER_NODESTORE_VARINT_HPP
@@ -0,0 +1,72 @@
+/**
+ * The tags of every way version are checked against short, fixed lists
+ * of keys and values, like the keys that make a way an area or the
+ * highway classes of the z-order. Instead of comparing a tag against
+ * each entry of such a list, the PerfectHash maps it to the only entry
+ * it could be equal to, so a single strcmp decides.
+ *
+ * The hash combines the length, the first two and the last character of
+ * a string. Its parameters are chosen for each list, so that no two
+ * entries of the list share a slot. The slots are filled from the list
+ * when it is first used, a collision (because the list was changed
+ * without choosing new parameters) is reported as an error then.
+ */
+
+#ifndef IMPORTER_PERFECTHASH_HPP
+#define IMPORTER_PERFECTHASH_HPP
+
+#include <string.h>
+#include <stdexcept>
+
+/**
+ * Maps the strings of a fixed list to their index in the list
+ */
+template <int SIZE, int A, int B, int C>
+class PerfectHash {
+private:
+    const char *m_keys[SIZE];
+    int m_index[SIZE];
+
+    static int slot(const char *str, size_t len) {
+        const unsigned char *s = reinterpret_cast< const unsigned char* >(str);
+        return (len * A + s[0] * B + s[1] * C + s[len - 1]) % SIZE;
+    }
+
+public:
+    PerfectHash() {
+        for(int i = 0; i < SIZE; i++) {
+            m_keys[i] = NULL;
+            m_index[i] = -1;
+        }
+    }
+
+    /**
+     * add the entry at index of the list
+     */
+    void add(const char *key, int index) {
+        int h = slot(key, strlen(key));
+        if(m_keys[h]) {
+            throw std::runtime_error(std::string("perfect hash collision between ") + m_keys[h] + " and " + key);
+        }
+        m_keys[h] = key;
+        m_index[h] = index;
+    }
+
+    /**
+     * the index of str in the list or -1, if it is not part of it
+     */
+    int find(const char *str) const {
+        size_t len = strlen(str);
+        if(len == 0) {
+            return -1;
+        }
+
+        int h = slot(str, len);
+        if(!m_keys[h] || 0 != strcmp(m_keys[h], str)) {
+            return -1;
+        }
+        return m_index[h];
+    }
+};
+
+#endif // IMPORTER_PERFECTHASH_HPP
@@ -10,6 +10,8 @@
 #ifndef IMPORTER_POLYGONIDENTIFYER_HPP
 #define IMPORTER_POLYGONIDENTIFYER_HPP
 
+#include "perfecthash.hpp"
+
 /**
  * list of tags that let a closed way look like a polygon
  */
@@ -44,6 +46,25 @@ const char *polygons[] =
  * could potentially be a polygon.
  */
 class PolygonIdentifyer {
+private:
+    /**
+     * perfect hash over the polygons list, see perfecthash.hpp
+     */
+    typedef PerfectHash<26, 4, 5, 1> PolygonHash;
+
+    static const PolygonHash& polygonHash() {
+        static const PolygonHash hash = buildPolygonHash();
+        return hash;
+    }
+
+    static PolygonHash buildPolygonHash() {
+        PolygonHash hash;
+        for(int i = 0; polygons[i] != 0; i++) {
+            hash.add(polygons[i], i);
+        }
+        return hash;
+    }
+
 public:
 
     /**
@@ -51,18 +72,16 @@ public:
      * way could potentially be a polygon.
      */
     static bool looksLikePolygon(const Osmium::OSM::TagList& tags) {
+        const PolygonHash& hash = polygonHash();
+
         // iterate over all tags
         for(Osmium::OSM::TagList::const_iterator it = tags.begin(); it != tags.end(); ++it) {
 
-            // iterate over all known polygon-tags
-            for(int i = 0; polygons[i] != 0; i++) {
-
-                // compare the tag name
-                if(0 == strcmp(polygons[i], it->key())) {
+            // compare the tag name with the known polygon-tag it could be
+            if(hash.find(it->key()) >= 0) {
 
-                    // yep, it looks like a polygon
-                    return true;
-                }
+                // yep, it looks like a polygon
+                return true;
             }
         }
 
@@ -1,13 +1,44 @@
+/**
+ * The importer stores all geometries in spherical mercator (EPSG:900913).
+ * The projection from lat/lon has a simple closed form:
+ *
+ *   x = R * lon
+ *   y = R * ln(tan(pi/4 + lat/2))
+ *
+ * with R being the radius of the sphere, 6378137 meters. The Project
+ * class implements it directly, following the same steps and the same
+ * limits as the merc projection of proj4, so both yield the same results.
+ * The coordinates of a way are projected in one call, as plain loops
+ * over arrays, which the compiler can vectorize.
+ *
+ * proj4 is still available to check the results of the built-in
+ * projection, see useProj4.
+ */
+
 #ifndef IMPORTER_PROJECT_HPP
 #define IMPORTER_PROJECT_HPP
 
+#include <math.h>
 #include <proj_api.h>
+#include <pthread.h>
 
 class Project {
 private:
     projPJ pj_900913, pj_4326;
 
-    Project() {
+    /**
+     * the projections share their error state, so proj4 must not be
+     * called from multiple threads at once
+     */
+    pthread_mutex_t m_mutex;
+
+    /**
+     * project using proj4 instead of the built-in projection
+     */
+    bool m_useProj4;
+
+    Project() : m_useProj4(false) {
+        pthread_mutex_init(&m_mutex, NULL);
         //if(!(pj_900913 = pj_init_plus("+init=epsg:900913"))) {
         if(!(pj_900913 = pj_init_plus("+proj=merc +a=6378137 +b=6378137 +lat_ts=0.0 +lon_0=0.0 +x_0=0.0 +y_0=0 +k=1.0 +units=m +nadgrids=@null +no_defs"))) {
             throw std::runtime_error("can't initialize proj4 with 900913");
@@ -20,30 +51,152 @@ private:
     virtual ~Project() {
         pj_free(pj_900913);
         pj_free(pj_4326);
+        pthread_mutex_destroy(&m_mutex);
     }
 
     static Project& instance() {
         static Project the_instance;
         return the_instance;
     }
-    
+
+    static void printError(double lon, double lat) {
+        std::cerr << "error transforming POINT(" << lon << " " << lat << ") from 4326 to 900913)" << std::endl;
+    }
+
     bool _toMercator(double *lon, double *lat) {
         double inlon = *lon, inlat = *lat;
         *lon *= DEG_TO_RAD;
         *lat *= DEG_TO_RAD;
 
+        pthread_mutex_lock(&m_mutex);
         int r = pj_transform(pj_4326, pj_900913, 1, 1, lon, lat, NULL);
+        pthread_mutex_unlock(&m_mutex);
         if(r != 0) {
-            std::cerr << "error transforming POINT(" << inlon << " " << inlat << ") from 4326 to 900913)" << std::endl;
+            printError(inlon, inlat);
             *lon = *lat = 0;
             return false;
         }
         return true;
     }
 
+    /**
+     * bring a longitude in radians into -pi..pi, like adjlon of proj4
+     */
+    static double adjlon(double lam) {
+        // proj4 leaves longitudes up to this (rounded) value alone
+        const double SPI = 3.14159265359;
+
+        if(fabs(lam) <= SPI) {
+            return lam;
+        }
+
+        lam += M_PI;
+        lam -= 2 * M_PI * floor(lam / (2 * M_PI));
+        lam -= M_PI;
+        return lam;
+    }
+
+    /**
+     * the built-in projection of count coordinates in place, valid[i] is
+     * set to 0 for coordinates which can't be projected
+     */
+    static size_t mercator(double *lon, double *lat, unsigned char *valid, size_t count) {
+        // radius of the sphere
+        const double R = 6378137;
+
+        // limits as checked by proj4: latitudes beyond the poles and
+        // longitudes of more then 10 radians fail in pj_fwd, latitudes
+        // at the poles fail in the merc projection
+        const double EPS = 1e-12, EPS10 = 1e-10, MAX_LAM = 10;
+
+        size_t failed = 0;
+
+        // check the limits
+        for(size_t i = 0; i < count; i++) {
+            double t = fabs(lat[i] * DEG_TO_RAD) - M_PI_2;
+            valid[i] = !(t > EPS) & !(fabs(lon[i] * DEG_TO_RAD) > MAX_LAM) & !(fabs(t) <= EPS10);
+            failed += !valid[i];
+        }
+
+        if(failed) {
+            for(size_t i = 0; i < count; i++) {
+                if(!valid[i]) {
+                    printError(lon[i], lat[i]);
+                }
+            }
+        }
+
+        // convert to radians, longitudes outside of -pi..pi are rare,
+        // but wrapped around
+        for(size_t i = 0; i < count; i++) {
+            lon[i] *= DEG_TO_RAD;
+            lat[i] *= DEG_TO_RAD;
+
+            if(fabs(lon[i]) > M_PI) {
+                lon[i] = adjlon(lon[i]);
+            }
+        }
+
+        // project
+        for(size_t i = 0; i < count; i++) {
+            lon[i] = R * lon[i];
+            lat[i] = R * log(tan(M_PI_4 + .5 * lat[i]));
+        }
+
+        if(failed) {
+            for(size_t i = 0; i < count; i++) {
+                if(!valid[i]) {
+                    lon[i] = lat[i] = 0;
+                }
+            }
+        }
+
+        return failed;
+    }
+
 public:
+    /**
+     * project a coordinate from lat/lon to mercator in place, returns
+     * false and sets it to 0/0 if it can't be projected
+     */
     static bool toMercator(double *lon, double *lat) {
-        return Project::instance()._toMercator(lon, lat);
+        if(Project::instance().m_useProj4) {
+            return Project::instance()._toMercator(lon, lat);
+        }
+
+        unsigned char valid;
+        return mercator(lon, lat, &valid, 1) == 0;
+    }
+
+    /**
+     * project count coordinates from lat/lon to mercator in place
+     *
+     * valid[i] is set to 0 for each coordinate that can't be projected,
+     * these are set to 0/0. Returns the number of those coordinates.
+     */
+    static size_t toMercator(double *lon, double *lat, unsigned char *valid, size_t count) {
+        if(!Project::instance().m_useProj4) {
+            return mercator(lon, lat, valid, count);
+        }
+
+        size_t failed = 0;
+        for(size_t i = 0; i < count; i++) {
+            valid[i] = Project::instance()._toMercator(&lon[i], &lat[i]);
+            failed += !valid[i];
+        }
+        return failed;
+    }
+
+    static bool isUsingProj4() {
+        return Project::instance().m_useProj4;
+    }
+
+    /**
+     * project using proj4 instead of the built-in projection, to verify
+     * its results
+     */
+    static void useProj4(bool shouldUseProj4) {
+        Project::instance().m_useProj4 = shouldUseProj4;
     }
 };
 
@@ -0,0 +1,411 @@
+/**
+ * Each version of a multipolygon relation is written to the polygon table
+ * as one row for the main version and one row for each minor version,
+ * like a way. The minor versions of a relation are created by new versions
+ * of its member ways and by the movement of their nodes until the next
+ * version of the relation.
+ *
+ * The rows of the relations get the negated relation id, like osm2pgsql
+ * does, so they don't collide with the rows of the ways.
+ *
+ * The RelationWriter only reads from the nodestore, the waystore and the
+ * username map, so multiple instances of it can work on different
+ * relation versions at the same time, see writerpool.hpp.
+ */
+
+#ifndef IMPORTER_RELATIONWRITER_HPP
+#define IMPORTER_RELATIONWRITER_HPP
+
+#include <string.h>
+#include <geos/algorithm/InteriorPointArea.h>
+
+#include "rowbuffer.hpp"
+#include "zordercalculator.hpp"
+#include "timestamp.hpp"
+#include "waystore.hpp"
+#include "waywriter.hpp"
+#include "multipolygonbuilder.hpp"
+#include "minortimescalculator.hpp"
+
+/**
+ * Builds the geometries of a multipolygon relation version and its minor
+ * versions and encodes them as rows
+ */
+class RelationWriter {
+private:
+    Nodestore *m_store;
+    const Waystore *m_waystore;
+    DbAdapter *m_adapter;
+    const WayWriter::username_map_t *m_username_map;
+
+    MultipolygonBuilder m_geom;
+    ImportMinorTimesCalculator m_mtimes;
+
+    /**
+     * the member ways of the relation version that is currently written
+     */
+    std::vector<osm_object_id_t> m_members;
+
+    /**
+     * the times of the later versions of the member ways until the next
+     * relation version
+     */
+    std::vector<MinorTimesCalculator::MinorTimesInfo> m_way_times;
+
+    /**
+     * the minor times of the relation version that is currently written
+     */
+    std::vector<MinorTimesCalculator::MinorTimesInfo> m_minor_times;
+
+    /**
+     * the geometry of the relation version that is currently built and
+     * the geometry of the version that waits to be written
+     */
+    AreaGeometry m_area, m_pending;
+
+    /**
+     * number of relation versions and minor versions written and number
+     * of minor versions merged into the version before them, because
+     * their geometry did not change
+     */
+    uint64_t m_written, m_minorWritten, m_minorSuppressed;
+
+    bool m_debug, m_interior, m_keepLatLng;
+
+    /**
+     * the tags of the relation version that is currently written and the
+     * user of the main version and of the last minor version
+     */
+    RowBuffer m_tagsField, m_mainUserField, m_minorUserField;
+    osm_user_id_t m_minorUserUid;
+    bool m_hasMinorUser;
+
+    RowBuffer *m_rows;
+
+    /**
+     * initial size of the buffers encoding a single field
+     */
+    static const size_t FIELD_CAPACITY = 1024;
+
+    static bool isMultipolygon(const Osmium::OSM::Relation *relation) {
+        const char *type = relation->tags().get_value_by_key("type");
+        return type && 0 == strcmp(type, "multipolygon");
+    }
+
+    const char* username(osm_user_id_t uid) {
+        WayWriter::username_map_t::const_iterator it = m_username_map->find(uid);
+        if(it == m_username_map->end()) {
+            return "";
+        }
+        return it->second.c_str();
+    }
+
+    const RowBuffer& minorUserField(osm_user_id_t uid) {
+        if(!m_hasMinorUser || m_minorUserUid != uid) {
+            m_minorUserField.clear();
+            m_minorUserField.addText(username(uid));
+            m_minorUserUid = uid;
+            m_hasMinorUser = true;
+        }
+        return m_minorUserField;
+    }
+
+    void write_relation_to_db(
+        osm_object_id_t id,
+        osm_version_t version,
+        osm_version_t minor,
+        bool visible,
+        osm_user_id_t user_id,
+        const RowBuffer &user_field,
+        time_t valid_from,
+        time_t valid_to,
+        long z_order,
+        const AreaGeometry *geom
+    ) {
+        if(m_debug) {
+            std::cerr << "forging geometry of relation " << id << 'v' << version << '.' << minor << " at tstamp " << valid_from << std::endl;
+        }
+
+        if(visible && !geom) {
+            if(m_debug) {
+                std::cerr << "no valid geometry for relation " << id << 'v' << version << '.' << minor << " at tstamp " << valid_from << std::endl;
+            }
+            return;
+        }
+
+        bool hasCenter = false;
+        geos::geom::Coordinate center;
+        if(geom && m_interior) {
+            geos::geom::Geometry* geosGeom = NULL;
+            try {
+                geosGeom = geom->toGeos(900913);
+
+                geos::algorithm::InteriorPointArea interior_calculator(geosGeom);
+                interior_calculator.getInteriorPoint(center);
+                hasCenter = true;
+            } catch(const geos::util::GEOSException& e) {
+                std::cerr << "error calculating interior point: " << e.what() << std::endl;
+            }
+            delete geosGeom;
+        }
+
+        RowBuffer& rows = *m_rows;
+
+        rows.beginRow(13);
+        rows.addInt64(-id);
+        rows.addInt16(version);
+        rows.addInt16(minor);
+        rows.addBool(visible);
+        rows.addInt32(user_id);
+        rows.addField(user_field);
+        rows.addTimestampOrNull(valid_from);
+        rows.addTimestampOrNull(valid_to);
+        rows.addField(m_tagsField);
+        rows.addInt32(z_order);
+        rows.addReal(geom ? geom->area() : 0);
+
+        if(geom) {
+            rows.addAreaGeometry(*geom, 900913);
+        } else {
+            rows.addNull();
+        }
+
+        if(hasCenter) {
+            rows.addPoint(center.x, center.y, 900913);
+        } else {
+            rows.addNull();
+        }
+
+        rows.endRow();
+        m_written++;
+    }
+
+public:
+    RelationWriter(Nodestore *nodestore, const Waystore *waystore, DbAdapter *adapter, const WayWriter::username_map_t *usernames) :
+            m_store(nodestore),
+            m_waystore(waystore),
+            m_adapter(adapter),
+            m_username_map(usernames),
+            m_geom(nodestore, waystore, adapter),
+            m_mtimes(nodestore, adapter),
+            m_members(),
+            m_way_times(),
+            m_minor_times(),
+            m_area(),
+            m_pending(),
+            m_written(0),
+            m_minorWritten(0),
+            m_minorSuppressed(0),
+            m_debug(false),
+            m_interior(false),
+            m_keepLatLng(false),
+            m_tagsField(NULL, FIELD_CAPACITY),
+            m_mainUserField(NULL, FIELD_CAPACITY),
+            m_minorUserField(NULL, FIELD_CAPACITY),
+            m_minorUserUid(0),
+            m_hasMinorUser(false),
+            m_rows(NULL) {}
+
+    /**
+     * create a new writer with the same settings as other, but with its
+     * own geometry builder
+     */
+    RelationWriter(const RelationWriter& other) :
+            m_store(other.m_store),
+            m_waystore(other.m_waystore),
+            m_adapter(other.m_adapter),
+            m_username_map(other.m_username_map),
+            m_geom(other.m_store, other.m_waystore, other.m_adapter),
+            m_mtimes(other.m_store, other.m_adapter),
+            m_members(),
+            m_way_times(),
+            m_minor_times(),
+            m_area(),
+            m_pending(),
+            m_written(0),
+            m_minorWritten(0),
+            m_minorSuppressed(0),
+            m_debug(false),
+            m_interior(false),
+            m_keepLatLng(false),
+            m_tagsField(NULL, FIELD_CAPACITY),
+            m_mainUserField(NULL, FIELD_CAPACITY),
+            m_minorUserField(NULL, FIELD_CAPACITY),
+            m_minorUserUid(0),
+            m_hasMinorUser(false),
+            m_rows(NULL) {
+        printDebugMessages(other.m_debug);
+        calculateInterior(other.m_interior);
+        keepLatLng(other.m_keepLatLng);
+        minorGranularity(other.m_mtimes.granularity());
+    }
+
+    bool isCalculatingInterior() {
+        return m_interior;
+    }
+
+    void calculateInterior(bool shouldCalculateInterior) {
+        m_interior = shouldCalculateInterior;
+    }
+
+    bool isKeepingLatLng() {
+        return m_keepLatLng;
+    }
+
+    void keepLatLng(bool shouldKeepLatLng) {
+        m_keepLatLng = shouldKeepLatLng;
+        m_geom.keepLatLng(shouldKeepLatLng);
+    }
+
+    time_t minorGranularity() {
+        return m_mtimes.granularity();
+    }
+
+    /**
+     * set the length of the time buckets in seconds, changes in the same
+     * bucket make only one minor version
+     */
+    void minorGranularity(time_t seconds) {
+        m_mtimes.granularity(seconds);
+    }
+
+    /**
+     * number of rows written, including the minor versions
+     */
+    uint64_t versionsWritten() const {
+        return m_written;
+    }
+
+    /**
+     * number of minor versions written
+     */
+    uint64_t minorVersionsWritten() const {
+        return m_minorWritten;
+    }
+
+    /**
+     * number of minor versions that were not written, because their
+     * geometry was the same as the one of the version before them
+     */
+    uint64_t minorVersionsSuppressed() const {
+        return m_minorSuppressed;
+    }
+
+    bool isPrintingDebugMessages() {
+        return m_debug;
+    }
+
+    void printDebugMessages(bool shouldPrintDebugMessages) {
+        m_debug = shouldPrintDebugMessages;
+        m_geom.printDebugMessages(shouldPrintDebugMessages);
+    }
+
+    /**
+     * write the relation version cur and its minor versions to the
+     * polygon rows, if it is a multipolygon
+     *
+     * prev and next are the relation versions before and after cur in the
+     * input and may be NULL. The line rows are not used, the signature is
+     * the one of WayWriter::write, so both can be used by a WriterPool.
+     */
+    void write(const Osmium::OSM::Relation *prev, const Osmium::OSM::Relation *cur, const Osmium::OSM::Relation *next, RowBuffer& /*line_rows*/, RowBuffer& polygon_rows) {
+        bool next_is_same_entity = next && next->id() == cur->id();
+
+        // a deleted version has no tags, it's written if the version before it was a multipolygon
+        if(cur->visible() ? !isMultipolygon(cur) : !(prev && prev->id() == cur->id() && prev->visible() && isMultipolygon(prev))) {
+            return;
+        }
+
+        m_rows = &polygon_rows;
+
+        if(m_tagsField.isBinary() != polygon_rows.isBinary()) {
+            m_tagsField.binary(polygon_rows.isBinary());
+            m_mainUserField.binary(polygon_rows.isBinary());
+            m_minorUserField.binary(polygon_rows.isBinary());
+            m_hasMinorUser = false;
+        }
+        m_tagsField.clear();
+        m_tagsField.addHStore(cur->tags());
+        m_mainUserField.clear();
+        m_mainUserField.addText(cur->user());
+
+        if(m_debug) {
+            std::cout << "relation r" << cur->id() << 'v' << cur->version() << " at tstamp " << cur->timestamp() << " (" << Timestamp::format(cur->timestamp()) << ")" << std::endl;
+        }
+
+        time_t until = next_is_same_entity ? next->timestamp() : 0;
+        long z_order = ZOrderCalculator::calculateZOrder(cur->tags());
+
+        if(!cur->visible()) {
+            write_relation_to_db(cur->id(), cur->version(), 0, false, cur->uid(), m_mainUserField, cur->timestamp(), next_is_same_entity ? until : cur->timestamp(), z_order, NULL);
+            m_rows = NULL;
+            return;
+        }
+
+        m_members.clear();
+        const Osmium::OSM::RelationMemberList &members = cur->members();
+        for(Osmium::OSM::RelationMemberList::const_iterator it = members.begin(); it != members.end(); ++it) {
+            if(it->type() == 'w') {
+                m_members.push_back(it->ref());
+            }
+        }
+
+        // the minor versions are made by new versions of the member ways
+        // and by the movement of the nodes of all of their versions
+        bool hasMinorTimes = !next_is_same_entity || cur->timestamp() <= next->timestamp();
+        bool hasGeom = m_geom.begin(m_members, cur->timestamp(), until, m_area);
+        if(hasMinorTimes) {
+            m_geom.wayTimes(m_way_times);
+            m_mtimes.forNodes(m_geom.nodes(), cur->timestamp(), until, m_minor_times);
+            m_mtimes.merge(m_minor_times, m_way_times);
+        }
+
+        std::swap(m_area, m_pending);
+        bool pendingHasGeom = hasGeom;
+        osm_version_t pendingMinor = 0;
+        osm_user_id_t pendingUid = cur->uid();
+        const RowBuffer *pendingUser = &m_mainUserField;
+        time_t pendingFrom = cur->timestamp();
+
+        if(hasMinorTimes) {
+            std::vector<MinorTimesCalculator::MinorTimesInfo>::const_iterator end = m_minor_times.end();
+            for(std::vector<MinorTimesCalculator::MinorTimesInfo>::const_iterator it = m_minor_times.begin(); it != end; it++) {
+                time_t t = (*it).t;
+
+                hasGeom = m_geom.advance(t, m_area);
+
+                if(hasGeom == pendingHasGeom && (!hasGeom || m_area.equals(m_pending))) {
+                    if(hasGeom) {
+                        m_minorSuppressed++;
+                    }
+                    continue;
+                }
+
+                write_relation_to_db(cur->id(), cur->version(), pendingMinor, true, pendingUid, *pendingUser, pendingFrom, t, z_order, pendingHasGeom ? &m_pending : NULL);
+                if(pendingMinor > 0 && pendingHasGeom) {
+                    m_minorWritten++;
+                }
+
+                std::swap(m_area, m_pending);
+                pendingHasGeom = hasGeom;
+                pendingMinor++;
+                pendingUid = (*it).uid;
+                pendingUser = &minorUserField(pendingUid);
+                pendingFrom = t;
+
+                if(m_debug) {
+                    std::cout << "minor relation r" << cur->id() << 'v' << cur->version() << '.' << pendingMinor << " at tstamp " << t << " (" << Timestamp::format(t) << ")" << std::endl;
+                }
+            }
+        }
+
+        write_relation_to_db(cur->id(), cur->version(), pendingMinor, true, pendingUid, *pendingUser, pendingFrom, until, z_order, pendingHasGeom ? &m_pending : NULL);
+        if(pendingMinor > 0 && pendingHasGeom) {
+            m_minorWritten++;
+        }
+
+        m_rows = NULL;
+    }
+};
+
+#endif // IMPORTER_RELATIONWRITER_HPP
@@ -0,0 +1,628 @@
+/**
+ * The importer sends its rows to the database through COPY pipes. To
+ * keep the work per row low, the rows are not assembled in temporary
+ * strings but appended directly into a preallocated buffer, which is
+ * handed to the COPY pipe in chunks of about 64k. Once the buffer has
+ * reached its size, no more memory is allocated.
+ *
+ * The buffer knows how to encode the values for the text and for the
+ * binary COPY format. The binary format is described in the COPY docs:
+ *   http://www.postgresql.org/docs/9.1/static/sql-copy.html
+ */
+
+#ifndef IMPORTER_ROWBUFFER_HPP
+#define IMPORTER_ROWBUFFER_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "dbcopyconn.hpp"
+#include "hstore.hpp"
+#include "timestamp.hpp"
+#include "waygeometry.hpp"
+#include "areageometry.hpp"
+
+/**
+ * Assembles rows for a COPY pipe and sends them in chunks
+ */
+class RowBuffer {
+private:
+    /**
+     * seconds between the unix epoch and the postgres epoch (2000-01-01)
+     */
+    static const time_t POSTGRES_EPOCH = 946684800;
+
+    /**
+     * EWKB geometry types and the type-flag signaling that an SRID follows
+     * the type
+     */
+    static const uint32_t wkbPoint = 1, wkbLineString = 2, wkbPolygon = 3, wkbMultiPolygon = 6, wkbSRID = 0x20000000;
+
+    /**
+     * the pipe the rows are sent to
+     */
+    DbCopyConn* m_conn;
+
+    /**
+     * use the binary instead of the text format
+     */
+    bool m_binary;
+
+    char* m_data;
+    size_t m_size, m_capacity;
+
+    /**
+     * is the next field the first one of a row (text format only)
+     */
+    bool m_firstField;
+
+    /**
+     * formats the timestamps in text format
+     */
+    Timestamp::Cache m_timestamps;
+
+    /**
+     * make sure there is space for n more bytes
+     */
+    void reserve(size_t n) {
+        if(m_size + n <= m_capacity) {
+            return;
+        }
+
+        // only rows larger then the buffer get here
+        m_capacity = std::max(m_capacity * 2, m_size + n);
+        char* data = static_cast< char* >(realloc(m_data, m_capacity));
+        if(!data) {
+            throw std::bad_alloc();
+        }
+        m_data = data;
+    }
+
+    void put(char c) {
+        reserve(1);
+        m_data[m_size++] = c;
+    }
+
+    /**
+     * start a new field: the field separator in text format
+     */
+    void field() {
+        if(!m_binary) {
+            if(!m_firstField) {
+                put('\t');
+            }
+            m_firstField = false;
+        }
+    }
+
+    /**
+     * the length of a field in binary format
+     */
+    void length(int32_t len) {
+        putInt32(len);
+    }
+
+    void putInt16(int16_t v) {
+        reserve(2);
+        uint16_t n = static_cast< uint16_t >(v);
+        m_data[m_size++] = static_cast< char >(n >> 8);
+        m_data[m_size++] = static_cast< char >(n);
+    }
+
+    void putInt32(int32_t v) {
+        reserve(4);
+        uint32_t n = static_cast< uint32_t >(v);
+        m_data[m_size++] = static_cast< char >(n >> 24);
+        m_data[m_size++] = static_cast< char >(n >> 16);
+        m_data[m_size++] = static_cast< char >(n >> 8);
+        m_data[m_size++] = static_cast< char >(n);
+    }
+
+    void putInt64(int64_t v) {
+        putInt32(static_cast< int32_t >(static_cast< uint64_t >(v) >> 32));
+        putInt32(static_cast< int32_t >(v));
+    }
+
+    /**
+     * write an integer in decimal notation
+     */
+    void putDecimal(int64_t v) {
+        char buffer[24];
+        char* end = buffer + sizeof(buffer);
+        char* p = end;
+
+        uint64_t n = v < 0 ? -static_cast< uint64_t >(v) : static_cast< uint64_t >(v);
+        do {
+            *--p = static_cast< char >('0' + n % 10);
+            n /= 10;
+        } while(n);
+
+        if(v < 0) {
+            *--p = '-';
+        }
+
+        append(p, end - p);
+    }
+
+    /**
+     * the first byte of a WKB geometry, telling the server if it is
+     * written in big (0) or little (1) endian. Geometries are written in
+     * the byte order of the machine.
+     */
+    static char byteOrder() {
+        const uint32_t one = 1;
+        return *reinterpret_cast< const char* >(&one);
+    }
+
+    /**
+     * write bytes at ptr and return the position after them
+     */
+    static char* write(char* ptr, const void* data, size_t size) {
+        memcpy(ptr, data, size);
+        return ptr + size;
+    }
+
+    /**
+     * replace the len bytes at ptr by their hex representation, there must
+     * be space for len more bytes behind them
+     */
+    static void hex(char* ptr, size_t len) {
+        static const char digits[] = "0123456789ABCDEF";
+
+        // from back to front, so no byte is overwritten before it is read
+        for(size_t i = len; i-- > 0; ) {
+            unsigned char c = static_cast< unsigned char >(ptr[i]);
+            ptr[2 * i] = digits[c >> 4];
+            ptr[2 * i + 1] = digits[c & 0x0f];
+        }
+    }
+
+    /**
+     * write a floating point number with 8 significant digits, like
+     * std::setprecision(8) does
+     */
+    void putDouble(double v) {
+        reserve(32);
+        m_size += snprintf(m_data + m_size, 32, "%.8g", v);
+    }
+
+public:
+    /**
+     * size at which the buffer is sent to the COPY pipe
+     */
+    static const size_t FLUSH_SIZE = 64*1024;
+
+    /**
+     * create a new buffer, sending its rows to conn
+     *
+     * a buffer without conn is never flushed, it collects all rows until
+     * it is cleared. This is used by the workers of the WriterPool and to
+     * encode single fields, that are added to many rows with addField.
+     */
+    RowBuffer(DbCopyConn* conn, size_t capacity = 2 * FLUSH_SIZE) :
+            m_conn(conn),
+            m_binary(false),
+            m_data(static_cast< char* >(malloc(capacity))),
+            m_size(0),
+            m_capacity(capacity),
+            m_firstField(true),
+            m_timestamps() {
+        if(!m_data) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~RowBuffer() {
+        free(m_data);
+    }
+
+    bool isBinary() {
+        return m_binary;
+    }
+
+    /**
+     * set the format of the rows, needs to match the format of the COPY pipe
+     */
+    void binary(bool shouldBeBinary) {
+        m_binary = shouldBeBinary;
+    }
+
+    /**
+     * number of bytes in the buffer
+     */
+    size_t size() const {
+        return m_size;
+    }
+
+    /**
+     * the bytes in the buffer
+     */
+    const char* data() const {
+        return m_data;
+    }
+
+    /**
+     * drop all bytes in the buffer without sending them
+     */
+    void clear() {
+        m_size = 0;
+        m_firstField = true;
+    }
+
+    /**
+     * append raw bytes
+     */
+    void append(const char* data, size_t size) {
+        reserve(size);
+        memcpy(m_data + m_size, data, size);
+        m_size += size;
+    }
+
+    /**
+     * start a new row with the given number of fields
+     */
+    void beginRow(int16_t fields) {
+        if(m_binary) {
+            putInt16(fields);
+        }
+        m_firstField = true;
+    }
+
+    /**
+     * end the row and send the buffer to the COPY pipe, if it is full
+     */
+    void endRow() {
+        if(!m_binary) {
+            put('\n');
+        }
+
+        if(m_conn && m_size >= FLUSH_SIZE) {
+            flush();
+        }
+    }
+
+    /**
+     * append complete rows, encoded in the same format by another buffer
+     */
+    void appendRows(const char* data, size_t size) {
+        append(data, size);
+
+        if(m_conn && m_size >= FLUSH_SIZE) {
+            flush();
+        }
+    }
+
+    /**
+     * send all buffered rows to the COPY pipe
+     */
+    void flush() {
+        if(m_size > 0) {
+            m_conn->copy(m_data, m_size);
+            m_size = 0;
+        }
+    }
+
+    /**
+     * add a field, that has been encoded as the only content of another
+     * buffer in the same format
+     */
+    void addField(const RowBuffer& encoded) {
+        field();
+        append(encoded.data(), encoded.size());
+    }
+
+    void addNull() {
+        field();
+        if(m_binary) {
+            length(-1);
+        } else {
+            append("\\N", 2);
+        }
+    }
+
+    void addBool(bool v) {
+        field();
+        if(m_binary) {
+            length(1);
+            put(v ? 1 : 0);
+        } else {
+            put(v ? 't' : 'f');
+        }
+    }
+
+    /**
+     * add a smallint
+     */
+    void addInt16(int16_t v) {
+        field();
+        if(m_binary) {
+            length(sizeof(v));
+            putInt16(v);
+        } else {
+            putDecimal(v);
+        }
+    }
+
+    /**
+     * add an integer
+     */
+    void addInt32(int32_t v) {
+        field();
+        if(m_binary) {
+            length(sizeof(v));
+            putInt32(v);
+        } else {
+            putDecimal(v);
+        }
+    }
+
+    /**
+     * add a bigint
+     */
+    void addInt64(int64_t v) {
+        field();
+        if(m_binary) {
+            length(sizeof(v));
+            putInt64(v);
+        } else {
+            putDecimal(v);
+        }
+    }
+
+    /**
+     * add a real
+     */
+    void addReal(double v) {
+        field();
+        if(m_binary) {
+            float f = static_cast< float >(v);
+            int32_t n;
+            memcpy(&n, &f, sizeof(n));
+            length(sizeof(n));
+            putInt32(n);
+        } else {
+            putDouble(v);
+        }
+    }
+
+    /**
+     * add a text, escaped for the text format
+     */
+    void addText(const char* v) {
+        field();
+        if(m_binary) {
+            size_t len = strlen(v);
+            length(len);
+            append(v, len);
+        } else {
+            DbCopyConn::escape(v, *this);
+        }
+    }
+
+    /**
+     * add a timestamp without time zone
+     *
+     * in binary format it is sent as microseconds since the postgres
+     * epoch (assuming a server with integer datetimes)
+     */
+    void addTimestamp(time_t v) {
+        field();
+        if(m_binary) {
+            length(sizeof(int64_t));
+            putInt64(static_cast< int64_t >(v - POSTGRES_EPOCH) * 1000000);
+        } else {
+            reserve(Timestamp::buffer_length);
+            m_size += m_timestamps.format(m_data + m_size, v);
+        }
+    }
+
+    /**
+     * add a timestamp, a time of 0 is written as NULL, see Timestamp::formatDb
+     */
+    void addTimestampOrNull(time_t v) {
+        if(v == 0) {
+            addNull();
+        } else {
+            addTimestamp(v);
+        }
+    }
+
+    /**
+     * add a taglist as hstore
+     *
+     * in binary format it is sent in the binary send format of hstore:
+     * the number of pairs, followed by the length and content of each
+     * key and value
+     */
+    void addHStore(const Osmium::OSM::TagList& tags) {
+        field();
+        if(!m_binary) {
+            HStore::format(tags, *this);
+            return;
+        }
+
+        size_t start = m_size;
+        length(0);
+        putInt32(tags.size());
+
+        for(Osmium::OSM::TagList::const_iterator it = tags.begin(); it != tags.end(); ++it) {
+            size_t klen = strlen(it->key()), vlen = strlen(it->value());
+            putInt32(klen);
+            append(it->key(), klen);
+            putInt32(vlen);
+            append(it->value(), vlen);
+        }
+
+        // fill in the length of the field
+        size_t end = m_size;
+        m_size = start;
+        length(end - start - sizeof(int32_t));
+        m_size = end;
+    }
+
+    /**
+     * add the node ids of a way as bigint array
+     *
+     * in binary format it is sent in the binary send format of arrays:
+     * the number of dimensions, a flag for NULLs, the type of the elements
+     * (the oid of bigint) and the size and lower bound of the dimension,
+     * followed by the length and content of each element
+     */
+    void addNodeList(const Osmium::OSM::WayNodeList& nodes) {
+        field();
+        if(!m_binary) {
+            put('{');
+            for(Osmium::OSM::WayNodeList::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+                if(it != nodes.begin()) {
+                    put(',');
+                }
+                putDecimal(it->ref());
+            }
+            put('}');
+            return;
+        }
+
+        int32_t count = nodes.size();
+        length(count > 0 ? 5 * sizeof(int32_t) + count * (sizeof(int32_t) + sizeof(int64_t)) : 3 * sizeof(int32_t));
+        putInt32(count > 0 ? 1 : 0);
+        putInt32(0);
+        putInt32(20);
+        if(count == 0) {
+            return;
+        }
+
+        putInt32(count);
+        putInt32(1);
+        for(Osmium::OSM::WayNodeList::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+            putInt32(sizeof(int64_t));
+            putInt64(it->ref());
+        }
+    }
+
+    /**
+     * add a point with SRID, as EWKB in binary format
+     */
+    void addPoint(double x, double y, int32_t srid) {
+        field();
+        if(!m_binary) {
+            append("SRID=", 5);
+            putDecimal(srid);
+            append(";POINT(", 7);
+            putDouble(x);
+            put(' ');
+            putDouble(y);
+            put(')');
+            return;
+        }
+
+        uint32_t type = wkbSRID | wkbPoint;
+
+        length(1 + sizeof(type) + sizeof(srid) + sizeof(x) + sizeof(y));
+        put(byteOrder());
+        append(reinterpret_cast< const char* >(&type), sizeof(type));
+        append(reinterpret_cast< const char* >(&srid), sizeof(srid));
+        append(reinterpret_cast< const char* >(&x), sizeof(x));
+        append(reinterpret_cast< const char* >(&y), sizeof(y));
+    }
+
+    /**
+     * add the geometry of a way as hex-EWKB in text format or as EWKB in
+     * binary format, like the geos WKBWriter would write it
+     */
+    void addWayGeometry(const WayGeometry& geom, int32_t srid) {
+        field();
+
+        uint32_t type = wkbSRID | (geom.isPolygon ? wkbPolygon : wkbLineString);
+        uint32_t rings = 1;
+        uint32_t points = geom.size();
+
+        size_t len = 1 + sizeof(type) + sizeof(srid) + (geom.isPolygon ? sizeof(rings) : 0) + sizeof(points) + points * 2 * sizeof(double);
+        if(m_binary) {
+            length(len);
+        }
+
+        // in text format the bytes are expanded to hex in place
+        reserve(m_binary ? len : 2 * len);
+
+        char* start = m_data + m_size;
+        char* ptr = start;
+        *ptr++ = byteOrder();
+        ptr = write(ptr, &type, sizeof(type));
+        ptr = write(ptr, &srid, sizeof(srid));
+        if(geom.isPolygon) {
+            ptr = write(ptr, &rings, sizeof(rings));
+        }
+        ptr = write(ptr, &points, sizeof(points));
+
+        for(size_t i = 0; i < points; i++) {
+            ptr = write(ptr, &geom.x[i], sizeof(double));
+            ptr = write(ptr, &geom.y[i], sizeof(double));
+        }
+
+        if(m_binary) {
+            m_size += len;
+        } else {
+            hex(start, len);
+            m_size += 2 * len;
+        }
+    }
+
+    /**
+     * add the rings of a multipolygon relation as EWKB multipolygon
+     *
+     * the polygons inside the multipolygon carry no srid of their own
+     */
+    void addAreaGeometry(const AreaGeometry& geom, int32_t srid) {
+        field();
+
+        uint32_t type = wkbSRID | wkbMultiPolygon;
+        uint32_t polygonType = wkbPolygon;
+        uint32_t polygons = geom.polygons();
+
+        size_t len = 1 + sizeof(type) + sizeof(srid) + sizeof(polygons);
+        len += polygons * (1 + sizeof(polygonType) + sizeof(uint32_t));
+        len += geom.ringEnds.size() * sizeof(uint32_t) + geom.size() * 2 * sizeof(double);
+        if(m_binary) {
+            length(len);
+        }
+
+        // in text format the bytes are expanded to hex in place
+        reserve(m_binary ? len : 2 * len);
+
+        char* start = m_data + m_size;
+        char* ptr = start;
+        *ptr++ = byteOrder();
+        ptr = write(ptr, &type, sizeof(type));
+        ptr = write(ptr, &srid, sizeof(srid));
+        ptr = write(ptr, &polygons, sizeof(polygons));
+
+        for(size_t p = 0; p < polygons; p++) {
+            uint32_t rings = geom.polygonEnds[p] - geom.polygonBegin(p);
+
+            *ptr++ = byteOrder();
+            ptr = write(ptr, &polygonType, sizeof(polygonType));
+            ptr = write(ptr, &rings, sizeof(rings));
+
+            for(size_t r = geom.polygonBegin(p); r < geom.polygonEnds[p]; r++) {
+                uint32_t points = geom.ringEnds[r] - geom.ringBegin(r);
+                ptr = write(ptr, &points, sizeof(points));
+
+                for(size_t i = geom.ringBegin(r); i < geom.ringEnds[r]; i++) {
+                    ptr = write(ptr, &geom.x[i], sizeof(double));
+                    ptr = write(ptr, &geom.y[i], sizeof(double));
+                }
+            }
+        }
+
+        if(m_binary) {
+            m_size += len;
+        } else {
+            hex(start, len);
+            m_size += 2 * len;
+        }
+    }
+};
+
+#endif // IMPORTER_ROWBUFFER_HPP
@@ -0,0 +1,77 @@
+-- requires hstore_new, postgis, postgresql 12
+--
+-- a variant of 00-before.sql, used by the importer with --partitioned: the
+-- history tables are partitioned by the year of valid_from and have a
+-- generated column valid, the range from valid_from to valid_to. COPY
+-- without a column list skips generated columns, so the importer writes the
+-- same rows into both variants and the server routes them to the partitions.
+
+DROP TABLE IF EXISTS hist_point CASCADE;
+CREATE TABLE hist_point (
+    id bigint,
+    version smallint,
+    visible boolean,
+    user_id integer,
+    user_name text,
+    valid_from timestamp without time zone,
+    valid_to timestamp without time zone,
+    tags hstore,
+    geom geometry(POINT, 900913),
+
+    -- valid_to is never before valid_from, even if the timestamps in the input are
+    valid tsrange GENERATED ALWAYS AS (tsrange(valid_from, CASE WHEN valid_to < valid_from THEN valid_from ELSE valid_to END, '[]')) STORED
+) PARTITION BY RANGE (valid_from);
+
+
+DROP TABLE IF EXISTS hist_line CASCADE;
+CREATE TABLE hist_line (
+    id bigint,
+    version smallint,
+    minor smallint,
+    visible boolean,
+    user_id integer,
+    user_name text,
+    valid_from timestamp without time zone,
+    valid_to timestamp without time zone,
+    tags hstore,
+    z_order integer,
+    geom geometry(LINESTRING, 900913),
+    valid tsrange GENERATED ALWAYS AS (tsrange(valid_from, CASE WHEN valid_to < valid_from THEN valid_from ELSE valid_to END, '[]')) STORED
+) PARTITION BY RANGE (valid_from);
+
+
+DROP TABLE IF EXISTS hist_polygon CASCADE;
+CREATE TABLE hist_polygon (
+    id bigint,
+    version smallint,
+    minor smallint,
+    visible boolean,
+    user_id integer,
+    user_name text,
+    valid_from timestamp without time zone,
+    valid_to timestamp without time zone,
+    tags hstore,
+    z_order integer,
+    area real,
+
+    -- POLYGON for ways, MULTIPOLYGON for multipolygon relations
+    geom geometry(GEOMETRY, 900913),
+    center geometry(POINT, 900913),
+    valid tsrange GENERATED ALWAYS AS (tsrange(valid_from, CASE WHEN valid_to < valid_from THEN valid_from ELSE valid_to END, '[]')) STORED
+) PARTITION BY RANGE (valid_from);
+
+
+-- one partition per year, versions from before 2004 or after 2030 go to the default partition
+DO $$
+DECLARE
+    tbl text;
+BEGIN
+    FOREACH tbl IN ARRAY ARRAY['hist_point', 'hist_line', 'hist_polygon'] LOOP
+        FOR year IN 2004..2030 LOOP
+            EXECUTE format('CREATE TABLE %I PARTITION OF %I FOR VALUES FROM (%L) TO (%L)',
+                tbl || '_' || year, tbl, year || '-01-01', (year + 1) || '-01-01');
+        END LOOP;
+        EXECUTE format('CREATE TABLE %I PARTITION OF %I DEFAULT', tbl || '_default', tbl);
+    END LOOP;
+END
+$$;
@@ -0,0 +1,14 @@
+-- the node lists of all way versions, needed to update the database. The
+-- importer only creates this table with --keep-way-nodes, for both schemes
+DROP TABLE IF EXISTS hist_way CASCADE;
+CREATE TABLE hist_way (
+    id bigint,
+    version smallint,
+    visible boolean,
+    user_id integer,
+    user_name text,
+    valid_from timestamp without time zone,
+    valid_to timestamp without time zone,
+    tags hstore,
+    nodes bigint[]
+);
@@ -84,9 +84,8 @@ SELECT AddGeometryColumn(
     -- SRID (900913 = Spherical Mercator)
     900913,
 
-    -- type -- needs to be changed to generic GEOMETRY later (maybe)
-    --'MULTIPOLYGON',
-    'POLYGON',
+    -- type -- POLYGON for ways, MULTIPOLYGON for multipolygon relations
+    'GEOMETRY',
 
     -- dimensions
     2
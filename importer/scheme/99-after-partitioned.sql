@@ -0,0 +1,22 @@
+-- a variant of 99-after.sql for the tables of 00-before-partitioned.sql
+--
+-- the partitions get no primary keys, which would have to contain
+-- valid_from. The order of the rows by id can't be relied on: with
+-- --copy-streams the rows of a table are spread over several pipes,
+-- and --update appends the new versions of old entities at the end. So
+-- a btree on (id, version) finds the rows of an entity, like the primary
+-- keys of 99-after.sql, and serves the statements of --update. The GIST
+-- index on the validity range and the geometry serves the queries of the
+-- renderer; the partitions themselves limit the years scanned.
+--
+-- the importer runs the blocks separated by empty lines in parallel, each
+-- on its own connection
+
+CREATE INDEX hist_point_id_index ON hist_point (id, version);
+CREATE INDEX hist_point_valid_and_geom_index ON hist_point USING GIST (valid, geom);
+
+CREATE INDEX hist_line_id_index ON hist_line (id, version);
+CREATE INDEX hist_line_valid_and_geom_index ON hist_line USING GIST (valid, geom);
+
+CREATE INDEX hist_polygon_id_index ON hist_polygon (id, version);
+CREATE INDEX hist_polygon_valid_and_geom_index ON hist_polygon USING GIST (valid, geom);
@@ -0,0 +1,5 @@
+-- the indexes of the way table of 00-before-way.sql, built at the same time
+-- as the indexes of the other tables
+
+ALTER TABLE hist_way ADD PRIMARY KEY (id, version);
+CREATE INDEX hist_way_current_nodes_index ON hist_way USING GIN (nodes) WHERE valid_to IS NULL;
@@ -1,3 +1,5 @@
+-- the importer runs the blocks separated by empty lines in parallel, each on its own connection
+
 ALTER TABLE hist_point ADD PRIMARY KEY (id, version);
 CREATE INDEX hist_point_geom_and_time_index ON hist_point USING GIST (geom, valid_from, valid_to);
 
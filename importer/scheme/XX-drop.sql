@@ -1,3 +1,4 @@
 SELECT DropGeometryTable('hist_point');
 SELECT DropGeometryTable('hist_line');
 SELECT DropGeometryTable('hist_polygon');
+DROP TABLE IF EXISTS hist_way;
@@ -13,6 +13,8 @@
  */
 class Timestamp {
 private:
+    static const time_t SECONDS_PER_DAY = 24 * 60 * 60;
+
     /**
      * length of ISO timestamp string yyyy-mm-ddThh:mm:ssZ\0
      */
@@ -27,23 +29,157 @@ private:
         return f;
     }
 
+    /**
+     * write n as two digits
+     */
+    static void put2(char *buffer, int n) {
+        buffer[0] = '0' + n / 10;
+        buffer[1] = '0' + n % 10;
+    }
+
+    /**
+     * split time into the number of days since the epoch and the seconds
+     * of that day
+     */
+    static void split(time_t time, time_t &days, time_t &seconds) {
+        days = time / SECONDS_PER_DAY;
+        seconds = time % SECONDS_PER_DAY;
+        if(seconds < 0) {
+            seconds += SECONDS_PER_DAY;
+            days--;
+        }
+    }
+
+    /**
+     * write the date yyyy-mm-dd of the day with the given number of days
+     * since the epoch, returns false for years that don't have 4 digits
+     *
+     * this is the civil_from_days algorithm by Howard Hinnant:
+     *   http://howardhinnant.github.io/date_algorithms.html#civil_from_days
+     */
+    static bool formatDate(char *buffer, time_t days) {
+        days += 719468;
+        time_t era = (days >= 0 ? days : days - 146096) / 146097;
+        time_t doe = days - era * 146097;                                   // [0, 146096]
+        time_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365; // [0, 399]
+        time_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);               // [0, 365]
+        time_t mp = (5 * doy + 2) / 153;                                    // [0, 11]
+        int day = doy - (153 * mp + 2) / 5 + 1;                             // [1, 31]
+        int month = mp < 10 ? mp + 3 : mp - 9;                              // [1, 12]
+        time_t year = yoe + era * 400 + (month <= 2);
+
+        if(year < 1000 || year > 9999) {
+            return false;
+        }
+
+        put2(buffer, year / 100);
+        put2(buffer + 2, year % 100);
+        buffer[4] = '-';
+        put2(buffer + 5, month);
+        buffer[7] = '-';
+        put2(buffer + 8, day);
+        return true;
+    }
+
+    /**
+     * write the time Thh:mm:ssZ of the given seconds of a day
+     */
+    static void formatTime(char *buffer, time_t seconds) {
+        buffer[0] = 'T';
+        put2(buffer + 1, seconds / 3600);
+        buffer[3] = ':';
+        put2(buffer + 4, seconds / 60 % 60);
+        buffer[6] = ':';
+        put2(buffer + 7, seconds % 60);
+        buffer[9] = 'Z';
+    }
+
+    /**
+     * format with strftime, for years that don't have 4 digits
+     */
+    static size_t formatSlow(char *buffer, const time_t time) {
+        struct tm tm;
+        gmtime_r(&time, &tm);
+        return strftime(buffer, timestamp_length, timestamp_format(), &tm);
+    }
+
 public:
+    /**
+     * length of the buffer needed by format(char*, const time_t)
+     */
+    static const int buffer_length = timestamp_length;
+
     /**
      * Format the Timestamp according to
      * ISO timestamp string yyyy-mm-ddThh:mm:ssZ\0
+     * into a buffer of at least buffer_length bytes and return the
+     * number of chars written (without the \0)
+     *
+     * the fields are calculated directly, without gmtime and strftime,
+     * so this is reentrant and does not depend on the locale.
      */
-    static std::string format(const time_t time) {
-        struct tm *tm = gmtime(&time);
-        std::string s(timestamp_length, '\0');
-        /*
-         *  This const_cast is ok, because we know we have enough space
-         * in the string for the format we are using (well at least until
-         * the year will have 5 digits). And by setting the size
-         * afterwards from the result of strftime we make sure thats set
-         * right, too.
+    static size_t format(char *buffer, const time_t time) {
+        time_t days, seconds;
+        split(time, days, seconds);
+        if(!formatDate(buffer, days)) {
+            return formatSlow(buffer, time);
+        }
+        formatTime(buffer + 10, seconds);
+        buffer[20] = 0;
+        return 20;
+    }
+
+    /**
+     * Formats timestamps like format(char*, const time_t), but remembers
+     * the last date it formatted. The ways and nodes of a changeset share
+     * their timestamps or at least their day, so most of the time only a
+     * copy or the time of the day is needed.
+     *
+     * A Cache must not be shared between threads, every RowBuffer has one.
+     */
+    class Cache {
+    private:
+        time_t m_time, m_day;
+        bool m_valid;
+        char m_buffer[timestamp_length];
+
+    public:
+        Cache() : m_time(0), m_day(0), m_valid(false) {}
+
+        /**
+         * like Timestamp::format(char*, const time_t)
          */
-        s.resize(strftime(const_cast<char *>(s.c_str()), timestamp_length, timestamp_format(), tm));
-        return s;
+        size_t format(char *buffer, const time_t time) {
+            if(!m_valid || time != m_time) {
+                time_t days, seconds;
+                split(time, days, seconds);
+
+                if(!m_valid || days != m_day) {
+                    if(!formatDate(m_buffer, days)) {
+                        m_valid = false;
+                        return formatSlow(buffer, time);
+                    }
+                    m_day = days;
+                }
+
+                formatTime(m_buffer + 10, seconds);
+                m_buffer[20] = 0;
+                m_time = time;
+                m_valid = true;
+            }
+
+            memcpy(buffer, m_buffer, timestamp_length);
+            return 20;
+        }
+    };
+
+    /**
+     * Format the Timestamp according to
+     * ISO timestamp string yyyy-mm-ddThh:mm:ssZ\0
+     */
+    static std::string format(const time_t time) {
+        char buffer[timestamp_length];
+        return std::string(buffer, format(buffer, time));
     }
 
     /**
@@ -0,0 +1,107 @@
+/**
+ * The geometry of a way is a linestring or a polygon with a single ring.
+ * Both are fully described by the list of their coordinates, which can
+ * be written to the database as EWKB without building a geos geometry,
+ * see RowBuffer::addWayGeometry. The area of a polygon is calculated
+ * directly from the coordinates, too.
+ *
+ * A geos geometry is only built, when geos is needed to calculate
+ * something, like the interior point of an area.
+ */
+
+#ifndef IMPORTER_WAYGEOMETRY_HPP
+#define IMPORTER_WAYGEOMETRY_HPP
+
+#include <math.h>
+#include <vector>
+
+/**
+ * The coordinates of a way, either as linestring or as polygon
+ */
+class WayGeometry {
+public:
+    /**
+     * the coordinates, for a polygon the first and the last one are equal
+     */
+    std::vector<double> x, y;
+
+    /**
+     * is the way a polygon or a linestring?
+     */
+    bool isPolygon;
+
+    WayGeometry() : x(), y(), isPolygon(false) {}
+
+    size_t size() const {
+        return x.size();
+    }
+
+    /**
+     * remove all coordinates, keeping the allocated memory
+     */
+    void clear() {
+        x.clear();
+        y.clear();
+        isPolygon = false;
+    }
+
+    /**
+     * are both geometries of the same type and have exactly the same
+     * coordinates?
+     */
+    bool equals(const WayGeometry &other) const {
+        return isPolygon == other.isPolygon && x == other.x && y == other.y;
+    }
+
+    /**
+     * the area of the polygon, calculated with the shoelace formula
+     *
+     * the coordinates are taken relative to the first one, like geos does,
+     * to keep the products small and the result exact.
+     */
+    double area() const {
+        size_t n = size();
+        if(!isPolygon || n < 4) {
+            return 0;
+        }
+
+        double sum = 0;
+        double x0 = x[0];
+        for(size_t i = 1; i < n - 1; i++) {
+            sum += (x[i] - x0) * (y[i - 1] - y[i + 1]);
+        }
+        return fabs(sum / 2);
+    }
+
+    /**
+     * build a geos geometry with the given srid, the caller owns it
+     */
+    geos::geom::Geometry* toGeos(int srid) const {
+        geos::geom::GeometryFactory *f = Osmium::Geometry::geos_geometry_factory();
+
+        std::vector<geos::geom::Coordinate> *c = new std::vector<geos::geom::Coordinate>();
+        c->reserve(size());
+        for(size_t i = 0; i < size(); i++) {
+            c->push_back(geos::geom::Coordinate(x[i], y[i], DoubleNotANumber));
+        }
+
+        geos::geom::Geometry* geom;
+        if(isPolygon) {
+            geom = f->createPolygon(
+                f->createLinearRing(
+                    f->getCoordinateSequenceFactory()->create(c)
+                ),
+                NULL
+            );
+        } else {
+            geom = f->createLineString(
+                f->getCoordinateSequenceFactory()->create(c)
+            );
+        }
+
+        geom->setSRID(srid);
+        return geom;
+    }
+};
+
+#endif // IMPORTER_WAYGEOMETRY_HPP
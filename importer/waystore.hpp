@@ -0,0 +1,341 @@
+/**
+ * To assemble the geometry of a multipolygon relation at a given time,
+ * the importer needs to know which nodes its member ways had at that
+ * time. The Waystore keeps the history of all ways for this, like the
+ * nodestore keeps the history of the nodes.
+ *
+ * Way versions are much larger then node versions, so they are stored
+ * compressed: the versions of a way are written one after another into
+ * large memory blocks, each as varints of its timestamp, its user id,
+ * its number of nodes and the zig-zag encoded differences between the
+ * ids of consecutive nodes. Most of the node ids of a way are close to
+ * each other, so they usually take two or three bytes instead of eight.
+ * The versions of a way are terminated by a 0 byte.
+ *
+ *   +-------------------------------+-----------------+--------------
+ *   | w1v1 w1v2 w1v3 0 | w2v1 0 | w3v1 w3v2 ...
+ *   +-------------------------------+-----------------+--------------
+ *
+ * The input is sorted by id and version, so the versions of a way are
+ * recorded one after another. When they don't fit into the current
+ * block anymore, they are copied into a new block, like the sparse
+ * nodestore does. The index from way ids to the positions of their
+ * versions is a vector sorted by id, which is searched binary.
+ *
+ * All way versions stay in memory until the relations have been written,
+ * a way version takes around 10 bytes plus 2 to 3 bytes per node, and 16
+ * bytes more for the first version of a way. The memory can be limited,
+ * the import is aborted with an error when the waystore needs more, which
+ * is better than being killed when the machine runs out of memory.
+ */
+
+#ifndef IMPORTER_WAYSTORE_HPP
+#define IMPORTER_WAYSTORE_HPP
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "nodestore/varint.hpp"
+
+/**
+ * Stores the node lists of all way versions
+ */
+class Waystore {
+private:
+    /**
+     * Size of one allocated memory block
+     */
+    static const size_t BLOCK_SIZE = 64*1024*1024;
+
+    /**
+     * an offset consists of the number of the memory block in the upper
+     * 32 bits and the position inside the block in the lower 32 bits
+     */
+    typedef uint64_t offset_t;
+
+    typedef std::pair< osm_object_id_t, offset_t > indexentry_t;
+
+    struct IndexEntryLess {
+        bool operator()(const indexentry_t& a, osm_object_id_t id) const {
+            return a.first < id;
+        }
+    };
+
+    /**
+     * list of all allocated memory blocks
+     */
+    std::vector< char* > m_blocks;
+
+    /**
+     * number of bytes already used in the last memory block
+     */
+    size_t m_position;
+
+    /**
+     * position of the first version of the last recorded way in the
+     * last memory block
+     */
+    size_t m_chainStart;
+
+    /**
+     * the positions of the first versions of the ways, sorted by way id
+     */
+    std::vector< indexentry_t > m_index;
+
+    /**
+     * number of recorded way versions
+     */
+    uint64_t m_count;
+
+    /**
+     * maximal number of bytes used by the waystore, 0 for no limit
+     */
+    uint64_t m_limit;
+
+    char* allocateBlock() {
+        if(m_limit && memoryUsage() + BLOCK_SIZE > m_limit) {
+            std::ostringstream message;
+            message << "the waystore needs more then " << (m_limit / 1024 / 1024) << " MB for the " << m_count << " way versions recorded so far";
+            throw std::runtime_error(message.str());
+        }
+
+        char* block = static_cast< char* >(malloc(BLOCK_SIZE));
+        if(!block) {
+            throw std::bad_alloc();
+        }
+        m_blocks.push_back(block);
+        m_position = 0;
+        return block;
+    }
+
+public:
+    /**
+     * walks over the versions of one way in the order they were recorded
+     */
+    class VersionCursor {
+    private:
+        friend class Waystore;
+
+        const char* m_ptr;
+
+        /**
+         * the encoded node ids of the current version, as long as they
+         * have not been skipped or read
+         */
+        const char* m_nodesPtr;
+
+    public:
+        /**
+         * the time, the user and the number of nodes of the current
+         * version, a deleted version has no nodes
+         */
+        time_t t;
+        osm_user_id_t uid;
+        size_t count;
+
+        VersionCursor() : m_ptr(NULL), m_nodesPtr(NULL), t(0), uid(0), count(0) {}
+
+        /**
+         * move to the next version, returns false after the last one
+         */
+        bool next() {
+            if(!m_ptr) {
+                return false;
+            }
+
+            // skip the nodes of the current version, if they were not read
+            if(m_nodesPtr) {
+                for(size_t i = 0; i < count; i++) {
+                    Varint::read(m_ptr);
+                }
+                m_nodesPtr = NULL;
+            }
+
+            if(*m_ptr == 0) {
+                m_ptr = NULL;
+                return false;
+            }
+
+            t = Varint::read(m_ptr);
+            uid = Varint::unzigzag(Varint::read(m_ptr));
+            count = Varint::read(m_ptr);
+            m_nodesPtr = m_ptr;
+            return true;
+        }
+
+        /**
+         * decode the node ids of the current version into nodes, can only
+         * be called once per version
+         */
+        void nodes(std::vector< osm_object_id_t >& nodes) {
+            nodes.clear();
+            if(!m_nodesPtr) {
+                return;
+            }
+
+            nodes.reserve(count);
+            osm_object_id_t id = 0;
+            for(size_t i = 0; i < count; i++) {
+                id += Varint::unzigzag(Varint::read(m_ptr));
+                nodes.push_back(id);
+            }
+            m_nodesPtr = NULL;
+        }
+    };
+
+    /**
+     * the first memory block is allocated with the first way version, so
+     * an unused waystore takes no memory
+     */
+    Waystore() : m_blocks(), m_position(0), m_chainStart(0), m_index(), m_count(0), m_limit(0) {}
+
+    ~Waystore() {
+        for(size_t i = 0; i < m_blocks.size(); i++) {
+            free(m_blocks[i]);
+        }
+    }
+
+    /**
+     * record a way version, deleted versions are recorded without nodes
+     *
+     * the versions need to be recorded in ascending order of id and version
+     */
+    void record(const Osmium::OSM::Way& way) {
+        osm_object_id_t id = way.id();
+        const Osmium::OSM::WayNodeList& nodes = way.nodes();
+        size_t count = way.visible() ? nodes.size() : 0;
+
+        bool sameWay = !m_index.empty() && m_index.back().first == id;
+        if(!sameWay && !m_index.empty() && m_index.back().first > id) {
+            throw std::runtime_error("ways need to be sorted by id to be stored in the waystore");
+        }
+
+        // the version, the 0 byte terminating the chain and, for a new way,
+        // the 0 byte terminating the chain before it
+        size_t needed = 3 * Varint::MAX_SIZE + count * Varint::MAX_SIZE + 2;
+
+        if(m_blocks.empty()) {
+            allocateBlock();
+        } else if(m_position + needed > BLOCK_SIZE) {
+            char* oldBlock = m_blocks.back();
+            size_t chainLength = m_position - m_chainStart;
+
+            allocateBlock();
+
+            if(sameWay) {
+                // same way as before, need to copy its versions into the new block
+                if(chainLength + needed > BLOCK_SIZE) {
+                    throw std::runtime_error("way does not fit into the BLOCK_SIZE of the waystore");
+                }
+
+                memcpy(m_blocks.back(), oldBlock + m_chainStart, chainLength);
+                m_chainStart = 0;
+                m_position = chainLength;
+                m_index.back().second = static_cast< offset_t >(m_blocks.size() - 1) << 32;
+            }
+        }
+
+        char* block = m_blocks.back();
+        if(!sameWay) {
+            // new way, skip the 0 byte of the last chain
+            if(m_position > 0) {
+                m_position++;
+            }
+
+            m_chainStart = m_position;
+            m_index.push_back(indexentry_t(id, (static_cast< offset_t >(m_blocks.size() - 1) << 32) | m_chainStart));
+        }
+
+        char* ptr = block + m_position;
+        ptr = Varint::write(ptr, way.timestamp());
+        ptr = Varint::write(ptr, Varint::zigzag(way.uid()));
+        ptr = Varint::write(ptr, count);
+
+        osm_object_id_t last = 0;
+        for(size_t i = 0; i < count; i++) {
+            osm_object_id_t ref = nodes[i].ref();
+            ptr = Varint::write(ptr, Varint::zigzag(ref - last));
+            last = ref;
+        }
+
+        // mark end of the chain
+        *ptr = 0;
+        m_position = ptr - block;
+        m_count++;
+    }
+
+    /**
+     * point cursor to the versions of a way, returns false if the way is
+     * unknown
+     */
+    bool versions(osm_object_id_t id, VersionCursor& cursor) const {
+        std::vector< indexentry_t >::const_iterator it = std::lower_bound(m_index.begin(), m_index.end(), id, IndexEntryLess());
+        if(it == m_index.end() || it->first != id) {
+            cursor.m_ptr = NULL;
+            cursor.m_nodesPtr = NULL;
+            return false;
+        }
+
+        cursor.m_ptr = m_blocks[it->second >> 32] + (it->second & 0xffffffff);
+        cursor.m_nodesPtr = NULL;
+        return true;
+    }
+
+    /**
+     * the nodes of the version of a way that was valid at time t, returns
+     * false if the way is unknown, was deleted at t or was not yet created
+     */
+    bool lookup(osm_object_id_t id, time_t t, std::vector< osm_object_id_t >& nodes) const {
+        nodes.clear();
+
+        VersionCursor cursor;
+        if(!versions(id, cursor)) {
+            return false;
+        }
+
+        // the versions are ordered by version, which should be the order of time,
+        // but in case it's not, the youngest version not younger then t wins
+        bool found = false;
+        time_t foundTime = 0;
+        while(cursor.next()) {
+            if(cursor.t <= t && (!found || cursor.t >= foundTime)) {
+                found = true;
+                foundTime = cursor.t;
+                cursor.nodes(nodes);
+            }
+        }
+
+        return found && !nodes.empty();
+    }
+
+    /**
+     * number of recorded way versions
+     */
+    uint64_t size() const {
+        return m_count;
+    }
+
+    uint64_t limit() const {
+        return m_limit;
+    }
+
+    /**
+     * set the maximal number of bytes used by the waystore, 0 for no limit
+     */
+    void limit(uint64_t bytes) {
+        m_limit = bytes;
+    }
+
+    /**
+     * number of bytes used by the waystore
+     */
+    uint64_t memoryUsage() const {
+        return m_blocks.size() * BLOCK_SIZE + m_index.capacity() * sizeof(indexentry_t);
+    }
+};
+
+#endif // IMPORTER_WAYSTORE_HPP
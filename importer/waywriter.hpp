@@ -0,0 +1,464 @@
+/**
+ * Each way version is written to the database as one row for the main
+ * version and one row for each minor version, that is created by the
+ * movement of its nodes until the next version of the way. The rows are
+ * encoded into the row buffers of the line or the polygon table.
+ *
+ * The WayWriter only reads from the nodestore and the username map, so
+ * multiple instances of it can work on different way versions at the
+ * same time, see writerpool.hpp.
+ */
+
+#ifndef IMPORTER_WAYWRITER_HPP
+#define IMPORTER_WAYWRITER_HPP
+
+#include <geos/algorithm/InteriorPointArea.h>
+#include <boost/unordered_map.hpp>
+
+#include "rowbuffer.hpp"
+#include "polygonidentifyer.hpp"
+#include "zordercalculator.hpp"
+#include "timestamp.hpp"
+#include "geombuilder.hpp"
+#include "minortimescalculator.hpp"
+
+/**
+ * Builds the geometries of a way version and its minor versions and
+ * encodes them as rows
+ */
+class WayWriter {
+public:
+    typedef boost::unordered_map<osm_user_id_t, std::string> username_map_t;
+
+private:
+    Nodestore *m_store;
+    DbAdapter *m_adapter;
+    const username_map_t *m_username_map;
+
+    ImportGeomBuilder m_geom;
+    ImportMinorTimesCalculator m_mtimes;
+
+    /**
+     * the minor times of the way version that is currently written
+     */
+    std::vector<MinorTimesCalculator::MinorTimesInfo> m_minor_times;
+
+    /**
+     * the geometry of the way version that is currently built and the
+     * geometry of the version that waits to be written
+     */
+    WayGeometry m_way, m_pending;
+
+    /**
+     * number of minor versions written and number of minor versions
+     * merged into the version before them, because their geometry did
+     * not change
+     */
+    uint64_t m_minorWritten, m_minorSuppressed;
+
+    bool m_debug, m_storeerrors, m_interior, m_keepLatLng;
+
+    /**
+     * the tags of the way version that is currently written and the user
+     * of the main version, encoded once for all of its rows
+     */
+    RowBuffer m_tagsField, m_mainUserField;
+
+    /**
+     * the user of the last minor version, encoded for its uid
+     */
+    RowBuffer m_minorUserField;
+    osm_user_id_t m_minorUserUid;
+    bool m_hasMinorUser;
+
+    /**
+     * the previous way version and the row buffers of the way version
+     * that is currently written
+     */
+    const Osmium::OSM::Way *m_prev;
+    RowBuffer *m_line_rows, *m_polygon_rows;
+
+    /**
+     * initial size of the buffers encoding a single field
+     */
+    static const size_t FIELD_CAPACITY = 1024;
+
+    const char* username(osm_user_id_t uid) {
+        username_map_t::const_iterator it = m_username_map->find(uid);
+        if(it == m_username_map->end()) {
+            return "";
+        }
+        return it->second.c_str();
+    }
+
+    /**
+     * the user with the given uid from the username map, encoded as field
+     */
+    const RowBuffer& minorUserField(osm_user_id_t uid) {
+        if(!m_hasMinorUser || m_minorUserUid != uid) {
+            m_minorUserField.clear();
+            m_minorUserField.addText(username(uid));
+            m_minorUserUid = uid;
+            m_hasMinorUser = true;
+        }
+        return m_minorUserField;
+    }
+
+    void write_way_to_db(
+        osm_object_id_t id,
+        osm_version_t version,
+        osm_version_t minor,
+        bool visible,
+        osm_user_id_t user_id,
+        const RowBuffer &user_field,
+        time_t timestamp,
+        time_t valid_from,
+        time_t valid_to,
+        long z_order,
+        const WayGeometry *geom
+    ) {
+        if(m_debug) {
+            std::cerr << "forging geometry of way " << id << 'v' << version << '.' << minor << " at tstamp " << timestamp << std::endl;
+        }
+
+        bool isPolygon = false;
+        if(visible) {
+            // the geometry has been built by the caller
+            if(!geom) {
+                if(m_debug) {
+                    std::cerr << "no valid geometry for way " << id << 'v' << version << '.' << minor << " at tstamp " << timestamp << std::endl;
+                }
+                return;
+            }
+
+            isPolygon = geom->isPolygon;
+        } else {
+            // this entity is deleted, we have no nd-refs and no tags from it to devide whether it once was a line or an areas
+            if(!m_prev || m_prev->id() != id) {
+                return;
+            }
+
+            // if we have a previous version of this way (which we should have or this way has already been deleted in its initial version)
+            // we can use the previous version to decide between line and area
+            const Osmium::OSM::Way *prev = m_prev;
+
+            bool looksLikePolygon = PolygonIdentifyer::looksLikePolygon(prev->tags());
+            if(!m_geom.forWay(prev->nodes(), prev->timestamp(), looksLikePolygon, m_way)) {
+                if(m_debug) {
+                    std::cerr << "no valid geometry for way of " << prev->id() << 'v' << prev->version() << " which was consulted to determine if the deleted way " <<
+                        id << "v" << version << " once was an area or a line. skipping that double-deleted way." << std::endl;
+                }
+                return;
+            }
+
+            isPolygon = m_way.isPolygon;
+        }
+
+        // calculate interior point, this is the only thing geos is needed for
+        bool hasCenter = false;
+        geos::geom::Coordinate center;
+        if(geom && isPolygon && m_interior) {
+            geos::geom::Geometry* geosGeom = NULL;
+            try {
+                geosGeom = geom->toGeos(900913);
+
+                // will leak with invalid geometries on old geos code:
+                //  http://trac.osgeo.org/geos/ticket/475
+                geos::algorithm::InteriorPointArea interior_calculator(geosGeom);
+                interior_calculator.getInteriorPoint(center);
+                hasCenter = true;
+            } catch(const geos::util::GEOSException& e) {
+                std::cerr << "error calculating interior point: " << e.what() << std::endl;
+            }
+            delete geosGeom;
+        }
+
+        RowBuffer& rows = isPolygon ? *m_polygon_rows : *m_line_rows;
+
+        rows.beginRow(isPolygon ? 13 : 11);
+        rows.addInt64(id);
+        rows.addInt16(version);
+        rows.addInt16(minor);
+        rows.addBool(visible);
+        rows.addInt32(user_id);
+        rows.addField(user_field);
+        rows.addTimestampOrNull(valid_from);
+        rows.addTimestampOrNull(valid_to);
+        rows.addField(m_tagsField);
+        rows.addInt32(z_order);
+
+        if(isPolygon) {
+            // a polygon, polygon-meta to table
+            rows.addReal(geom ? geom->area() : 0);
+        }
+
+        if(geom) {
+            rows.addWayGeometry(*geom, 900913);
+        } else {
+            rows.addNull();
+        }
+
+        if(isPolygon) {
+            if(hasCenter) {
+                rows.addPoint(center.x, center.y, 900913);
+            } else {
+                rows.addNull();
+            }
+        }
+
+        rows.endRow();
+    }
+
+public:
+    WayWriter(Nodestore *nodestore, DbAdapter *adapter, const username_map_t *usernames) :
+            m_store(nodestore),
+            m_adapter(adapter),
+            m_username_map(usernames),
+            m_geom(nodestore, adapter),
+            m_mtimes(nodestore, adapter),
+            m_minor_times(),
+            m_way(),
+            m_pending(),
+            m_minorWritten(0),
+            m_minorSuppressed(0),
+            m_debug(false),
+            m_storeerrors(false),
+            m_interior(false),
+            m_keepLatLng(false),
+            m_tagsField(NULL, FIELD_CAPACITY),
+            m_mainUserField(NULL, FIELD_CAPACITY),
+            m_minorUserField(NULL, FIELD_CAPACITY),
+            m_minorUserUid(0),
+            m_hasMinorUser(false),
+            m_prev(NULL),
+            m_line_rows(NULL),
+            m_polygon_rows(NULL) {}
+
+    /**
+     * create a new writer with the same settings as other, but with its
+     * own geometry builder
+     */
+    WayWriter(const WayWriter& other) :
+            m_store(other.m_store),
+            m_adapter(other.m_adapter),
+            m_username_map(other.m_username_map),
+            m_geom(other.m_store, other.m_adapter),
+            m_mtimes(other.m_store, other.m_adapter),
+            m_minor_times(),
+            m_way(),
+            m_pending(),
+            m_minorWritten(0),
+            m_minorSuppressed(0),
+            m_debug(false),
+            m_storeerrors(false),
+            m_interior(false),
+            m_keepLatLng(false),
+            m_tagsField(NULL, FIELD_CAPACITY),
+            m_mainUserField(NULL, FIELD_CAPACITY),
+            m_minorUserField(NULL, FIELD_CAPACITY),
+            m_minorUserUid(0),
+            m_hasMinorUser(false),
+            m_prev(NULL),
+            m_line_rows(NULL),
+            m_polygon_rows(NULL) {
+        printDebugMessages(other.m_debug);
+        printStoreErrors(other.m_storeerrors);
+        calculateInterior(other.m_interior);
+        keepLatLng(other.m_keepLatLng);
+        minorGranularity(other.m_mtimes.granularity());
+    }
+
+    bool isPrintingStoreErrors() {
+        return m_storeerrors;
+    }
+
+    void printStoreErrors(bool shouldPrintStoreErrors) {
+        m_storeerrors = shouldPrintStoreErrors;
+    }
+
+    bool isCalculatingInterior() {
+        return m_interior;
+    }
+
+    void calculateInterior(bool shouldCalculateInterior) {
+        m_interior = shouldCalculateInterior;
+    }
+
+    bool isKeepingLatLng() {
+        return m_keepLatLng;
+    }
+
+    void keepLatLng(bool shouldKeepLatLng) {
+        m_keepLatLng = shouldKeepLatLng;
+        m_geom.keepLatLng(shouldKeepLatLng);
+    }
+
+    time_t minorGranularity() {
+        return m_mtimes.granularity();
+    }
+
+    /**
+     * set the length of the time buckets in seconds, node changes in the
+     * same bucket make only one minor version
+     */
+    void minorGranularity(time_t seconds) {
+        m_mtimes.granularity(seconds);
+    }
+
+    /**
+     * number of minor versions written
+     */
+    uint64_t minorVersionsWritten() const {
+        return m_minorWritten;
+    }
+
+    /**
+     * number of minor versions that were not written, because their
+     * geometry was the same as the one of the version before them
+     */
+    uint64_t minorVersionsSuppressed() const {
+        return m_minorSuppressed;
+    }
+
+    bool isPrintingDebugMessages() {
+        return m_debug;
+    }
+
+    void printDebugMessages(bool shouldPrintDebugMessages) {
+        m_debug = shouldPrintDebugMessages;
+        m_geom.printDebugMessages(shouldPrintDebugMessages);
+    }
+
+    /**
+     * write the way version cur and its minor versions to the row buffers
+     *
+     * prev and next are the way versions before and after cur in the input
+     * and may be NULL. They are used to decide if a deleted way once was an
+     * area and to find the end of the validity of cur.
+     */
+    void write(const Osmium::OSM::Way *prev, const Osmium::OSM::Way *cur, const Osmium::OSM::Way *next, RowBuffer& line_rows, RowBuffer& polygon_rows) {
+        m_prev = prev;
+        m_line_rows = &line_rows;
+        m_polygon_rows = &polygon_rows;
+
+        bool next_is_same_entity = next && next->id() == cur->id();
+
+        // the fields that are the same for all rows of this way version
+        if(m_tagsField.isBinary() != line_rows.isBinary()) {
+            m_tagsField.binary(line_rows.isBinary());
+            m_mainUserField.binary(line_rows.isBinary());
+            m_minorUserField.binary(line_rows.isBinary());
+            m_hasMinorUser = false;
+        }
+        m_tagsField.clear();
+        m_tagsField.addHStore(cur->tags());
+        m_mainUserField.clear();
+        m_mainUserField.addText(cur->user());
+
+        if(m_debug) {
+            std::cout << "way w" << cur->id() << 'v' << cur->version() << " at tstamp " << cur->timestamp() << " (" << Timestamp::format(cur->timestamp()) << ")" << std::endl;
+        }
+
+        // the end of the validity of cur and its last minor version
+        time_t until = next_is_same_entity ? next->timestamp() : 0;
+
+        if(!cur->visible()) {
+            // if the current version is deleted, it's end-timestamp is the same as its creation-timestamp
+            write_way_to_db(
+                cur->id(),
+                cur->version(),
+                0 /*minor*/,
+                false,
+                cur->uid(),
+                m_mainUserField,
+                cur->timestamp(),
+                cur->timestamp(),
+                next_is_same_entity ? until : cur->timestamp(),
+                ZOrderCalculator::calculateZOrder(cur->tags()),
+                NULL
+            );
+
+            m_prev = NULL;
+            m_line_rows = m_polygon_rows = NULL;
+            return;
+        }
+
+        bool hasMinorTimes = false;
+        if(next_is_same_entity) {
+            if(cur->timestamp() > next->timestamp()) {
+                if(m_storeerrors) {
+                    std::cerr << "inverse timestamp-order in way " << cur->id() << " between v" << cur->version() << " and v" << next->version() << ", skipping minor ways" << std::endl;
+                }
+            } else {
+                // collect minor ways between current and next
+                m_mtimes.forWay(cur->nodes(), cur->timestamp(), next->timestamp(), m_minor_times);
+                hasMinorTimes = true;
+            }
+        } else {
+            // collect minor ways between current and the end
+            m_mtimes.forWay(cur->nodes(), cur->timestamp(), m_minor_times);
+            hasMinorTimes = true;
+        }
+
+        // the tags are the same for all minor versions, so they are classified once
+        bool looksLikePolygon = PolygonIdentifyer::looksLikePolygon(cur->tags());
+        long z_order = ZOrderCalculator::calculateZOrder(cur->tags());
+
+        // build the geometry of the main way version, the minor versions are built from it
+        bool hasGeom = m_geom.begin(cur->nodes(), cur->timestamp(), until, looksLikePolygon, m_way);
+
+        // a version is only written, when the version after it is known, so
+        // versions with an unchanged geometry can be merged into it
+        std::swap(m_way, m_pending);
+        bool pendingHasGeom = hasGeom;
+        osm_version_t pendingMinor = 0;
+        osm_user_id_t pendingUid = cur->uid();
+        const RowBuffer *pendingUser = &m_mainUserField;
+        time_t pendingFrom = cur->timestamp();
+
+        if(hasMinorTimes) {
+            std::vector<MinorTimesCalculator::MinorTimesInfo>::const_iterator end = m_minor_times.end();
+            for(std::vector<MinorTimesCalculator::MinorTimesInfo>::const_iterator it = m_minor_times.begin(); it != end; it++) {
+                time_t t = (*it).t;
+
+                // move the nodes that changed until t
+                hasGeom = m_geom.advance(t, m_way);
+
+                // only tags changed or the nodes moved back and forth: the
+                // pending version stays valid
+                if(hasGeom == pendingHasGeom && (!hasGeom || m_way.equals(m_pending))) {
+                    if(hasGeom) {
+                        m_minorSuppressed++;
+                    }
+                    continue;
+                }
+
+                write_way_to_db(cur->id(), cur->version(), pendingMinor, true, pendingUid, *pendingUser, pendingFrom, pendingFrom, t, z_order, pendingHasGeom ? &m_pending : NULL);
+                if(pendingMinor > 0 && pendingHasGeom) {
+                    m_minorWritten++;
+                }
+
+                std::swap(m_way, m_pending);
+                pendingHasGeom = hasGeom;
+                pendingMinor++;
+                pendingUid = (*it).uid;
+                pendingUser = &minorUserField(pendingUid);
+                pendingFrom = t;
+
+                if(m_debug) {
+                    std::cout << "minor way w" << cur->id() << 'v' << cur->version() << '.' << pendingMinor << " at tstamp " << t << " (" << Timestamp::format(t) << ")" << std::endl;
+                }
+            }
+        }
+
+        write_way_to_db(cur->id(), cur->version(), pendingMinor, true, pendingUid, *pendingUser, pendingFrom, pendingFrom, until, z_order, pendingHasGeom ? &m_pending : NULL);
+        if(pendingMinor > 0 && pendingHasGeom) {
+            m_minorWritten++;
+        }
+
+        m_prev = NULL;
+        m_line_rows = m_polygon_rows = NULL;
+    }
+};
+
+#endif // IMPORTER_WAYWRITER_HPP
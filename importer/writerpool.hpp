@@ -0,0 +1,306 @@
+/**
+ * Building the geometries of the ways and their minor versions is the
+ * most expensive part of the import. The WriterPool spreads this work over
+ * a number of worker threads, each with its own WayWriter. The nodestore
+ * is complete when the ways are read, so it's only read by the workers.
+ * The same is done for the multipolygon relations with RelationWriters,
+ * which additionally read the waystore, that is complete when the
+ * relations are read.
+ *
+ * The way versions are collected into batches. While the workers process
+ * one batch, the handler fills the next one. Every worker encodes the rows
+ * of the way versions it took from the batch into its own row buffers and
+ * remembers, which bytes belong to which way version. When the batch is
+ * done, these bytes are copied into the row buffers of the COPY pipes in
+ * the order of the input, so the COPY pipes receive exactly the same rows,
+ * in the same order as when the ways are written one after another.
+ */
+
+#ifndef IMPORTER_WRITERPOOL_HPP
+#define IMPORTER_WRITERPOOL_HPP
+
+#include <pthread.h>
+#include <vector>
+
+#include "dbshardedcopyconn.hpp"
+#include "rowbuffer.hpp"
+
+/**
+ * Writes versions of TObject with TWriters using multiple threads
+ *
+ * TWriter needs a copy constructor taking over the settings and a method
+ * write(prev, cur, next, line_rows, polygon_rows) like WayWriter::write.
+ */
+template <class TObject, class TWriter>
+class WriterPool {
+private:
+    /**
+     * number of versions in one batch
+     */
+    static const size_t BATCH_SIZE = 4096;
+
+    /**
+     * a version to be written, with its neighbours in the input
+     */
+    struct Job {
+        shared_ptr<TObject const> prev, cur, next;
+
+        /**
+         * the worker that wrote the rows and the ranges of the rows in
+         * its line and polygon buffers
+         */
+        size_t worker;
+        size_t lineStart, lineEnd, polygonStart, polygonEnd;
+    };
+
+    /**
+     * a worker thread with its own writer and row buffers
+     */
+    struct Worker {
+        WriterPool *pool;
+        size_t index;
+        pthread_t thread;
+        TWriter writer;
+        RowBuffer line_rows, polygon_rows;
+
+        Worker(WriterPool *p, size_t i, const TWriter& prototype) :
+                pool(p),
+                index(i),
+                thread(),
+                writer(prototype),
+                line_rows(NULL),
+                polygon_rows(NULL) {}
+    };
+
+    DbShardedCopyConn *m_line, *m_polygon;
+    std::vector<Worker*> m_workers;
+
+    /**
+     * the batch that is filled and the batch that is processed
+     */
+    std::vector<Job> m_batches[2];
+    std::vector<Job> *m_filling, *m_processing;
+
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_work, m_done;
+
+    /**
+     * counts the submitted batches, so the workers can tell a new batch
+     * from a spurious wakeup
+     */
+    unsigned long m_generation;
+
+    /**
+     * the next job of the processed batch that has not yet been taken
+     */
+    size_t m_nextJob;
+
+    /**
+     * number of workers still working on the processed batch
+     */
+    size_t m_running;
+
+    bool m_shutdown;
+
+    static void* run(void *arg) {
+        Worker *worker = static_cast< Worker* >(arg);
+        worker->pool->work(worker);
+        return NULL;
+    }
+
+    void work(Worker *worker) {
+        unsigned long generation = 0;
+
+        pthread_mutex_lock(&m_mutex);
+        while(true) {
+            while(!m_shutdown && m_generation == generation) {
+                pthread_cond_wait(&m_work, &m_mutex);
+            }
+            if(m_shutdown) {
+                break;
+            }
+            generation = m_generation;
+
+            while(m_nextJob < m_processing->size()) {
+                Job& job = (*m_processing)[m_nextJob++];
+                pthread_mutex_unlock(&m_mutex);
+
+                job.worker = worker->index;
+                job.lineStart = worker->line_rows.size();
+                job.polygonStart = worker->polygon_rows.size();
+
+                worker->writer.write(job.prev.get(), job.cur.get(), job.next.get(), worker->line_rows, worker->polygon_rows);
+
+                job.lineEnd = worker->line_rows.size();
+                job.polygonEnd = worker->polygon_rows.size();
+
+                pthread_mutex_lock(&m_mutex);
+            }
+
+            if(--m_running == 0) {
+                pthread_cond_signal(&m_done);
+            }
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /**
+     * hand the filled batch to the workers
+     */
+    void submit() {
+        std::swap(m_filling, m_processing);
+
+        pthread_mutex_lock(&m_mutex);
+        for(size_t i = 0; i < m_workers.size(); i++) {
+            m_workers[i]->line_rows.clear();
+            m_workers[i]->polygon_rows.clear();
+        }
+        m_nextJob = 0;
+        m_running = m_workers.size();
+        m_generation++;
+        pthread_cond_broadcast(&m_work);
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /**
+     * wait for the processed batch and copy its rows to the COPY pipes
+     */
+    void collect() {
+        if(m_processing->empty()) {
+            return;
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        while(m_running > 0) {
+            pthread_cond_wait(&m_done, &m_mutex);
+        }
+        pthread_mutex_unlock(&m_mutex);
+
+        typename std::vector<Job>::const_iterator end = m_processing->end();
+        for(typename std::vector<Job>::const_iterator it = m_processing->begin(); it != end; ++it) {
+            Worker *worker = m_workers[it->worker];
+            osm_object_id_t id = it->cur->id();
+            m_line->rows(id).appendRows(worker->line_rows.data() + it->lineStart, it->lineEnd - it->lineStart);
+            m_polygon->rows(id).appendRows(worker->polygon_rows.data() + it->polygonStart, it->polygonEnd - it->polygonStart);
+        }
+
+        m_processing->clear();
+    }
+
+public:
+    /**
+     * create a pool of threads workers, each with a copy of the prototype
+     * writer, writing to the opened line and polygon COPY pipes
+     */
+    WriterPool(size_t threads, const TWriter& prototype, DbShardedCopyConn *line, DbShardedCopyConn *polygon) :
+            m_line(line),
+            m_polygon(polygon),
+            m_workers(),
+            m_filling(&m_batches[0]),
+            m_processing(&m_batches[1]),
+            m_generation(0),
+            m_nextJob(0),
+            m_running(0),
+            m_shutdown(false) {
+        pthread_mutex_init(&m_mutex, NULL);
+        pthread_cond_init(&m_work, NULL);
+        pthread_cond_init(&m_done, NULL);
+
+        m_filling->reserve(BATCH_SIZE);
+        m_processing->reserve(BATCH_SIZE);
+
+        for(size_t i = 0; i < threads; i++) {
+            Worker *worker = new Worker(this, i, prototype);
+            worker->line_rows.binary(line->isBinary());
+            worker->polygon_rows.binary(polygon->isBinary());
+
+            if(pthread_create(&worker->thread, NULL, &WriterPool::run, worker) != 0) {
+                delete worker;
+                throw std::runtime_error("can't start writer thread");
+            }
+            m_workers.push_back(worker);
+        }
+    }
+
+    ~WriterPool() {
+        pthread_mutex_lock(&m_mutex);
+        m_shutdown = true;
+        pthread_cond_broadcast(&m_work);
+        pthread_mutex_unlock(&m_mutex);
+
+        for(size_t i = 0; i < m_workers.size(); i++) {
+            pthread_join(m_workers[i]->thread, NULL);
+            delete m_workers[i];
+        }
+
+        pthread_cond_destroy(&m_done);
+        pthread_cond_destroy(&m_work);
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    /**
+     * queue the version cur for writing
+     */
+    void add(const shared_ptr<TObject const>& prev, const shared_ptr<TObject const>& cur, const shared_ptr<TObject const>& next) {
+        m_filling->push_back(Job());
+        Job &job = m_filling->back();
+        job.prev = prev;
+        job.cur = cur;
+        job.next = next;
+
+        if(m_filling->size() >= BATCH_SIZE) {
+            collect();
+            submit();
+        }
+    }
+
+    /**
+     * number of rows written by all workers, see
+     * RelationWriter::versionsWritten
+     */
+    uint64_t versionsWritten() {
+        uint64_t count = 0;
+        for(size_t i = 0; i < m_workers.size(); i++) {
+            count += m_workers[i]->writer.versionsWritten();
+        }
+        return count;
+    }
+
+    /**
+     * number of minor versions written by all workers, see
+     * TWriter::minorVersionsWritten
+     */
+    uint64_t minorVersionsWritten() {
+        uint64_t count = 0;
+        for(size_t i = 0; i < m_workers.size(); i++) {
+            count += m_workers[i]->writer.minorVersionsWritten();
+        }
+        return count;
+    }
+
+    /**
+     * number of minor versions suppressed by all workers, see
+     * TWriter::minorVersionsSuppressed
+     */
+    uint64_t minorVersionsSuppressed() {
+        uint64_t count = 0;
+        for(size_t i = 0; i < m_workers.size(); i++) {
+            count += m_workers[i]->writer.minorVersionsSuppressed();
+        }
+        return count;
+    }
+
+    /**
+     * write all queued versions and wait until their rows are in
+     * the row buffers
+     */
+    void finish() {
+        collect();
+        if(!m_filling->empty()) {
+            submit();
+            collect();
+        }
+    }
+};
+
+#endif // IMPORTER_WRITERPOOL_HPP
@@ -10,6 +10,8 @@
 #ifndef IMPORTER_ZORDERCALCULATOR_HPP
 #define IMPORTER_ZORDERCALCULATOR_HPP
 
+#include "perfecthash.hpp"
+
 /**
  * Data to generate z-order column and lowzoom-table
  * This includes railways and administrative boundaries, too.
@@ -46,6 +48,25 @@ static struct {
  */
 class ZOrderCalculator {
 private:
+    /**
+     * perfect hash over the highway values of the layers list, see
+     * perfecthash.hpp
+     */
+    typedef PerfectHash<16, 2, 0, 9> HighwayHash;
+
+    static const HighwayHash& highwayHash() {
+        static const HighwayHash hash = buildHighwayHash();
+        return hash;
+    }
+
+    static HighwayHash buildHighwayHash() {
+        HighwayHash hash;
+        for(int i = 0; layers[i].highway != 0; i++) {
+            hash.add(layers[i].highway, i);
+        }
+        return hash;
+    }
+
     /**
      * different tag-values can make up a true-value: "1", "yes", "true"
      * this method checks all those values against the tag-value
@@ -69,13 +90,30 @@ public:
         int lowzoom = false;
 
         // shorthands to the values of different keys, contributing to
-        // the z-order calculation
-        const char *layer = tags.get_value_by_key("layer");
-        const char *highway = tags.get_value_by_key("highway");
-        const char *bridge = tags.get_value_by_key("bridge");
-        const char *tunnel = tags.get_value_by_key("tunnel");
-        const char *railway = tags.get_value_by_key("railway");
-        const char *boundary = tags.get_value_by_key("boundary");
+        // the z-order calculation, collected in one pass over the tags
+        const char *layer = NULL, *highway = NULL, *bridge = NULL, *tunnel = NULL, *railway = NULL, *boundary = NULL;
+        for(Osmium::OSM::TagList::const_iterator it = tags.begin(); it != tags.end(); ++it) {
+            // like get_value_by_key, the first tag with a key wins
+            const char *key = it->key();
+            switch(key[0]) {
+                case 'l':
+                    if(!layer && 0 == strcmp(key, "layer")) layer = it->value();
+                    break;
+                case 'h':
+                    if(!highway && 0 == strcmp(key, "highway")) highway = it->value();
+                    break;
+                case 'b':
+                    if(!bridge && 0 == strcmp(key, "bridge")) bridge = it->value();
+                    else if(!boundary && 0 == strcmp(key, "boundary")) boundary = it->value();
+                    break;
+                case 't':
+                    if(!tunnel && 0 == strcmp(key, "tunnel")) tunnel = it->value();
+                    break;
+                case 'r':
+                    if(!railway && 0 == strcmp(key, "railway")) railway = it->value();
+                    break;
+            }
+        }
 
         // if the way has a layer-tag
         if(layer) {
@@ -86,17 +124,13 @@ public:
         // if it has a highway tag
         if(highway) {
 
-            // iterate over the list of known highway-values
-            for(int i = 0; layers[i].highway != 0; i++) {
+            // look for a matching known value
+            int i = highwayHash().find(highway);
+            if(i >= 0) {
 
-                // look for a matching known value
-                if(0 == strcmp(layers[i].highway, highway)) {
-
-                    // and copy over its offset & lowzoom value
-                    z_order   += layers[i].offset;
-                    lowzoom   = layers[i].lowzoom;
-                    break;
-                }
+                // and copy over its offset & lowzoom value
+                z_order   += layers[i].offset;
+                lowzoom   = layers[i].lowzoom;
             }
         }
 
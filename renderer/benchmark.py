@@ -0,0 +1,87 @@
+#!/usr/bin/python
+#
+# time the queries the renderer sends for a date and a bbox against the
+# tables of one or two databases, eg. one imported with the default and
+# one imported with the partitioned scheme
+#
+
+import psycopg2
+from optparse import OptionParser
+import sys, time
+import render
+
+def main():
+    parser = OptionParser()
+    parser.add_option("-D", "--db", action="store", type="string", dest="dsn", default="",
+                      help="database connection string of a database imported with the default scheme")
+
+    parser.add_option("-R", "--partitioned-db", action="store", type="string", dest="partitioneddsn", default="",
+                      help="database connection string of a database imported with the partitioned scheme (importer --partitioned)")
+
+    parser.add_option("-P", "--dbprefix", action="store", type="string", dest="dbprefix", default="hist",
+                      help="database table prefix of imported tables [default: %default]")
+
+    parser.add_option("-d", "--dates", action="store", type="string", dest="dates", default="2008-01-01 00:00:00,2011-01-01 00:00:00,2014-01-01 00:00:00",
+                      help="comma separated list of dates to query, format 'YYYY-MM-DD HH:II:SS' [default: %default]")
+
+    parser.add_option("-b", "--bboxes", action="store", type="string", dest="bboxes", default="-180,-85,180,85;5.17,48.17,11.21,51.34;8.1457,49.7594,8.2401,49.809",
+                      help="semicolon separated list of bounding boxes to query in the format l,b,r,t [default: %default]")
+
+    parser.add_option("-n", "--repeat", action="store", type="int", dest="repeat", default=3,
+                      help="run each query this often and report the fastest run [default: %default]")
+
+    (options, args) = parser.parse_args()
+
+    if not options.dsn and not options.partitioneddsn:
+        print "at least one of --db and --partitioned-db is required"
+        print
+        parser.print_help()
+        sys.exit(1)
+
+    dates = options.dates.split(",")
+    try:
+        bboxes = [map(float, bbox.split(",")) for bbox in options.bboxes.split(";")]
+    except ValueError, err:
+        print "invalid bbox:", options.bboxes
+        sys.exit(1)
+
+    schemes = []
+    if options.dsn:
+        schemes.append(("default", psycopg2.connect(options.dsn), False))
+    if options.partitioneddsn:
+        schemes.append(("partitioned", psycopg2.connect(options.partitioneddsn), True))
+
+    print "%-8s  %-19s  %-40s  %s" % ("table", "date", "bbox", "  ".join(["%12s %9s" % (name, "rows") for (name, con, partitioned) in schemes]))
+    for table in ("point", "line", "polygon"):
+        for date in dates:
+            for bbox in bboxes:
+                results = []
+                for (name, con, partitioned) in schemes:
+                    (seconds, rows) = measure(con, options.dbprefix, table, date, bbox, partitioned, options.repeat)
+                    results.append("%10.3f s %9d" % (seconds, rows))
+
+                print "%-8s  %-19s  %-40s  %s" % (table, date, ",".join(["%g" % c for c in bbox]), "  ".join(results))
+
+    for (name, con, partitioned) in schemes:
+        con.close()
+
+def measure(con, dbprefix, table, date, bbox, partitioned, repeat):
+    cur = con.cursor()
+
+    # the same condition as the views of the renderer, and the bbox mapnik adds to it
+    sql = "SELECT count(*) FROM %s_%s WHERE %s AND geom && ST_Transform(ST_SetSRID(ST_MakeBox2D(ST_Point(%f, %f), ST_Point(%f, %f)), 4326), 900913)" % (dbprefix, table, render.valid_at(date, partitioned), bbox[0], bbox[1], bbox[2], bbox[3])
+
+    best = None
+    for i in range(repeat):
+        start = time.time()
+        cur.execute(sql)
+        rows = cur.fetchone()[0]
+        seconds = time.time() - start
+        if best is None or seconds < best:
+            best = seconds
+
+    cur.close()
+    return (best, rows)
+
+if __name__ == "__main__":
+    main()
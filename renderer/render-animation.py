@@ -69,6 +69,9 @@ def main():
     parser.add_option("-P", "--dbprefix", action="store", type="string", dest="dbprefix", default="hist", 
                       help="database table prefix used for auto-infering animation start [default: %default]")
     
+    parser.add_option("-r", "--partitioned", action="store_true", dest="partitioned", default=False, 
+                      help="the tables were created with the partitioned scheme (importer --partitioned), query their validity ranges")
+    
     (options, args) = parser.parse_args()
     
     if options.size:
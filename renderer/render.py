@@ -62,6 +62,9 @@ def main():
     parser.add_option("-P", "--dbprefix", action="store", type="string", dest="dbprefix", default="hist", 
                       help="database table prefix of imported tables, used for view creation [default: %default]")
     
+    parser.add_option("-r", "--partitioned", action="store_true", dest="partitioned", default=False, 
+                      help="the tables were created with the partitioned scheme (importer --partitioned), query their validity ranges")
+    
     
     (options, args) = parser.parse_args()
     
@@ -104,7 +107,7 @@ def render(options):
         if(options.extracolumns):
             columns += options.extracolumns.split(',')
         
-        create_views(options.dsn, options.dbprefix, options.viewprefix, options.viewhstore, columns, options.date)
+        create_views(options.dsn, options.dbprefix, options.viewprefix, options.viewhstore, columns, options.date, options.partitioned)
     
     # create map
     m = mapnik.Map(options.size[0], options.size[1])
@@ -231,7 +234,14 @@ def zoom2size(bbox, zoom):
     
     return (wp, hp)
 
-def create_views(dsn, dbprefix, viewprefix, hstore, columns, date):
+def valid_at(date, partitioned):
+    if partitioned:
+        # the condition on valid_from lets the database skip the partitions of later years
+        return "valid_from <= '%s' AND valid @> '%s'::timestamp" % (date, date)
+    
+    return "'%s' BETWEEN valid_from AND COALESCE(valid_to, '9999-12-31')" % (date)
+
+def create_views(dsn, dbprefix, viewprefix, hstore, columns, date, partitioned=False):
     con = psycopg2.connect(dsn)
     cur = con.cursor()
     
@@ -239,23 +249,25 @@ def create_views(dsn, dbprefix, viewprefix, hstore, columns, date):
     for column in columns:
         columselect += "tags->'%s' AS \"%s\", " % (column, column)
     
+    where = valid_at(date, partitioned)
+    
     cur.execute("DELETE FROM geometry_columns WHERE f_table_catalog = '' AND f_table_schema = 'public' AND f_table_name IN ('%s_point', '%s_line', '%s_roads', '%s_polygon');" % (viewprefix, viewprefix, viewprefix, viewprefix))
     
     cur.execute("DROP VIEW IF EXISTS %s_point" % (viewprefix))
-    cur.execute("CREATE OR REPLACE VIEW %s_point AS SELECT id AS osm_id, %s geom AS way FROM %s_point WHERE '%s' BETWEEN valid_from AND COALESCE(valid_to, '9999-12-31');" % (viewprefix, columselect, dbprefix, date))
+    cur.execute("CREATE OR REPLACE VIEW %s_point AS SELECT id AS osm_id, %s geom AS way FROM %s_point WHERE %s;" % (viewprefix, columselect, dbprefix, where))
     cur.execute("INSERT INTO geometry_columns (f_table_catalog, f_table_schema, f_table_name, f_geometry_column, coord_dimension, srid, type) VALUES ('', 'public', '%s_point', 'way', 2, 900913, 'POINT');" % (viewprefix))
     
     cur.execute("DROP VIEW IF EXISTS %s_line" % (viewprefix))
-    cur.execute("CREATE OR REPLACE VIEW %s_line AS SELECT id AS osm_id, %s z_order, geom AS way FROM %s_line WHERE '%s' BETWEEN valid_from AND COALESCE(valid_to, '9999-12-31');" % (viewprefix, columselect, dbprefix, date))
+    cur.execute("CREATE OR REPLACE VIEW %s_line AS SELECT id AS osm_id, %s z_order, geom AS way FROM %s_line WHERE %s;" % (viewprefix, columselect, dbprefix, where))
     cur.execute("INSERT INTO geometry_columns (f_table_catalog, f_table_schema, f_table_name, f_geometry_column, coord_dimension, srid, type) VALUES ('', 'public', '%s_line', 'way', 2, 900913, 'LINESTRING');" % (viewprefix))
     
     cur.execute("DROP VIEW IF EXISTS %s_roads" % (viewprefix))
-    cur.execute("CREATE OR REPLACE VIEW %s_roads AS SELECT id AS osm_id, %s z_order, geom AS way FROM %s_line WHERE '%s' BETWEEN valid_from AND COALESCE(valid_to, '9999-12-31');" % (viewprefix, columselect, dbprefix, date))
+    cur.execute("CREATE OR REPLACE VIEW %s_roads AS SELECT id AS osm_id, %s z_order, geom AS way FROM %s_line WHERE %s;" % (viewprefix, columselect, dbprefix, where))
     cur.execute("INSERT INTO geometry_columns (f_table_catalog, f_table_schema, f_table_name, f_geometry_column, coord_dimension, srid, type) VALUES ('', 'public', '%s_roads', 'way', 2, 900913, 'LINESTRING');" % (viewprefix))
     
     cur.execute("DROP VIEW IF EXISTS %s_polygon" % (viewprefix))
-    cur.execute("CREATE OR REPLACE VIEW %s_polygon AS SELECT id AS osm_id, %s z_order, area AS way_area, geom AS way FROM %s_polygon WHERE '%s' BETWEEN valid_from AND COALESCE(valid_to, '9999-12-31');" % (viewprefix, columselect, dbprefix, date))
-    cur.execute("INSERT INTO geometry_columns (f_table_catalog, f_table_schema, f_table_name, f_geometry_column, coord_dimension, srid, type) VALUES ('', 'public', '%s_polygon', 'way', 2, 900913, 'POLYGON');" % (viewprefix))
+    cur.execute("CREATE OR REPLACE VIEW %s_polygon AS SELECT id AS osm_id, %s z_order, area AS way_area, geom AS way FROM %s_polygon WHERE %s;" % (viewprefix, columselect, dbprefix, where))
+    cur.execute("INSERT INTO geometry_columns (f_table_catalog, f_table_schema, f_table_name, f_geometry_column, coord_dimension, srid, type) VALUES ('', 'public', '%s_polygon', 'way', 2, 900913, 'GEOMETRY');" % (viewprefix))
     
     con.commit()
     cur.close()